@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "acl.h"
+
+#define ACL_ALL		0xffff		/* every request type */
+#define ACL_LINE_MAX	512
+
+/* addresses are 128 bit integers, IPv4 ones mapped into ::ffff:0:0/96 */
+typedef unsigned __int128 acl_key;
+
+#define KEY_BITS	128
+#define V4_MAPPED	((acl_key)0xffff << 32)
+
+/*
+ * Path-compressed binary radix trie: each node stands for a prefix of
+ * $len bits, and its children for the longer prefixes continuing it with a
+ * 0 or a 1 bit. Nodes with a single child are only kept where a prefix of
+ * the ACL ends, so a lookup visits at most one node per prefix containing
+ * the address, plus one where the paths split. All nodes live in one array,
+ * linked by index.
+ */
+struct acl_node {
+	acl_key		prefix;		/* bits past $len are zero */
+	uint8_t		len;
+	bool		terminal;	/* a prefix of the ACL ends here */
+	uint16_t	allow;		/* bit 1 << type for every allowed type */
+	int32_t		child[2];	/* -1 if none */
+};
+
+struct acl {
+	struct acl_node	*nodes;
+	int32_t		nnodes, size;
+	int32_t		root;		/* -1 while empty */
+	struct acl	*retired;	/* ACL this one replaced */
+};
+
+/*
+ * Lookups never take a lock: a reload swaps in a complete trie, and the one
+ * it replaces is kept until acl_unload(), as lookups may still be in it.
+ * Reloads are rare and ACLs small.
+ */
+static _Atomic(struct acl *) current;
+
+static acl_key key_mask(int len)
+{
+	return len == 0 ? 0 : ~(acl_key)0 << (KEY_BITS - len);
+}
+
+static int key_bit(acl_key key, int i)
+{
+	return (key >> (KEY_BITS - 1 - i)) & 1;
+}
+
+/* length of the prefix $a and $b share, up to $max bits */
+static int common_len(acl_key a, acl_key b, int max)
+{
+	acl_key x = a ^ b;
+	uint64_t hi = x >> 64, lo = x;
+	int n;
+
+	if (hi)
+		n = __builtin_clzll(hi);
+	else if (lo)
+		n = 64 + __builtin_clzll(lo);
+	else
+		n = KEY_BITS;
+	return MIN(n, max);
+}
+
+static acl_key key_from_bytes(const unsigned char *bytes)
+{
+	acl_key key = 0;
+
+	for (int i = 0; i < 16; ++i)
+		key = key << 8 | bytes[i];
+	return key;
+}
+
+static acl_key key_from_addr(const struct sockaddr_storage *addr)
+{
+	if (addr->ss_family == AF_INET)
+		return V4_MAPPED | ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+	return key_from_bytes(((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr);
+}
+
+/* append a node to $acl, returning its index or -1 */
+static int32_t new_node(struct acl *acl, acl_key prefix, int len)
+{
+	struct acl_node *nodes;
+
+	if (acl->nnodes == acl->size) {
+		nodes = realloc(acl->nodes, (acl->size * 2 + 16) * sizeof(*nodes));
+		if (!nodes)
+			return -1;
+		acl->nodes = nodes;
+		acl->size = acl->size * 2 + 16;
+	}
+	acl->nodes[acl->nnodes] = (struct acl_node){
+		.prefix = prefix & key_mask(len), .len = len, .child = { -1, -1 }
+	};
+	return acl->nnodes++;
+}
+
+/* allow the types in $allow from $prefix/$len, returns -1 if out of memory */
+static int insert(struct acl *acl, acl_key prefix, int len, uint16_t allow)
+{
+	int32_t idx = acl->root, parent = -1, split, leaf;
+	struct acl_node *n;
+	int pbit = 0, common = 0;
+
+	prefix &= key_mask(len);
+	while (idx != -1) {
+		n = &acl->nodes[idx];
+		common = common_len(prefix, n->prefix, MIN(len, n->len));
+		if (common < n->len)
+			break;		/* the node has to be split */
+		if (len == n->len) {
+			n->terminal = true;
+			n->allow |= allow;
+			return 0;
+		}
+		parent = idx;
+		pbit = key_bit(prefix, n->len);
+		idx = n->child[pbit];
+	}
+
+	if ((leaf = new_node(acl, prefix, len)) == -1)
+		return -1;
+	acl->nodes[leaf].terminal = true;
+	acl->nodes[leaf].allow = allow;
+	split = leaf;
+	if (idx != -1) {
+		n = &acl->nodes[idx];
+		if (common == len) {
+			/* the new prefix contains the node's */
+			acl->nodes[leaf].child[key_bit(n->prefix, len)] = idx;
+		} else {
+			/* both continue a shorter prefix, which becomes their parent */
+			if ((split = new_node(acl, prefix, common)) == -1)
+				return -1;
+			n = &acl->nodes[idx];
+			acl->nodes[split].child[key_bit(prefix, common)] = leaf;
+			acl->nodes[split].child[key_bit(n->prefix, common)] = idx;
+		}
+	}
+	if (parent == -1)
+		acl->root = split;
+	else
+		acl->nodes[parent].child[pbit] = split;
+	return 0;
+}
+
+/* parse prefix $str (address[/len]) into $key and $len */
+static int parse_prefix(char *str, acl_key *key, int *len)
+{
+	unsigned char bytes[16] = { 0 };
+	char *slash = strchr(str, '/'), *end;
+	struct in_addr in;
+	int max;
+
+	if (slash)
+		*slash = '\0';
+	if (inet_pton(AF_INET, str, &in) == 1) {
+		*key = V4_MAPPED | ntohl(in.s_addr);
+		max = 32;
+	} else if (inet_pton(AF_INET6, str, bytes) == 1) {
+		*key = key_from_bytes(bytes);
+		max = KEY_BITS;
+	} else {
+		return -1;
+	}
+	*len = max;
+	if (slash) {
+		errno = 0;
+		*len = strtol(slash + 1, &end, 10);
+		if (errno || end == slash + 1 || *end || *len < 0 || *len > max)
+			return -1;
+	}
+	/* IPv4 prefixes are prefixes of ::ffff:0:0/96 */
+	if (max == 32)
+		*len += KEY_BITS - 32;
+	return 0;
+}
+
+static void acl_free(struct acl *acl)
+{
+	struct acl *next;
+
+	for (; acl; acl = next) {
+		next = acl->retired;
+		free(acl->nodes);
+		free(acl);
+	}
+}
+
+int acl_load(const char *path)
+{
+	char line[ACL_LINE_MAX], *tok, *save;
+	struct acl *acl;
+	uint16_t allow, type;
+	acl_key key;
+	int len, lineno = 0, ret = -1;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "error opening ACL '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if ((acl = calloc(1, sizeof(*acl))) == NULL) {
+		perror("error allocating ACL");
+		goto out;
+	}
+	acl->root = -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		++lineno;
+		line[strcspn(line, "#\n")] = '\0';
+		if ((tok = strtok_r(line, " \t", &save)) == NULL)
+			continue;
+		if (parse_prefix(tok, &key, &len) == -1) {
+			fprintf(stderr, "%s:%d: invalid prefix '%s'\n", path, lineno, tok);
+			goto out;
+		}
+		allow = 0;
+		while ((tok = strtok_r(NULL, " \t,", &save)) != NULL) {
+			if (!strcasecmp(tok, "all")) {
+				allow = ACL_ALL;
+			} else if (parse_request(&type, tok) == 0) {
+				allow |= 1 << type;
+			} else {
+				fprintf(stderr, "%s:%d: invalid request '%s'\n", path, lineno, tok);
+				goto out;
+			}
+		}
+		if (insert(acl, key, len, allow) == -1) {
+			perror("error allocating ACL");
+			goto out;
+		}
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "error reading ACL '%s'\n", path);
+		goto out;
+	}
+
+	acl->retired = atomic_exchange(&current, acl);
+	acl = NULL;
+	ret = 0;
+	PDEBUG("[+] loaded ACL '%s'\n", path);
+out:
+	acl_free(acl);
+	fclose(fp);
+	return ret;
+}
+
+void acl_unload(void)
+{
+	acl_free(atomic_exchange(&current, NULL));
+}
+
+int acl_check(const struct sockaddr_storage *addr, uint16_t req_type)
+{
+	struct acl *acl = atomic_load_explicit(&current, memory_order_acquire);
+	const struct acl_node *n;
+	acl_key key;
+	int32_t idx;
+	int allow = -1;
+
+	if (!acl)
+		return ACL_ALLOW;
+	key = key_from_addr(addr);
+	for (idx = acl->root; idx != -1; idx = n->child[key_bit(key, n->len)]) {
+		n = &acl->nodes[idx];
+		if ((key & key_mask(n->len)) != n->prefix)
+			break;
+		if (n->terminal)
+			allow = n->allow;
+		if (n->len == KEY_BITS)
+			break;
+	}
+	if (allow == -1)
+		return ACL_DENIED;
+	req_type &= ~REQ_FLAG_BITS;
+	return req_type < 16 && (allow & 1 << req_type) ? ACL_ALLOW : ACL_DISABLED;
+}
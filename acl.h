@@ -0,0 +1,47 @@
+#ifndef ACL_H
+#define ACL_H 1
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Source address ACL. Each line of an ACL file holds a prefix in CIDR
+ * notation, IPv4 or IPv6, followed by the requests allowed from it:
+ *
+ * 	# helpdesk may send messages, ops jump hosts anything
+ * 	10.20.0.0/16		notify query
+ * 	10.20.99.0/24		# nothing at all from the guest network
+ * 	10.1.2.7		all
+ * 	2001:db8:42::/48	notify,query,abort
+ *
+ * The longest prefix containing a source decides alone; a source in none of
+ * them may not send anything. IPv4 addresses are matched as ::ffff:a.b.c.d,
+ * so IPv6 prefixes covering those cover IPv4 too. Without an ACL loaded,
+ * everything is allowed.
+ */
+
+/* return values of acl_check() */
+#define ACL_ALLOW	0
+#define ACL_DENIED	-1	/* the source is in no prefix */
+#define ACL_DISABLED	-2	/* the request type is not allowed from it */
+
+/*
+ * acl_load:
+ * 	Read the ACL in $path and make it the one used by acl_check(). On error
+ * 	the previously loaded ACL (if any) stays in use.
+ * 	Returns -1 on error and 0 on success.
+ */
+int acl_load(const char *path);
+
+/* acl_unload:	Release every ACL loaded, allowing everything again */
+void acl_unload(void);
+
+/*
+ * acl_check:
+ * 	Check whether request type $req_type (flag bits are ignored) may come
+ * 	from $addr. Lock free, and safe to call while the ACL is reloaded.
+ * 	Returns ACL_ALLOW if it may, else why it may not.
+ */
+int acl_check(const struct sockaddr_storage *addr, uint16_t req_type);
+
+#endif /* ifndef ACL_H */
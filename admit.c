@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "stats.h"
+#include "admit.h"
+#include "acl.h"
+
+#define ADMIT_SETS	(ADMIT_SLOTS / ADMIT_WAYS)
+#define TOKEN		1000	/* tokens are kept in thousandths of a request */
+
+_Static_assert((ADMIT_SETS & (ADMIT_SETS - 1)) == 0, "ADMIT_SLOTS / ADMIT_WAYS must be a power of two");
+
+struct source {
+	uint64_t	addr;
+	int64_t		last;		/* last refill, 0 if the slot was never used */
+	int64_t		tokens;		/* in thousandths of a request */
+};
+
+/*
+ * A source may be stored in any of the ADMIT_WAYS slots of the set its
+ * address hashes to, each set having its own lock so that receive threads
+ * rarely wait for each other. When all of them are taken, the source seen
+ * least recently is forgotten; it starts with a full bucket when it comes
+ * back, as it would have had if it had stayed quiet.
+ */
+static struct {
+	pthread_mutex_t	lock;
+	struct source	ways[ADMIT_WAYS];
+} sets[ADMIT_SETS];
+
+static int64_t refill;		/* thousandths of a request per ms, 0 for no limit */
+static int64_t capacity;	/* bucket size, in thousandths of a request */
+
+void admit_init(unsigned int rate, unsigned int burst)
+{
+	for (int i = 0; i < ADMIT_SETS; ++i) {
+		pthread_mutex_init(&sets[i].lock, NULL);
+		memset(sets[i].ways, 0, sizeof(sets[i].ways));
+	}
+	refill = rate;
+	capacity = (int64_t)MAX(burst, 1) * TOKEN;
+}
+
+/* key of the bucket charged for a datagram from $addr */
+static uint64_t source_addr(const struct sockaddr_storage *addr)
+{
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+	uint64_t key = 0;
+
+	if (addr->ss_family == AF_INET)
+		return ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+	/* a host usually owns a whole /64, a mapped ipv4 address is one host */
+	if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+		memcpy(&key, &sin6->sin6_addr.s6_addr[12], 4);
+	else
+		memcpy(&key, sin6->sin6_addr.s6_addr, sizeof(key));
+	return key;
+}
+
+static unsigned int hash_addr(uint64_t x)
+{
+	/* sources pick their own addresses: spread them before taking bits */
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return x & (ADMIT_SETS - 1);
+}
+
+/* take a token from the bucket of $addr at time $now, false if it is empty */
+static bool take_token(uint64_t addr, int64_t now)
+{
+	unsigned int set = hash_addr(addr);
+	struct source *s, *victim = NULL;
+	bool ok;
+
+	pthread_mutex_lock(&sets[set].lock);
+	for (int i = 0; i < ADMIT_WAYS; ++i) {
+		s = &sets[set].ways[i];
+		if (s->last && s->addr == addr)
+			goto found;
+		if (!victim || s->last < victim->last)
+			victim = s;
+	}
+	s = victim;
+	s->addr = addr;
+	s->last = now;
+	s->tokens = capacity;
+found:
+	/* a clock stepped back refills nothing */
+	if (now > s->last)
+		s->tokens = MIN(capacity, s->tokens + (now - s->last) * refill);
+	s->last = now;
+	if ((ok = s->tokens >= TOKEN))
+		s->tokens -= TOKEN;
+	pthread_mutex_unlock(&sets[set].lock);
+
+	return ok;
+}
+
+int admit_datagram(const struct rxslot *slot)
+{
+	struct request req, cmds[BATCH_MAX];
+	int ncmds = 1;
+
+	/* unpack_request() checks every size and offset in the request */
+	if (slot->len > REQUEST_MAX_SIZE
+			|| unpack_request(&req, slot->buf, slot->len) == -1) {
+		STATS_INC(admit_malformed);
+		return ADMIT_MALFORMED;
+	}
+	/* so does unpack_batch() for the commands of a batch */
+	if ((req.req_type & ~REQ_FLAG_BITS) == REQ_BATCH) {
+		if ((ncmds = unpack_batch(&req, cmds, BATCH_MAX)) == -1) {
+			STATS_INC(admit_malformed);
+			return ADMIT_MALFORMED;
+		}
+	} else {
+		cmds[0].req_type = req.req_type;
+	}
+	if (refill && !take_token(source_addr(&slot->addr), slot->stamp)) {
+		STATS_INC(admit_limited);
+		return ADMIT_LIMITED;
+	}
+	/* a batch is allowed if every command in it is */
+	for (int i = 0; i < ncmds; ++i) {
+		switch (acl_check(&slot->addr, cmds[i].req_type)) {
+		case ACL_DENIED:
+			STATS_INC(admit_refused);
+			return ADMIT_DENIED;
+		case ACL_DISABLED:
+			STATS_INC(admit_refused);
+			return ADMIT_DISABLED;
+		}
+	}
+	return ADMIT_OK;
+}
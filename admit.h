@@ -0,0 +1,51 @@
+#ifndef ADMIT_H
+#define ADMIT_H 1
+
+#include "rx.h"
+
+/*
+ * Admission of datagrams, before their signature is verified. Verifying a
+ * signature is by far the most expensive thing done for a request, so
+ * datagrams only get there after passing cheap layers:
+ *
+ * 	1. structure: the request has to parse, with its message and signature
+ * 	   within MSG_MAXSIZE and 192 bytes, and fit in REQUEST_MAX_SIZE.
+ * 	2. rate: each source address has a token bucket refilled at a fixed
+ * 	   rate, so a single host flooding the port gets a bounded share of
+ * 	   the verifiers and everyone else is still served.
+ * 	3. policy: the request type, or that of every command of a batch, has
+ * 	   to be allowed from the source by the ACL (see acl.h), if one is
+ * 	   loaded.
+ *
+ * Each layer counts what it drops (admit_malformed, admit_limited and
+ * admit_refused).
+ */
+
+#define ADMIT_SLOTS		1024	/* sources tracked, a power of two */
+#define ADMIT_WAYS		4	/* slots a source may be stored in */
+#define ADMIT_DEFAULT_RATE	20	/* requests per second per source */
+#define ADMIT_DEFAULT_BURST	40	/* requests a quiet source may send at once */
+
+/* return values of admit_datagram() */
+#define ADMIT_OK		0
+#define ADMIT_MALFORMED		-1
+#define ADMIT_LIMITED		-2
+#define ADMIT_DENIED		-3	/* source not in the ACL */
+#define ADMIT_DISABLED		-4	/* request type not allowed from the source */
+
+/*
+ * admit_init:
+ * 	Allow every source $rate requests per second, with bursts of up to
+ * 	$burst requests. A $rate of 0 turns rate limiting off.
+ */
+void admit_init(unsigned int rate, unsigned int burst);
+
+/*
+ * admit_datagram:
+ * 	Decide whether the datagram in $slot is worth verifying, charging it
+ * 	to the bucket of its source. Thread safe.
+ * 	Returns ADMIT_OK if it is, else why it is not.
+ */
+int admit_datagram(const struct rxslot *slot);
+
+#endif /* ifndef ADMIT_H */
@@ -1,71 +1,616 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <openssl/ec.h>
+#include <openssl/sha.h>
 
+#include "common.h"
+#include "protocol.h"
 #include "auth.h"
 
-int signbuf(const char *keyfile, unsigned char *buf, size_t bufsize,
-		unsigned char **sig, size_t *siglen)
+#define SIG_MAXSIZE	sizeof(((struct signature *)0)->sig)
+#define KEYFILE_SUFFIX	".pem"
+
+/*
+ * Signature backends, indexed by the algorithm named on the wire. A backend
+ * can only be used with keys of its type and curve; the legacy one with any
+ * key, producing whatever OpenSSL does for it (DER for ECDSA). Session tags
+ * have no backend here, they are checked by session.c.
+ */
+struct sig_backend {
+	const char	*name;
+	int		keytype;	/* EVP_PKEY_EC or EVP_PKEY_ED25519, 0 for any */
+	const char	*group;		/* curve of EC keys */
+	size_t		sigsize;	/* every signature is this long, 0 if it varies */
+	int		(*sign)(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+				const unsigned char *buf, size_t size,
+				unsigned char *sig, size_t *siglen);
+	int		(*verify)(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+				const unsigned char *buf, size_t size,
+				const unsigned char *sig, size_t siglen);
+};
+
+static int evp_sign(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+		const unsigned char *buf, size_t size, unsigned char *sig, size_t *siglen);
+static int evp_verify(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+		const unsigned char *buf, size_t size, const unsigned char *sig, size_t siglen);
+static int ecdsa_sign(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+		const unsigned char *buf, size_t size, unsigned char *sig, size_t *siglen);
+static int ecdsa_verify(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+		const unsigned char *buf, size_t size, const unsigned char *sig, size_t siglen);
+
+static const struct sig_backend backends[SIG_ALG_MAX + 1] = {
+	[SIG_LEGACY] =		{ "legacy", 0, NULL, 0, evp_sign, evp_verify },
+	[SIG_ECDSA_P256] =	{ "ecdsa-p256", EVP_PKEY_EC, "prime256v1", 64,
+					ecdsa_sign, ecdsa_verify },
+	[SIG_ECDSA_P384] =	{ "ecdsa-p384", EVP_PKEY_EC, "secp384r1", 96,
+					ecdsa_sign, ecdsa_verify },
+	[SIG_ED25519] =		{ "ed25519", EVP_PKEY_ED25519, NULL, 64,
+					evp_sign, evp_verify },
+	[SIG_HMAC_SHA256] =	{ "hmac-sha256", 0, NULL, 40, NULL, NULL },
+};
+
+/*
+ * Public key used by verifysig(). It is loaded once by pubkey_load() and
+ * replaced as a whole on reload; verifiers take their own reference under
+ * the lock so a reload never frees a key that is still in use.
+ */
+static pthread_mutex_t pubkey_lock = PTHREAD_MUTEX_INITIALIZER;
+static EVP_PKEY *g_pubkey;
+
+/* a key of the trust store, and what it verified */
+struct trusted_key {
+	uint64_t	id;		/* 0 if the slot is free */
+	EVP_PKEY	*key;
+	char		*name;		/* of its file in the trust store */
+	atomic_ulong	verified, failed;
+};
+
+/*
+ * Keys of the trust store, by id: open addressing with linear probing in a
+ * table at least twice as large as the number of keys, so a lookup takes a
+ * hash and a probe or two. Like g_pubkey, a reload swaps in a whole new
+ * table; verifiers hold a reference to the one they use.
+ */
+struct truststore {
+	unsigned int	refs;		/* under pubkey_lock */
+	size_t		size;		/* slots, a power of two */
+	size_t		count;
+	struct trusted_key keys[];
+};
+
+static struct truststore *g_trust;
+/* requests naming a key id the trust store does not hold */
+static atomic_ulong unknown_ids;
+
+/* per-thread digest context, reused across verifications */
+static __thread EVP_MD_CTX *verify_ctx;
+
+/* private key used by signbuf(), kept until its file changes */
+static EVP_PKEY *sign_key;
+static char sign_keyfile[PATH_MAX];
+static struct stat sign_keystat;
+
+static int key_fits(const struct sig_backend *b, EVP_PKEY *key)
+{
+	char group[32];
+
+	if (!b->sign || (b->keytype && EVP_PKEY_get_base_id(key) != b->keytype))
+		return 0;
+	return !b->group || (EVP_PKEY_get_group_name(key, group, sizeof(group), NULL)
+		&& !strcmp(group, b->group));
+}
+
+/* Ed25519 hashes the message itself, ECDSA signs its SHA-256 digest */
+static const EVP_MD *key_md(EVP_PKEY *key)
+{
+	return EVP_PKEY_get_base_id(key) == EVP_PKEY_ED25519 ? NULL : EVP_sha256();
+}
+
+static int evp_sign(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+		const unsigned char *buf, size_t size, unsigned char *sig, size_t *siglen)
+{
+	return EVP_DigestSignInit(ctx, NULL, key_md(key), NULL, key) == 1
+		&& EVP_DigestSign(ctx, sig, siglen, buf, size) == 1;
+}
+
+static int evp_verify(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+		const unsigned char *buf, size_t size, const unsigned char *sig, size_t siglen)
+{
+	return EVP_DigestVerifyInit(ctx, NULL, key_md(key), NULL, key) == 1
+		&& EVP_DigestVerify(ctx, sig, siglen, buf, size) == 1;
+}
+
+/* ECDSA signatures are sent as r and s padded to half the size each */
+static int ecdsa_sign(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+		const unsigned char *buf, size_t size, unsigned char *sig, size_t *siglen)
+{
+	unsigned char der[SIG_MAXSIZE];
+	const unsigned char *p = der;
+	const BIGNUM *r, *s;
+	size_t derlen = sizeof(der);
+	ECDSA_SIG *esig;
+	int ok;
+
+	if (!evp_sign(b, ctx, key, buf, size, der, &derlen)
+			|| (esig = d2i_ECDSA_SIG(NULL, &p, derlen)) == NULL)
+		return 0;
+	ECDSA_SIG_get0(esig, &r, &s);
+	ok = BN_bn2binpad(r, sig, b->sigsize / 2) != -1
+		&& BN_bn2binpad(s, sig + b->sigsize / 2, b->sigsize / 2) != -1;
+	ECDSA_SIG_free(esig);
+	*siglen = b->sigsize;
+	return ok;
+}
+
+static int ecdsa_verify(const struct sig_backend *b, EVP_MD_CTX *ctx, EVP_PKEY *key,
+		const unsigned char *buf, size_t size, const unsigned char *sig, size_t siglen)
+{
+	unsigned char der[SIG_MAXSIZE], *p = der;
+	ECDSA_SIG *esig;
+	BIGNUM *r, *s;
+	int derlen, ok = 0;
+
+	if ((esig = ECDSA_SIG_new()) == NULL)
+		return 0;
+	r = BN_bin2bn(sig, siglen / 2, NULL);
+	s = BN_bin2bn(sig + siglen / 2, siglen / 2, NULL);
+	if (!r || !s || !ECDSA_SIG_set0(esig, r, s)) {
+		BN_free(r);
+		BN_free(s);
+		goto out;
+	}
+	/* the DER encoding of the largest signature fits, i2d never truncates */
+	if ((derlen = i2d_ECDSA_SIG(esig, NULL)) > 0 && derlen <= (int)sizeof(der)
+			&& i2d_ECDSA_SIG(esig, &p) == derlen)
+		ok = evp_verify(b, ctx, key, buf, size, der, derlen);
+out:
+	ECDSA_SIG_free(esig);
+	return ok;
+}
+
+const char *sig_alg_name(uint8_t alg)
+{
+	return alg <= SIG_ALG_MAX ? backends[alg].name : NULL;
+}
+
+/* load the private key in $keyfile, unless it is the one loaded already */
+static EVP_PKEY *load_sign_key(const char *keyfile)
 {
 	FILE *keyfp;
-	EC_KEY *ec_key;
 	EVP_PKEY *key;
+	struct stat st;
 
-	*siglen = 0;
-	if ((keyfp = fopen(keyfile, "r")) == NULL) {
+	if ((keyfp = fopen(keyfile, "r")) == NULL || fstat(fileno(keyfp), &st) == -1) {
 		fprintf(stderr, "error opening private key '%s' for signing: %s\n",
 			keyfile, strerror(errno));
-		return -1;
+		if (keyfp)
+			fclose(keyfp);
+		return NULL;
 	}
-	ec_key = PEM_read_ECPrivateKey(keyfp, NULL, NULL, NULL);
-	if (!ec_key) {
-		ERR_print_errors_fp(stderr);
-		return -1;
+	/* the same file, not written to since */
+	if (sign_key && !strcmp(keyfile, sign_keyfile) && st.st_ino == sign_keystat.st_ino
+			&& st.st_dev == sign_keystat.st_dev
+			&& st.st_mtim.tv_sec == sign_keystat.st_mtim.tv_sec
+			&& st.st_mtim.tv_nsec == sign_keystat.st_mtim.tv_nsec) {
+		fclose(keyfp);
+		return sign_key;
 	}
+	key = PEM_read_PrivateKey(keyfp, NULL, NULL, NULL);
 	fclose(keyfp);
+	if (!key) {
+		ERR_print_errors_fp(stderr);
+		return NULL;
+	}
+	EVP_PKEY_free(sign_key);
+	sign_key = key;
+	sign_keystat = st;
+	snprintf(sign_keyfile, sizeof(sign_keyfile), "%s", keyfile);
+	return key;
+}
 
-	assert(EC_KEY_check_key(ec_key) == 1);
-	key = EVP_PKEY_new();
-	assert (EVP_PKEY_assign_EC_KEY(key, ec_key) == 1); 
-	EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new(key, NULL);
-	assert(EVP_PKEY_sign_init(key_ctx) == 1);
-	assert(EVP_PKEY_CTX_set_signature_md(key_ctx, EVP_sha256()));
-	assert(EVP_PKEY_sign(key_ctx, NULL, siglen, buf, bufsize) == 1);
-	assert(EVP_PKEY_sign(key_ctx, (unsigned char *)sig, siglen, buf, bufsize));
-
-	EVP_PKEY_CTX_free(key_ctx);
-	EVP_PKEY_free(key);
+int sig_key_alg(const char *keyfile)
+{
+	EVP_PKEY *key;
 
-	return 0;
+	if ((key = load_sign_key(keyfile)) == NULL)
+		return -1;
+	for (uint8_t alg = SIG_LEGACY + 1; alg <= SIG_ALG_MAX; ++alg)
+		if (key_fits(&backends[alg], key))
+			return alg;
+	return SIG_LEGACY;
 }
 
-int verifysig(const char *pubkey, unsigned char *buf, size_t bufsize,
+int signbuf(const char *keyfile, uint8_t alg, unsigned char *buf, size_t bufsize,
 		unsigned char *sig, size_t *siglen)
+{
+	const struct sig_backend *b;
+	EVP_PKEY *key;
+	EVP_MD_CTX *md_ctx;
+	int ret = -1;
+
+	if (alg > SIG_ALG_MAX || (key = load_sign_key(keyfile)) == NULL)
+		return -1;
+	b = &backends[alg];
+	if (!key_fits(b, key)) {
+		fprintf(stderr, "key '%s' cannot make %s signatures\n", keyfile, b->name);
+		return -1;
+	}
+
+	*siglen = SIG_MAXSIZE;
+	md_ctx = EVP_MD_CTX_new();
+	if (md_ctx && b->sign(b, md_ctx, key, buf, bufsize, sig, siglen))
+		ret = 0;
+	else
+		ERR_print_errors_fp(stderr);
+	EVP_MD_CTX_free(md_ctx);
+
+	return ret;
+}
+
+int pubkey_load(const char *pubkey)
 {
 	FILE *fp;
-	EC_KEY *ec_key;
+	EVP_PKEY *key, *old;
 
 	if ((fp = fopen(pubkey, "r")) == NULL) {
 		fprintf(stderr, "error opening public key '%s' for verification: %s\n",
 			pubkey, strerror(errno));
+		return -1;
+	}
+	key = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (!key) {
+		fprintf(stderr, "error reading public key '%s'\n", pubkey);
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+
+	/* swap in the fully loaded key; the old one goes away with its last user */
+	pthread_mutex_lock(&pubkey_lock);
+	old = g_pubkey;
+	g_pubkey = key;
+	pthread_mutex_unlock(&pubkey_lock);
+	EVP_PKEY_free(old);
+	PDEBUG("[+] loaded %s public key '%s'\n", EVP_PKEY_get0_type_name(key), pubkey);
+
+	return 0;
+}
+
+void pubkey_unload(void)
+{
+	EVP_PKEY *old;
+
+	pthread_mutex_lock(&pubkey_lock);
+	old = g_pubkey;
+	g_pubkey = NULL;
+	pthread_mutex_unlock(&pubkey_lock);
+	EVP_PKEY_free(old);
+}
+
+/* the first 8 bytes of the SHA-256 of $key's SubjectPublicKeyInfo, never 0 */
+static uint64_t key_id(EVP_PKEY *key)
+{
+	unsigned char *der = NULL, md[SHA256_DIGEST_LENGTH];
+	uint64_t id = 0;
+	int len;
+
+	if ((len = i2d_PUBKEY(key, &der)) <= 0)
+		return 0;
+	SHA256(der, len, md);
+	OPENSSL_free(der);
+	for (int i = 0; i < 8; ++i)
+		id = id << 8 | md[i];
+	return id ? id : 1;
+}
+
+int sig_key_id(const char *keyfile, uint64_t *id)
+{
+	EVP_PKEY *key;
+
+	if ((key = load_sign_key(keyfile)) == NULL || (*id = key_id(key)) == 0)
+		return -1;
+	return 0;
+}
+
+/* slot of key $id in $ts, or of the free slot where it would go */
+static struct trusted_key *trust_slot(struct truststore *ts, uint64_t id)
+{
+	size_t i = id & (ts->size - 1);
+
+	while (ts->keys[i].id && ts->keys[i].id != id)
+		i = (i + 1) & (ts->size - 1);
+	return &ts->keys[i];
+}
+
+static void truststore_free(struct truststore *ts)
+{
+	if (!ts)
+		return;
+	for (size_t i = 0; i < ts->size; ++i) {
+		EVP_PKEY_free(ts->keys[i].key);
+		free(ts->keys[i].name);
+	}
+	free(ts);
+}
+
+/* drop a reference to $ts taken under pubkey_lock */
+static void truststore_put(struct truststore *ts)
+{
+	bool last;
+
+	if (!ts)
+		return;
+	pthread_mutex_lock(&pubkey_lock);
+	last = --ts->refs == 0;
+	pthread_mutex_unlock(&pubkey_lock);
+	if (last)
+		truststore_free(ts);
+}
+
+/*
+ * Read the public key in $dir/$name into its slot of $ts. A file that is
+ * not a usable key is skipped, so it cannot keep the other keys from
+ * being reloaded. Returns -1 on error and 0 otherwise.
+ */
+static int trust_add(struct truststore *ts, const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	struct trusted_key *t;
+	EVP_PKEY *key;
+	uint64_t id;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "error opening trusted key '%s': %s, skipping\n", path,
+			strerror(errno));
 		return 0;
 	}
-	printf("opened public key '%s' successfully\n", pubkey);
-	ec_key = PEM_read_EC_PUBKEY(fp, NULL, NULL, NULL);
+	key = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
 	fclose(fp);
+	if (!key || (id = key_id(key)) == 0) {
+		fprintf(stderr, "error reading trusted key '%s', skipping\n", path);
+		ERR_print_errors_fp(stderr);
+		EVP_PKEY_free(key);
+		return 0;
+	}
+	t = trust_slot(ts, id);
+	if (t->id) {
+		fprintf(stderr, "trusted key '%s' is '%s' again, skipping\n", path, t->name);
+		EVP_PKEY_free(key);
+		return 0;
+	}
+	if ((t->name = strdup(name)) == NULL) {
+		perror("error loading trusted key");
+		EVP_PKEY_free(key);
+		return -1;
+	}
+	t->id = id;
+	t->key = key;
+	ts->count++;
+	PDEBUG("[+] trusting %s key %016llx '%s'\n", EVP_PKEY_get0_type_name(key),
+		(unsigned long long)id, path);
+	return 0;
+}
 
-	EVP_PKEY *key = EVP_PKEY_new();
-	assert(EVP_PKEY_assign_EC_KEY(key, ec_key) == 1);
+/* whether $name is that of a key file */
+static bool is_keyfile(const char *name)
+{
+	size_t len = strlen(name), slen = strlen(KEYFILE_SUFFIX);
 
-	EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new(key, NULL);
-	assert(EVP_PKEY_verify_init(key_ctx) == 1);
-	assert(EVP_PKEY_CTX_set_signature_md(key_ctx, EVP_sha256()));
-	const int ret = EVP_PKEY_verify(key_ctx, sig, *siglen, buf, bufsize);
-	EVP_PKEY_CTX_free(key_ctx);
-	EVP_PKEY_free(key);
+	return name[0] != '.' && len > slen && !strcmp(name + len - slen, KEYFILE_SUFFIX);
+}
+
+int truststore_load(const char *dir)
+{
+	struct truststore *ts, *old;
+	struct trusted_key *t, *prev;
+	struct dirent *de;
+	size_t n = 0, size = 16;
+	DIR *d;
 
+	if ((d = opendir(dir)) == NULL) {
+		fprintf(stderr, "error opening trust store '%s': %s\n", dir, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL)
+		n += is_keyfile(de->d_name);
+	while (size < 2 * n)
+		size *= 2;
+	if ((ts = calloc(1, sizeof(*ts) + size * sizeof(ts->keys[0]))) == NULL) {
+		perror("error loading trust store");
+		closedir(d);
+		return -1;
+	}
+	ts->refs = 1;
+	ts->size = size;
+	/*
+	 * Keys added since the count still fit, the table is twice as large;
+	 * beyond that they wait for the next reload, untrusted until then
+	 */
+	rewinddir(d);
+	while ((de = readdir(d)) != NULL) {
+		if (!is_keyfile(de->d_name))
+			continue;
+		if (ts->count == size / 2) {
+			fprintf(stderr, "trust store '%s' changed while loading\n", dir);
+			break;
+		}
+		if (trust_add(ts, dir, de->d_name) == -1) {
+			closedir(d);
+			truststore_free(ts);
+			return -1;
+		}
+	}
+	closedir(d);
+
+	pthread_mutex_lock(&pubkey_lock);
+	old = g_trust;
+	/* keys kept across the reload keep counting */
+	for (size_t i = 0; old && i < ts->size; ++i) {
+		t = &ts->keys[i];
+		if (t->id && (prev = trust_slot(old, t->id))->id) {
+			t->verified = prev->verified;
+			t->failed = prev->failed;
+		}
+	}
+	g_trust = ts;
+	pthread_mutex_unlock(&pubkey_lock);
+	truststore_put(old);
+	PDEBUG("[+] loaded %zu trusted keys from '%s'\n", ts->count, dir);
+
+	return 0;
+}
+
+void truststore_unload(void)
+{
+	struct truststore *old;
+
+	pthread_mutex_lock(&pubkey_lock);
+	old = g_trust;
+	g_trust = NULL;
+	pthread_mutex_unlock(&pubkey_lock);
+	truststore_put(old);
+}
+
+bool truststore_has(uint64_t id)
+{
+	bool found;
+
+	if (id == 0)
+		return true;
+	pthread_mutex_lock(&pubkey_lock);
+	found = g_trust && trust_slot(g_trust, id)->id;
+	pthread_mutex_unlock(&pubkey_lock);
+	return found;
+}
+
+void truststore_dump(FILE *fp)
+{
+	struct truststore *ts;
+	struct trusted_key *t;
+
+	pthread_mutex_lock(&pubkey_lock);
+	if ((ts = g_trust) != NULL)
+		ts->refs++;
+	pthread_mutex_unlock(&pubkey_lock);
+	if (!ts)
+		return;
+	fprintf(fp, "trusted keys\n============\n");
+	for (size_t i = 0; i < ts->size; ++i) {
+		t = &ts->keys[i];
+		if (t->id)
+			fprintf(fp, "%016llx %-24s %lu verified, %lu failed\n",
+				(unsigned long long)t->id, t->name,
+				atomic_load(&t->verified), atomic_load(&t->failed));
+	}
+	fprintf(fp, "%-41s %lu\n", "unknown key ids", atomic_load(&unknown_ids));
+	truststore_put(ts);
+}
+
+/* verify $sig over $buf with $key, for backend $b */
+static int verify_with(const struct sig_backend *b, EVP_PKEY *key, const unsigned char *buf,
+		size_t bufsize, const unsigned char *sig, size_t siglen)
+{
+	int ret = 0;
+
+	if (key_fits(b, key) && (verify_ctx || (verify_ctx = EVP_MD_CTX_new()) != NULL)) {
+		EVP_MD_CTX_reset(verify_ctx);
+		ret = b->verify(b, verify_ctx, key, buf, bufsize, sig, siglen);
+	}
+	/* drop any errors from bad signatures so they do not pile up */
+	ERR_clear_error();
+	return ret;
+}
+
+int verifysig(uint8_t alg, uint64_t keyid, unsigned char *buf, size_t bufsize,
+		unsigned char *sig, size_t *siglen)
+{
+	const struct sig_backend *b;
+	struct truststore *ts = NULL;
+	struct trusted_key *t = NULL;
+	EVP_PKEY *key = NULL;
+	int ret;
+
+	if (alg > SIG_ALG_MAX)
+		return 0;
+	b = &backends[alg];
+	if (b->sigsize && *siglen != b->sigsize)
+		return 0;
+	pthread_mutex_lock(&pubkey_lock);
+	if (keyid == 0) {
+		if ((key = g_pubkey) != NULL)
+			EVP_PKEY_up_ref(key);
+	} else if ((ts = g_trust) != NULL && (t = trust_slot(ts, keyid))->id) {
+		ts->refs++;
+		key = t->key;
+	}
+	pthread_mutex_unlock(&pubkey_lock);
+	if (!key) {
+		if (keyid)
+			atomic_fetch_add(&unknown_ids, 1);
+		return 0;
+	}
+
+	ret = verify_with(b, key, buf, bufsize, sig, *siglen);
+	if (keyid) {
+		atomic_fetch_add_explicit(ret ? &t->verified : &t->failed, 1,
+				memory_order_relaxed);
+		truststore_put(ts);
+	} else {
+		EVP_PKEY_free(key);
+	}
+	return ret;
+}
+
+int sig_keygen(uint8_t alg, const char *pvtkey, const char *pubkey)
+{
+	static const char *const curves[] = {
+		[SIG_LEGACY] = "P-384", [SIG_ECDSA_P256] = "P-256", [SIG_ECDSA_P384] = "P-384"
+	};
+	EVP_PKEY *key;
+	FILE *pvt = NULL, *pub = NULL;
+	int fd, ret = -1;
+
+	if (alg > SIG_ED25519)
+		return -1;
+	if (alg == SIG_ED25519)
+		key = EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+	else
+		key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", curves[alg]);
+	if (!key) {
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	/* readable by its owner alone, even if it was not before */
+	fd = open(pvtkey, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd != -1 && (fchmod(fd, 0600) == -1 || (pvt = fdopen(fd, "w")) == NULL)) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1 || (pub = fopen(pubkey, "w")) == NULL)
+		perror("error creating key file");
+	else if (PEM_write_PrivateKey(pvt, key, NULL, NULL, 0, NULL, NULL)
+			&& PEM_write_PUBKEY(pub, key))
+		ret = 0;
+	if (pvt)
+		fclose(pvt);
+	if (pub)
+		fclose(pub);
+	EVP_PKEY_free(key);
 	return ret;
 }
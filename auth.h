@@ -1,10 +1,107 @@
 #ifndef AUTH_H
 #define AUTH_H 1
 
-int signbuf(const char *pvtkey, unsigned char *buf, size_t bufsize, unsigned char **sig,
-		size_t *siglen);
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
-int verifysig(const char *pubkey, unsigned char *buf, size_t bufsize, unsigned char *sig,
-		size_t *siglen);
+/*
+ * Requests are signed with one of the SIG_* algorithms of protocol.h, each
+ * implemented by a backend in auth.c. Which ones a key can be used with
+ * depends on its type: any key with SIG_LEGACY, ECDSA keys on P-256 or P-384
+ * with SIG_ECDSA_P256 or SIG_ECDSA_P384, Ed25519 keys with SIG_ED25519.
+ * None with SIG_HMAC_SHA256, whose tags are made with session keys (see
+ * session.h).
+ *
+ * The server verifies with a default key, loaded by pubkey_load(), and with
+ * the keys of a trust store, a directory of PEM files loaded by
+ * truststore_load(). Requests flagged SIG_KEYID name the key they were
+ * signed with by its id, the first 8 bytes of the SHA-256 of its DER
+ * encoded SubjectPublicKeyInfo, so it is found with one hash lookup and a
+ * single signature is verified whatever the number of keys.
+ */
+
+/*
+ * signbuf:
+ * 	Sign the $bufsize bytes at $buf with algorithm $alg and the private key
+ * 	in PEM file $pvtkey, storing the signature in $sig, which has room for
+ * 	192 bytes, and its size in *$siglen. The key is kept loaded until the
+ * 	file changes; not thread safe.
+ * 	Returns -1 on error and 0 on success.
+ */
+int signbuf(const char *pvtkey, uint8_t alg, unsigned char *buf, size_t bufsize,
+		unsigned char *sig, size_t *siglen);
+
+/*
+ * sig_key_alg:
+ * 	Return the algorithm with fixed size signatures the private key in
+ * 	$pvtkey is for, SIG_LEGACY if there is none, or -1 on error.
+ */
+int sig_key_alg(const char *pvtkey);
+
+/*
+ * sig_key_id:
+ * 	Store the id of the key in PEM file $pvtkey, for requests signed with
+ * 	it, in *$id. Returns -1 on error and 0 on success.
+ */
+int sig_key_id(const char *pvtkey, uint64_t *id);
+
+/* sig_alg_name:	Return the name of algorithm $alg, or NULL if it is unknown */
+const char *sig_alg_name(uint8_t alg);
+
+/*
+ * sig_keygen:
+ * 	Generate a key pair for algorithm $alg (P-384 for SIG_LEGACY), writing
+ * 	it to PEM files $pvtkey, readable by its owner alone, and $pubkey.
+ * 	Returns -1 on error and 0 on success.
+ */
+int sig_keygen(uint8_t alg, const char *pvtkey, const char *pubkey);
+
+/*
+ * pubkey_load:
+ * 	Read the public key in PEM file $pubkey and make it the key used by
+ * 	verifysig(). The key is only swapped in once it has been fully loaded, so
+ * 	verifications running concurrently use either the old or the new key.
+ * 	On error the previously loaded key (if any) stays in use.
+ * 	Returns -1 on error and 0 on success.
+ */
+int pubkey_load(const char *pubkey);
+
+/* pubkey_unload:	Release the key loaded by pubkey_load() */
+void pubkey_unload(void);
+
+/*
+ * truststore_load:
+ * 	Read every *.pem public key in directory $dir and make them the trust
+ * 	store used by verifysig(), replacing the previous one as a whole like
+ * 	pubkey_load() does: keys whose files went away are no longer trusted,
+ * 	the others keep their counters. Files that cannot be read as a key are
+ * 	reported and skipped, so removing a key's file always revokes it. Only
+ * 	if the directory cannot be read or memory runs out does the previously
+ * 	loaded trust store (if any) stay in use.
+ * 	Returns -1 on error and 0 on success.
+ */
+int truststore_load(const char *dir);
+
+/* truststore_unload:	Release the trust store loaded by truststore_load() */
+void truststore_unload(void);
+
+/* truststore_has:	Whether key $id is trusted, always for 0, the default key */
+bool truststore_has(uint64_t id);
+
+/* truststore_dump:	Print the trusted keys and what they verified to $fp */
+void truststore_dump(FILE *fp);
+
+/*
+ * verifysig:
+ * 	Verify signature $sig over $buf, made with algorithm $alg, using the
+ * 	trusted key with id $keyid, or the key loaded by pubkey_load() if it is
+ * 	0. Signatures of algorithms the key is not for, or not of the size
+ * 	their algorithm makes, are never valid, nor are those of unknown keys.
+ * 	Returns 1 if the signature is valid and 0 otherwise.
+ */
+int verifysig(uint8_t alg, uint64_t keyid, unsigned char *buf, size_t bufsize,
+		unsigned char *sig, size_t *siglen);
 
 #endif /* ifndef AUTH_H */
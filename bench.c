@@ -0,0 +1,376 @@
+/*
+ * Micro benchmarks of the request path, run with `make bench`.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "acl.h"
+#include "auth.h"
+#include "session.h"
+#include "merkle.h"
+#include "dedupe.h"
+#include "tx.h"
+#include "targets.h"
+
+#define ITERATIONS	2000000
+
+static volatile size_t sink;	/* keeps results from being optimized away */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* time encoding and decoding a request in wire format $version */
+static void bench_codec(uint8_t version)
+{
+	unsigned char buf[REQUEST_MAX_SIZE];
+	struct request req = {
+		.when = time(NULL),
+		.timer = 60,
+		.req_type = REQ_NOTIFY,
+		.msg = "maintenance window starts in five minutes",
+		.version = version
+	};
+	struct request out;
+	size_t size;
+	double start, enc, dec;
+
+	req.msg_size = strlen((char *)req.msg);
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS; ++i) {
+		req.when += i;
+		sink += pack_request(&req, buf, sizeof(buf));
+	}
+	enc = (now_ns() - start) / ITERATIONS;
+
+	/* an empty signature, decoding does not verify it */
+	size = pack_request(&req, buf, sizeof(buf));
+	buf[size] = buf[size + 1] = 0;
+	size += 2;
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS; ++i)
+		sink += unpack_request(&out, buf, size);
+	dec = (now_ns() - start) / ITERATIONS;
+
+	printf("v%u codec: %3zu bytes, encode %6.1f ns, decode %6.1f ns per request\n",
+		version, size, enc, dec);
+}
+
+/* time ACL lookups of random addresses in an ACL of $nprefixes prefixes */
+static void bench_acl(int nprefixes)
+{
+	char path[] = "/tmp/lsd-bench-acl-XXXXXX";
+	struct sockaddr_storage addrs[1024] = { 0 };
+	struct sockaddr_in *sin;
+	double start;
+	FILE *fp;
+	int fd;
+
+	if ((fd = mkstemp(path)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+		return;
+	srand(1);
+	/* /8 to /32 prefixes within 10.0.0.0/8, where lookups are made */
+	for (int i = 0; i < nprefixes; ++i)
+		fprintf(fp, "10.%d.%d.%d/%d notify\n", rand() % 256, rand() % 256,
+			rand() % 256, 8 + rand() % 25);
+	fclose(fp);
+	if (acl_load(path) == -1)
+		goto out;
+	for (int i = 0; i < 1024; ++i) {
+		sin = (struct sockaddr_in *)&addrs[i];
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(0x0a000000 | (rand() & 0xffffff));
+	}
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS; ++i)
+		sink += acl_check(&addrs[i & 1023], REQ_NOTIFY);
+	printf("acl: %5d prefixes, lookup %6.1f ns\n", nprefixes,
+		(now_ns() - start) / ITERATIONS);
+	acl_unload();
+out:
+	unlink(path);
+}
+
+#define SIG_ITERATIONS	2000
+
+/* time signing and verifying a request with each signature algorithm */
+static void bench_sig(uint8_t alg)
+{
+	const char *pvt = "/tmp/lsd-bench-pvtkey.pem", *pub = "/tmp/lsd-bench-pubkey.pem";
+	unsigned char buf[REQUEST_MAX_SIZE], sig[256];
+	size_t size = 64, siglen;
+	double start, sign, verify;
+
+	memset(buf, 0x5a, size);
+	if (sig_keygen(alg, pvt, pub) == -1 || pubkey_load(pub) == -1)
+		goto out;
+	start = now_ns();
+	for (int i = 0; i < SIG_ITERATIONS; ++i) {
+		buf[0] = i;
+		sink += signbuf(pvt, alg, buf, size, sig, &siglen);
+	}
+	sign = (now_ns() - start) / SIG_ITERATIONS;
+	start = now_ns();
+	for (int i = 0; i < SIG_ITERATIONS; ++i)
+		sink += verifysig(alg, 0, buf, size, sig, &siglen);
+	verify = (now_ns() - start) / SIG_ITERATIONS;
+	printf("%-11s: %3zu byte signature, sign %6.1f us, verify %6.1f us\n",
+		sig_alg_name(alg), siglen, sign / 1000, verify / 1000);
+	pubkey_unload();
+out:
+	unlink(pvt);
+	unlink(pub);
+}
+
+/* time verifying with one of $n keys of a trust store, named by its id */
+static void bench_trust(int n)
+{
+	char dir[] = "/tmp/lsd-bench-trust.XXXXXX", pvt[64], pub[64];
+	unsigned char buf[64], sig[256];
+	size_t siglen;
+	uint64_t id;
+	double start, verify;
+
+	memset(buf, 0x5a, sizeof(buf));
+	if (mkdtemp(dir) == NULL)
+		return;
+	snprintf(pvt, sizeof(pvt), "%s/key", dir);
+	for (int i = 0; i < n; ++i) {
+		snprintf(pub, sizeof(pub), "%s/%d.pem", dir, i);
+		if (sig_keygen(SIG_ED25519, pvt, pub) == -1)
+			goto out;
+	}
+	if (truststore_load(dir) == -1 || sig_key_id(pvt, &id) == -1
+			|| signbuf(pvt, SIG_ED25519, buf, sizeof(buf), sig, &siglen) == -1)
+		goto out;
+	start = now_ns();
+	for (int i = 0; i < SIG_ITERATIONS; ++i)
+		sink += verifysig(SIG_ED25519, id, buf, sizeof(buf), sig, &siglen);
+	verify = (now_ns() - start) / SIG_ITERATIONS;
+	printf("trust store: %4d keys, verify by key id %6.1f us\n", n, verify / 1000);
+out:
+	truststore_unload();
+	unlink(pvt);
+	for (int i = 0; i < n; ++i) {
+		snprintf(pub, sizeof(pub), "%s/%d.pem", dir, i);
+		unlink(pub);
+	}
+	rmdir(dir);
+}
+
+/* time sealing and checking a request with a session, for comparison */
+static void bench_session(void)
+{
+	unsigned char pub[SESSION_PUB_SIZE], buf[REQUEST_MAX_SIZE];
+	struct session_reply reply;
+	struct session_kex *kex;
+	struct session s;
+	uint64_t keyid;
+	size_t size = 64;
+	double start, seal, verify;
+
+	memset(buf, 0x5a, size);
+	if ((kex = session_kex_new(pub)) == NULL)
+		return;
+	if (session_open(0, 1, pub, sizeof(pub), 1, &reply) == -1
+			|| session_kex_finish(kex, 1, &reply, 1, &s) == -1)
+		goto out;
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS / 10; ++i) {
+		buf[0] = i;
+		sink += session_seal(&s, buf, size);
+	}
+	seal = (now_ns() - start) / (ITERATIONS / 10);
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS / 10; ++i)
+		sink += session_verify(1, buf, size, buf + size + 2, SESSION_TAG_SIZE, 1, &keyid);
+	verify = (now_ns() - start) / (ITERATIONS / 10);
+	printf("%-11s: %3d byte tag,       seal %6.1f us, verify %6.1f us\n",
+		sig_alg_name(SIG_HMAC_SHA256), SESSION_TAG_SIZE, seal / 1000, verify / 1000);
+out:
+	session_kex_free(kex);
+}
+
+/*
+ * time signing $n requests at once with a Merkle root, and verifying one of
+ * them, without and with the root cached
+ */
+static void bench_merkle(uint32_t n)
+{
+	const char *pvt = "/tmp/lsd-bench-pvtkey.pem", *pub = "/tmp/lsd-bench-pubkey.pem";
+	unsigned char (*leaves)[MERKLE_HASH_SIZE], buf[REQUEST_MAX_SIZE], sig[256];
+	struct request req = { .req_type = REQ_POW_SHUTDOWN, .version = 2, .sigalg = SIG_ED25519 };
+	struct merkle_tree *tree = NULL;
+	size_t size, siglen;
+	ssize_t signedsize;
+	double start, sign, verify, cached;
+
+	if ((leaves = malloc(n * sizeof(*leaves))) == NULL)
+		return;
+	if (sig_keygen(SIG_ED25519, pvt, pub) == -1 || pubkey_load(pub) == -1)
+		goto out;
+	req.proof.count = n;
+	start = now_ns();
+	for (int it = 0; it < SIG_ITERATIONS / 100; ++it) {
+		merkle_tree_free(tree);
+		for (uint32_t i = 0; i < n; ++i) {
+			req.timer = i;
+			merkle_leaf(htonl(0x0a000000 + i), buf, pack_request(&req, buf,
+					sizeof(buf)), leaves[i]);
+		}
+		if ((tree = merkle_build(leaves, n)) == NULL
+				|| merkle_sign(tree, pvt, SIG_ED25519, sig, &siglen) == -1)
+			goto out;
+	}
+	sign = (now_ns() - start) / (SIG_ITERATIONS / 100);
+
+	/* the last leaf has the longest proof */
+	req.timer = n - 1;
+	size = merkle_seal(tree, n - 1, sig, siglen, buf, pack_request(&req, buf, sizeof(buf)),
+			sizeof(buf));
+	if ((signedsize = unpack_request(&req, buf, size)) == -1)
+		goto out;
+	start = now_ns();
+	for (int i = 0; i < SIG_ITERATIONS; ++i) {
+		merkle_cache_flush();
+		sink += merkle_verify(buf, signedsize, &req, htonl(0x0a000000 + n - 1), 1);
+	}
+	verify = (now_ns() - start) / SIG_ITERATIONS;
+	start = now_ns();
+	for (int i = 0; i < SIG_ITERATIONS; ++i)
+		sink += merkle_verify(buf, signedsize, &req, htonl(0x0a000000 + n - 1), 1);
+	cached = (now_ns() - start) / SIG_ITERATIONS;
+	printf("merkle: %5u requests, sign %8.1f us, verify %6.1f us, %5.1f us cached\n",
+		n, sign / 1000, verify / 1000, cached / 1000);
+	pubkey_unload();
+out:
+	merkle_tree_free(tree);
+	free(leaves);
+	unlink(pvt);
+	unlink(pub);
+}
+
+/* time answering a copy of a datagram from the dedupe cache */
+static void bench_dedupe(void)
+{
+	unsigned char buf[REQUEST_V2_FIXED_SIZE + 66], reply[DEDUPE_REPLY_MAX];
+	struct rxslot slot = { .buf = buf, .len = sizeof(buf), .addrlen = sizeof(struct sockaddr_in) };
+	size_t replylen;
+	double start;
+
+	memset(buf, 0x5a, sizeof(buf));
+	dedupe_init();
+	dedupe_check(&slot, reply, &replylen);
+	dedupe_answer(&slot, reply, SSTATE_SIZE);
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS; ++i)
+		sink += dedupe_check(&slot, reply, &replylen);
+	printf("dedupe: %3zu byte datagram, answered from the cache in %6.1f ns\n",
+		sizeof(buf), (now_ns() - start) / ITERATIONS);
+}
+
+/*
+ * time sending one payload to $n hosts, all of them a socket on loopback
+ * nobody reads, a datagram per sendto() and TXBATCH_MAX per sendmmsg()
+ */
+static void bench_fanout(size_t n)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t addrlen = sizeof(addr);
+	unsigned char payload[128];
+	struct txvec v;
+	double start, loop, vec;
+	int rx, tx;
+
+	memset(payload, 0x5a, sizeof(payload));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	rx = socket(AF_INET, SOCK_DGRAM, 0);
+	tx = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rx == -1 || tx == -1 || bind(rx, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| getsockname(rx, (struct sockaddr *)&addr, &addrlen) == -1
+			|| txvec_init(&v, n) == -1)
+		goto out;
+	start = now_ns();
+	for (size_t i = 0; i < n; ++i)
+		sink += sendto(tx, payload, sizeof(payload), 0, (struct sockaddr *)&addr,
+				sizeof(addr));
+	loop = now_ns() - start;
+	start = now_ns();
+	for (size_t i = 0; i < n; ++i)
+		txvec_add(&v, payload, sizeof(payload), (struct sockaddr *)&addr, sizeof(addr));
+	sink += txvec_send(&v, tx);
+	vec = now_ns() - start;
+	printf("fan-out: %5zu hosts, sendto %6.1f ms, sendmmsg %6.1f ms (%u syscalls)\n",
+		n, loop / 1e6, vec / 1e6, v.syscalls);
+	txvec_free(&v);
+out:
+	if (rx != -1)
+		close(rx);
+	if (tx != -1)
+		close(tx);
+}
+
+/* time matching an ack to one of $n hosts, against scanning them for it */
+static void bench_targets(size_t n)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(6969) }, *addrs;
+	struct targets t;
+	double start, table, scan;
+	size_t j;
+
+	if ((addrs = calloc(n, sizeof(*addrs))) == NULL || targets_init(&t, n) == -1) {
+		free(addrs);
+		return;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		addrs[i] = addr;
+		addrs[i].sin_addr.s_addr = htonl(0x0a000000 + i);
+		targets_add(&t, &addrs[i], i, NULL);
+	}
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS; ++i)
+		sink += targets_find(&t, &addrs[(size_t)i * 7919 % n])->host;
+	table = (now_ns() - start) / ITERATIONS;
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS / 100; ++i) {
+		addr = addrs[(size_t)i * 7919 % n];
+		for (j = 0; addrs[j].sin_addr.s_addr != addr.sin_addr.s_addr; ++j)
+			;
+		sink += j;
+	}
+	scan = (now_ns() - start) / (ITERATIONS / 100);
+	printf("targets: %5zu hosts, ack matched in %6.1f ns, %8.1f ns scanning\n",
+		n, table, scan);
+	targets_free(&t);
+	free(addrs);
+}
+
+int main(void)
+{
+	for (uint8_t version = 1; version <= PROTO_VERSION; ++version)
+		bench_codec(version);
+	bench_acl(16);
+	bench_acl(10000);
+	for (uint8_t alg = SIG_LEGACY; alg <= SIG_ED25519; ++alg)
+		bench_sig(alg);
+	bench_trust(256);
+	bench_session();
+	bench_merkle(16);
+	bench_merkle(4096);
+	bench_dedupe();
+	bench_fanout(10000);
+	bench_targets(50000);
+	return 0;
+}
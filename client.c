@@ -1,45 +1,112 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <poll.h>
 
 #include "common.h"
 #include "protocol.h"
 #include "addr.h"
+#include "auth.h"
+#include "session.h"
+#include "merkle.h"
+#include "tx.h"
+#include "rx.h"
+#include "targets.h"
+#include "replay.h"
+#include "sweep.h"
 
 #define DEFAULT_PORT	6969	// TODO: move this into a common header file
 #define DEFAULT_TIMER	5
+#define HANDSHAKE_TIMEOUT_MS	2000	/* wait for sessions to open */
+#define SESSION_MARGIN_MS	60000	/* sessions expiring sooner are opened again */
+#define DEFAULT_TRIES	3
+#define ACK_BATCH	256	/* acks received per syscall */
+#define ACK_RCVBUF	(4 << 20)	/* room for a burst of acks from many hosts */
+#define RESTAMP_MS	(REPLAY_FRESH_MS / 2)	/* a sweep's query is stamped anew */
 
 struct {
 	int		port;		/* port number */
 	char		*request;	/* request message */
 	int		targets_i;	/* index of argv from which target IPs start */
-	int32_t		timer;		/* shutdown timer */
+	int64_t		timer_ms;	/* shutdown timer */
+	uint32_t	id;		/* scheduled command to abort, 0 for all */
+	int64_t		deadline;	/* wall clock time to act in ms, 0 if none */
+	int64_t		stagger_ms;	/* delay between hosts, 0 for none */
+	int		wire;		/* wire format version */
+	uint64_t	client_id;	/* sender of v2 requests, for replay protection */
 	char		*ifname;	/* interface name */
 	char		*msg;		/* notification message to send to server */
 	char		*pvtkey;	/* private key */
+	bool		key_id;		/* name the key in v2 requests, for trust stores */
+	char		*sessions;	/* directory of session keys, NULL for none */
 	int		timeout;	/* timeout while waiting for ack */
-	int		ntries;		/* no of times to resend when ack not received */
+	int		ntries;		/* no of times to send a request to a host not acking it */
+	int		window;		/* hosts queried at once by a sweep, 0 if none */
 	int		broadcast;	/* 1 if broadcast, else 0 */
 	bool		verbose;	/* talk more */
 	bool		ipv6;		/* true if IPv6 */
 	bool		force;		/* force action, do not wait for user input */
 } argopts;
 
+/* totals of sending to every host, over each txvec_send() */
+struct fanout {
+	size_t		sent, failed;
+	unsigned int	syscalls;
+	int		error;		/* of the last datagram that failed */
+	int64_t		start;		/* monotonic time in us */
+};
+
+/*
+ * What the hosts are sent, made once and sent again to those not answering:
+ * the signed request, the request to seal with each session, or with
+ * --stagger the signed Merkle root of the requests, each packed anew.
+ */
+struct outbox {
+	struct request		*req;
+	const struct sockaddr_in	*addrs;	/* of each host */
+	size_t			num_ips;
+	struct session		*sessions;	/* of each host, NULL for none */
+	bool			is_signed;	/* the payload or the tree */
+	unsigned char		payload[REQUEST_MAX_SIZE];	/* signed */
+	size_t			payload_size;
+	unsigned char		sealed[REQUEST_MAX_SIZE];	/* to seal per session */
+	size_t			sealed_size;
+	struct merkle_tree	*tree;
+	unsigned char		sig[sizeof(((struct signature *)0)->sig)];	/* of its root */
+	size_t			siglen;
+	unsigned char		(*bufs)[REQUEST_MAX_SIZE];	/* TXBATCH_MAX to pack into */
+	struct txvec		v;
+	struct fanout		f;
+	int64_t			stamped;	/* monotonic ms */
+};
+
+static struct sweep sweep;
+
 static void parse_args(int *argc, char *argv[]);
 static void usage(char *pgmname);
 
 int create_socket(int domain, bool bcast);
 int fill_request(struct request *req);
-int send_request(int sockfd, struct request *req, struct sockaddr_in *addrs, size_t num_ips);
+struct session *open_sessions(int sockfd, struct request *req, struct sockaddr_in *addrs,
+		size_t num_ips, const struct targets *t);
+int outbox_init(struct outbox *o, struct request *req, const struct sockaddr_in *addrs,
+		size_t num_ips, struct session *sessions);
+void outbox_free(struct outbox *o);
+void send_request(int sockfd, struct outbox *o, struct targets *t);
+void report_acks(const struct targets *t);
+void report_sweep(const struct targets *t);
 
 int main(int argc, char *argv[])
 {
@@ -47,6 +114,10 @@ int main(int argc, char *argv[])
 	size_t addrsize = sizeof(*addrs);
 	int sockfd, ret = 0, num_ips;
 	char ipstr[INET6_ADDRSTRLEN];
+	struct session *sessions = NULL;
+	struct targets t = { 0 };
+	struct target *tgt;
+	struct outbox o = { 0 };
 	struct request req;
 
 	parse_args(&argc, argv);
@@ -81,6 +152,21 @@ int main(int argc, char *argv[])
 			puts(ipstr);
 #endif
 	}
+	/* a host named twice is sent one request */
+	if (targets_init(&t, num_ips + argopts.broadcast) == -1) {
+		perror("error allocating hosts");
+		ret = 1;
+		goto out;
+	}
+	for (int i = 0; i < num_ips + argopts.broadcast; ++i) {
+		if ((tgt = targets_add(&t, &addrs[i], i, NULL)) == NULL) {
+			perror("error allocating hosts");
+			ret = 1;
+			goto out;
+		}
+		if (argopts.broadcast && i == 0)
+			tgt->state = TARGET_BROADCAST;
+	}
 
 	if (fill_request(&req) == -1) {
 		ret = 1;
@@ -97,77 +183,895 @@ int main(int argc, char *argv[])
 		"pvtkey    = '%s'\n",
 		req.when, argopts.pvtkey);
 	sockfd = create_socket(AF_INET, argopts.broadcast);
-	send_request(sockfd, &req, addrs, num_ips + argopts.broadcast);
+	/* sessions are kept per host, broadcasts are always signed */
+	if (argopts.sessions && !argopts.broadcast)
+		sessions = open_sessions(sockfd, &req, addrs, num_ips, &t);
+	if (outbox_init(&o, &req, addrs, num_ips + argopts.broadcast, sessions) == -1) {
+		ret = 1;
+		goto out;
+	}
+	send_request(sockfd, &o, &t);
+	if (argopts.window)
+		report_sweep(&t);
+	else if (argopts.timeout > 0)
+		report_acks(&t);
 out:
+	outbox_free(&o);
+	targets_free(&t);
+	free(sessions);
 	free(addrs);
 	return ret;
 }
 
-int fill_request(struct request *req)
+static int64_t now_ms(void)
 {
-	/* argopts.request is mandatory and is checked in parse_args() */
-	if (parse_request(&req->req_type, argopts.request) == -1) {
-		fprintf(stderr, "invalid request '%s'", argopts.request);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* fanout_send:	Send the datagrams of $v, adding up what was sent in $f */
+static void fanout_send(struct fanout *f, struct txvec *v, int sockfd)
+{
+	const struct sockaddr_in *addr;
+	char ipstr[INET_ADDRSTRLEN];
+
+	txvec_send(v, sockfd);
+	f->sent += v->sent;
+	f->failed += v->failed;
+	f->syscalls += v->syscalls;
+	if (v->failed)
+		f->error = v->error;
+	/* one line per host is too much for thousands of them, unless asked */
+	for (size_t i = 0; argopts.verbose && i < v->count; ++i) {
+		addr = v->msgs[i].msg_hdr.msg_name;
+		inet_ntop(AF_INET, &addr->sin_addr, ipstr, sizeof(ipstr));
+		if (v->msgs[i].msg_len)
+			printf("sent payload (%u bytes) to %s\n", v->msgs[i].msg_len, ipstr);
+		else
+			printf("error sending payload to %s\n", ipstr);
+	}
+}
+
+/* fanout_report:	Print how sending went, $f having started at f->start */
+static void fanout_report(const struct fanout *f)
+{
+	double elapsed = (mono_us() - f->start) / 1e6;
+
+	printf("sent %zu datagram(s) in %.1f ms, %.0f/s, %u syscall(s)",
+		f->sent, elapsed * 1000, elapsed > 0 ? f->sent / elapsed : 0.0, f->syscalls);
+	if (f->failed)
+		printf(", %zu failed: %s", f->failed, strerror(f->error));
+	putchar('\n');
+}
+
+/*
+ * default_client_id:
+ * 	Return an id for this user on this host, the same for every run, so
+ * 	that the server tracks the sequence numbers of each sender separately.
+ */
+static uint64_t default_client_id(void)
+{
+	char host[256] = "";
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	uid_t uid = getuid();
+
+	gethostname(host, sizeof(host) - 1);
+	for (char *p = host; *p; ++p)
+		h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+	for (size_t i = 0; i < sizeof(uid); ++i)
+		h = (h ^ ((uid >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+	return h;
+}
+
+/* fill_command:	Fill in request $name in $req, with the options that apply */
+static int fill_command(struct request *req, char *name)
+{
+	if (parse_request(&req->req_type, name) == -1) {
+		fprintf(stderr, "invalid request '%s'", name);
+		return -1;
+	}
+	if (req->req_type == REQ_SESSION) {
+		fprintf(stderr, "sessions are opened with -S\n");
+		return -1;
+	}
+	if (argopts.timer_ms < 0) {
+		fprintf(stderr, "invalid timer value %ld ms\n", (long)argopts.timer_ms);
+		return -1;
+	}
+	if (req->req_type == REQ_POW_ABORT) {
+		/* abort carries the id of the command to abort instead */
+		req->timer = argopts.id;
+	} else if (argopts.deadline) {
+		/* the same deadline for every host, however late each one gets it */
+		SET_ABSTIME_BIT(req->req_type);
+		req->timer = 0;
+		req->deadline = argopts.deadline;
+	} else if (argopts.timer_ms % 1000 == 0 && argopts.timer_ms / 1000 <= INT32_MAX) {
+		req->timer = argopts.timer_ms / 1000;
+	} else if (argopts.timer_ms <= INT32_MAX) {
+		SET_MSEC_BIT(req->req_type);
+		req->timer = argopts.timer_ms;
+	} else {
+		fprintf(stderr, "timer too long for millisecond resolution\n");
 		return -1;
 	}
 	if (argopts.force) {
 		SET_FORCE_BIT(req->req_type);
 		printfv("set force bit: req_type = %x\n", req->req_type);
 	}
-	if (argopts.timer < 0) {
-		fprintf(stderr, "invalid timer value %d\n", argopts.timer);
-		return -1;
-	}
-	req->timer = argopts.timer;
 	req->msg_size = 0;
 	if (argopts.msg) {
 		req->msg_size = strlen(argopts.msg);
 		req->msg = argopts.msg;	/* NOTE: not copying */ 
 	}
-	req->when = time(NULL);
+	return 0;
 }
 
-int send_request(int sockfd, struct request *req, struct sockaddr_in *addrs, size_t num_ips)
+int fill_request(struct request *req)
 {
-	unsigned char *payload;
-	size_t payload_size, sigsize;
-	ssize_t ret;
-	char ipstr[INET6_ADDRSTRLEN];
+	static unsigned char batch[BATCH_MAXSIZE];
+	struct request cmds[BATCH_MAX];
+	char *name, *save;
+	int n = 0;
 
-	payload = pack_request(req, &payload_size);
-	if (!payload) {
-		perror("allocating payload failed");
+	memset(req, 0, sizeof(*req));
+	/* argopts.request is mandatory and is checked in parse_args() */
+	if (!strchr(argopts.request, ',')) {
+		if (fill_command(req, argopts.request) == -1)
+			return -1;
+		if (argopts.stagger_ms && (req->req_type & ~REQ_FLAG_BITS) > REQ_POW_HIBERNATE) {
+			fprintf(stderr, "only power requests can be staggered\n");
+			return -1;
+		}
+	} else {
+		/* several commands go in one batch, signed and verified once */
+		if (argopts.wire < 2) {
+			fprintf(stderr, "batches need wire format 2\n");
+			return -1;
+		}
+		if (argopts.stagger_ms) {
+			fprintf(stderr, "batches cannot be staggered\n");
+			return -1;
+		}
+		for (name = strtok_r(argopts.request, ",", &save); name;
+				name = strtok_r(NULL, ",", &save)) {
+			if (n == BATCH_MAX) {
+				fprintf(stderr, "at most %d requests in a batch\n", BATCH_MAX);
+				return -1;
+			}
+			memset(&cmds[n], 0, sizeof(cmds[n]));
+			if (fill_command(&cmds[n++], name) == -1)
+				return -1;
+		}
+		req->req_type = REQ_BATCH;
+		/* the skew of the acks is measured as for a deadline of its own */
+		if (argopts.deadline)
+			SET_ABSTIME_BIT(req->req_type);
+		if ((req->msg_size = pack_batch(cmds, n, batch, sizeof(batch))) == 0) {
+			fprintf(stderr, "batch does not fit in a datagram\n");
+			return -1;
+		}
+		req->msg = batch;
+		printfv("batch of %d requests, %d bytes\n", n, req->msg_size);
+	}
+	req->when = time(NULL);
+	req->version = argopts.wire;
+	/* v2 names the algorithm, fixed size signatures where the key has one */
+	req->sigalg = SIG_LEGACY;
+	if (req->version >= 2 && (req->sigalg = sig_key_alg(argopts.pvtkey)) == (uint8_t)-1)
 		return -1;
+	printfv("signature algorithm = %s\n", sig_alg_name(req->sigalg));
+	req->keyid = 0;
+	if (argopts.key_id && sig_key_id(argopts.pvtkey, &req->keyid) == -1)
+		return -1;
+	if (req->keyid)
+		printfv("key id = %016llx\n", (unsigned long long)req->keyid);
+	req->client_id = argopts.client_id ? argopts.client_id : default_client_id();
+	return 0;
+}
+
+/*
+ * stamp_request:
+ * 	Set the send time and sequence number of $req. Sequence numbers come
+ * 	from a counter per client id in the home directory, shared by every
+ * 	sender using that id there; without one the wall clock in
+ * 	microseconds stands in, which concurrent senders can race.
+ */
+static void stamp_request(struct request *req)
+{
+	static bool warned;
+	char path[PATH_MAX];
+	const char *home = getenv("HOME");
+	struct timespec ts;
+
+	/* the server measures its skew from this, it cannot be any later */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	req->sent = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	snprintf(path, sizeof(path), "%s/.lsd-seq-%016llx", home ? home : "",
+		(unsigned long long)req->client_id);
+	if (home && replay_next_seq(path, &req->seq) == 0)
+		return;
+	if (!warned) {
+		fprintf(stderr, "no sequence counter at '%s', using the clock\n", path);
+		warned = true;
 	}
-	/* sign message */
-	if (!sign_request(payload, &payload_size, &sigsize, argopts.pvtkey)) {
-		fprintf(stderr, "error signing request\n");
+	req->seq = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* path of the file in argopts.sessions holding the session with $addr */
+static char *session_path(const struct sockaddr_in *addr, char *path, size_t size)
+{
+	char ipstr[INET_ADDRSTRLEN] = "";
+
+	inet_ntop(AF_INET, &addr->sin_addr, ipstr, sizeof(ipstr));
+	snprintf(path, size, "%s/%s:%d", argopts.sessions, ipstr, ntohs(addr->sin_port));
+	return path;
+}
+
+/*
+ * load_session:
+ * 	Read the session with $addr into $s, unless it is about to expire.
+ * 	Returns -1 if there is none and 0 on success.
+ */
+static int load_session(const struct sockaddr_in *addr, struct session *s)
+{
+	char path[PATH_MAX], key[2 * SESSION_KEY_SIZE + 1];
+	unsigned long long id;
+	long long expires;
+	FILE *fp;
+	int n;
+
+	if ((fp = fopen(session_path(addr, path, sizeof(path)), "r")) == NULL)
 		return -1;
+	n = fscanf(fp, "%llx %lld %64s", &id, &expires, key);
+	fclose(fp);
+	if (n != 3 || strlen(key) != 2 * SESSION_KEY_SIZE
+			|| expires - SESSION_MARGIN_MS < now_ms())
+		return -1;
+	for (int i = 0; i < SESSION_KEY_SIZE; ++i)
+		if (sscanf(key + 2 * i, "%2hhx", &s->key[i]) != 1)
+			return -1;
+	s->id = id;
+	s->expires = expires;
+	return 0;
+}
+
+/* save_session:	Write the session with $addr, readable by its owner alone */
+static void save_session(const struct sockaddr_in *addr, const struct session *s)
+{
+	char path[PATH_MAX];
+	FILE *fp = NULL;
+	int fd;
+
+	fd = open(session_path(addr, path, sizeof(path)), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		fprintf(stderr, "error saving session '%s': %s\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return;
 	}
+	fprintf(fp, "%016llx %lld ", (unsigned long long)s->id, (long long)s->expires);
+	for (int i = 0; i < SESSION_KEY_SIZE; ++i)
+		fprintf(fp, "%02x", s->key[i]);
+	fputc('\n', fp);
+	fclose(fp);
+}
 
-	for (int i = 0; i < num_ips; ++i) {
-		ret = sendto(sockfd, payload, payload_size, 0,
-				(struct sockaddr *)&addrs[i], sizeof(*addrs));
-		if (inet_ntop(AF_INET, &addrs[i].sin_addr, ipstr, sizeof(ipstr)))
-			printf("sent payload (%zd bytes) to %s\n", ret, ipstr);
+/*
+ * open_sessions:
+ * 	Return the sessions with the $num_ips hosts at $addrs, those not saved
+ * 	in argopts.sessions being opened by a handshake with the client id and
+ * 	signature algorithm of $req. Hosts named twice, only once in $t, get
+ * 	one session. Hosts without one (id 0) are sent signed requests.
+ * 	Returns NULL on error.
+ */
+struct session *open_sessions(int sockfd, struct request *req, struct sockaddr_in *addrs,
+		size_t num_ips, const struct targets *t)
+{
+	unsigned char pub[SESSION_PUB_SIZE], buf[REQUEST_MAX_SIZE];
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	struct request hs = *req;
+	struct session_reply reply;
+	struct session_kex *kex;
+	struct session *sessions;
+	struct sockaddr_in addr;
+	struct target *tgt;
+	struct txvec v;
+	socklen_t addrlen;
+	size_t size, sigsize, pending = 0, i;
+	int64_t end;
+	ssize_t n;
 
-		if (ret == -1) {
-			perror("error sending payload");
+	if ((sessions = calloc(num_ips, sizeof(*sessions))) == NULL) {
+		perror("error allocating sessions");
+		return NULL;
+	}
+	for (size_t k = 0; k < t->count; ++k) {
+		i = t->v[k].host;
+		pending += load_session(&addrs[i], &sessions[i]) == -1;
+	}
+	printfv("%zu session(s) to open\n", pending);
+	if (!pending || (kex = session_kex_new(pub)) == NULL)
+		return sessions;
+
+	/* one key for every host, each answers with its own */
+	hs.req_type = REQ_SESSION;
+	hs.timer = 0;
+	hs.msg = pub;
+	hs.msg_size = SESSION_PUB_SIZE;
+	stamp_request(&hs);
+	if ((size = pack_request(&hs, buf, sizeof(buf))) == 0
+			|| !sign_request(buf, &size, &sigsize, argopts.pvtkey)) {
+		fprintf(stderr, "error signing session request\n");
+		goto out;
+	}
+	if (txvec_init(&v, pending) == -1) {
+		perror("error allocating session requests");
+		goto out;
+	}
+	for (size_t k = 0; k < t->count; ++k) {
+		i = t->v[k].host;
+		if (!sessions[i].id)
+			txvec_add(&v, buf, size, (struct sockaddr *)&addrs[i], sizeof(*addrs));
+	}
+	if (txvec_send(&v, sockfd) < v.count)
+		fprintf(stderr, "error sending %zu session request(s): %s\n", v.failed,
+			strerror(v.error));
+	txvec_free(&v);
+
+	end = now_ms() + HANDSHAKE_TIMEOUT_MS;
+	while (pending && now_ms() < end) {
+		if (poll(&pfd, 1, MAX(end - now_ms(), 0)) <= 0)
+			continue;
+		addrlen = sizeof(addr);
+		n = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addrlen);
+		if (n == -1 || unpack_session_reply(&reply, buf, n) == -1)
+			continue;
+		if ((tgt = targets_find(t, &addr)) == NULL)
+			continue;
+		i = tgt->host;
+		if (sessions[i].id
+				|| session_kex_finish(kex, hs.client_id, &reply, now_ms(),
+					&sessions[i]) == -1)
 			continue;
+		save_session(&addrs[i], &sessions[i]);
+		--pending;
+	}
+	if (pending)
+		printf("no session with %zu host(s), signing requests to them\n", pending);
+out:
+	session_kex_free(kex);
+	return sessions;
+}
+
+/*
+ * pack_staggered:
+ * 	Pack the request for the $i-th host into $buf, $req with its timer or
+ * 	deadline argopts.stagger_ms later than for the host before, as leaf
+ * 	$i of $count if $count is not 0, else sealed with session $s.
+ * 	Returns the size of the packed request, or 0 on error.
+ */
+static size_t pack_staggered(const struct request *req, size_t i, uint32_t count,
+		const struct session *s, unsigned char *buf, size_t size)
+{
+	struct request hreq = *req;
+	int64_t delay = (int64_t)i * argopts.stagger_ms;
+
+	if (GET_ABSTIME_BIT(hreq.req_type)) {
+		hreq.deadline += delay;
+	} else if (argopts.timer_ms + delay <= INT32_MAX) {
+		SET_MSEC_BIT(hreq.req_type);
+		hreq.timer = argopts.timer_ms + delay;
+	} else {
+		fprintf(stderr, "staggered timer too long for millisecond resolution\n");
+		return 0;
+	}
+	if (count) {
+		hreq.proof.count = count;
+		return pack_request(&hreq, buf, size);
+	}
+	hreq.sigalg = SIG_HMAC_SHA256;
+	hreq.keyid = 0;
+	if ((size = pack_request(&hreq, buf, size)) == 0)
+		return 0;
+	return session_seal(s, buf, size);
+}
+
+/*
+ * outbox_sign:
+ * 	Sign what $o sends the hosts without a session, unless done already:
+ * 	the request, or with --stagger the Merkle root of all the requests,
+ * 	each host getting its own (see pack_staggered()).
+ * 	Returns -1 on error and 0 on success.
+ */
+static int outbox_sign(struct outbox *o)
+{
+	unsigned char (*leaves)[MERKLE_HASH_SIZE] = NULL, buf[REQUEST_MAX_SIZE];
+	size_t size, sigsize;
+	int err = -1;
+
+	if (o->is_signed)
+		return 0;
+	if (!argopts.stagger_ms) {
+		if ((o->payload_size = pack_request(o->req, o->payload, sizeof(o->payload))) == 0) {
+			fprintf(stderr, "request does not fit in a datagram\n");
+			return -1;
 		}
+		/* sign message */
+		if (!sign_request(o->payload, &o->payload_size, &sigsize, argopts.pvtkey)) {
+			fprintf(stderr, "error signing request\n");
+			return -1;
+		}
+		o->is_signed = true;
+		return 0;
+	}
+
+	if ((leaves = malloc(o->num_ips * sizeof(*leaves))) == NULL) {
+		perror("error allocating requests");
+		return -1;
+	}
+	/* hash the requests as they are sent, packing them twice is cheap */
+	for (size_t i = 0; i < o->num_ips; ++i) {
+		size = pack_staggered(o->req, i, o->num_ips, NULL, buf, sizeof(buf));
+		merkle_leaf(o->addrs[i].sin_addr.s_addr, buf, size, leaves[i]);
+	}
+	if ((o->tree = merkle_build(leaves, o->num_ips)) == NULL
+			|| merkle_sign(o->tree, argopts.pvtkey, o->req->sigalg, o->sig,
+				&o->siglen) == -1) {
+		fprintf(stderr, "error signing requests\n");
+		goto out;
 	}
+	printfv("signed the Merkle root of %zu requests\n", o->num_ips);
+	o->is_signed = true;
+	err = 0;
+out:
+	free(leaves);
+	return err;
+}
+
+/*
+ * outbox_stamp:
+ * 	Stamp the request of $o anew, and seal and sign it again: at once if
+ * 	any host lacks a session, otherwise only once one loses it.
+ * 	Returns -1 on error and 0 on success.
+ */
+static int outbox_stamp(struct outbox *o)
+{
+	struct request sreq;
+	bool sign = !o->sessions;
+
+	stamp_request(o->req);
+	o->stamped = mono_us() / 1000;
+	merkle_tree_free(o->tree);
+	o->tree = NULL;
+	o->is_signed = false;
+	for (size_t i = 0; o->sessions && i < o->num_ips; ++i)
+		sign |= !o->sessions[i].id;
+	if (o->sessions && !argopts.stagger_ms) {
+		/* hosts with a session get the same request with a tag instead */
+		sreq = *o->req;
+		sreq.sigalg = SIG_HMAC_SHA256;
+		sreq.keyid = 0;	/* the session stands for the key */
+		if ((o->sealed_size = pack_request(&sreq, o->sealed, sizeof(o->sealed))) == 0) {
+			fprintf(stderr, "request does not fit in a datagram\n");
+			return -1;
+		}
+	}
+	return sign ? outbox_sign(o) : 0;
+}
+
+/*
+ * outbox_init:
+ * 	Stamp $req and get what each of the $num_ips hosts at $addrs is sent
+ * 	ready in $o. Hosts without a session share one signature (see
+ * 	outbox_sign()). Hosts with one get the request sealed with it.
+ * 	Returns -1 on error and 0 on success; $o is to be freed either way.
+ */
+int outbox_init(struct outbox *o, struct request *req, const struct sockaddr_in *addrs,
+		size_t num_ips, struct session *sessions)
+{
+	unsigned char buf[REQUEST_MAX_SIZE];
+
+	memset(o, 0, sizeof(*o));
+	o->req = req;
+	o->addrs = addrs;
+	o->num_ips = num_ips;
+	o->sessions = sessions;
+	if ((o->bufs = malloc(TXBATCH_MAX * sizeof(*o->bufs))) == NULL
+			|| txvec_init(&o->v, TXBATCH_MAX) == -1) {
+		perror("error allocating requests");
+		return -1;
+	}
+
+	if (argopts.stagger_ms) {
+		if (num_ips > MERKLE_MAX_LEAVES) {
+			fprintf(stderr, "at most %d hosts with --stagger\n", MERKLE_MAX_LEAVES);
+			return -1;
+		}
+		/* the last host has the longest timer, if it fits they all do */
+		if (pack_staggered(req, num_ips - 1, 1, NULL, buf, sizeof(buf)) == 0)
+			return -1;
+	}
+	return outbox_stamp(o);
+}
+
+void outbox_free(struct outbox *o)
+{
+	merkle_tree_free(o->tree);
+	txvec_free(&o->v);
+	free(o->bufs);
+	o->tree = NULL;
+	o->bufs = NULL;
+}
+
+/*
+ * outbox_datagram:
+ * 	Return the request for host $host of $o, the shared signed one or one
+ * 	packed into the REQUEST_MAX_SIZE bytes at $buf, and set *$size to its
+ * 	size. outbox_init() checked that every request fits.
+ */
+static const unsigned char *outbox_datagram(struct outbox *o, uint32_t host, unsigned char *buf,
+		size_t *size)
+{
+	const struct session *s = o->sessions && o->sessions[host].id ? &o->sessions[host] : NULL;
+
+	if (argopts.stagger_ms) {
+		if (s)
+			*size = pack_staggered(o->req, host, 0, s, buf, REQUEST_MAX_SIZE);
+		else if ((*size = pack_staggered(o->req, host, o->num_ips, NULL, buf,
+						REQUEST_MAX_SIZE)) != 0)
+			*size = merkle_seal(o->tree, host, o->sig, o->siglen, buf, *size,
+					REQUEST_MAX_SIZE);
+		return buf;
+	}
+	if (!s) {
+		*size = o->payload_size;
+		return o->payload;
+	}
+	memcpy(buf, o->sealed, o->sealed_size);
+	*size = session_seal(s, buf, o->sealed_size);
+	return buf;
+}
+
+/*
+ * outbox_send:
+ * 	Send the $n hosts of $t listed in $which their request, TXBATCH_MAX at
+ * 	a time, counting the sends and the errors of each.
+ */
+static void outbox_send(struct outbox *o, int sockfd, struct targets *t, const uint32_t *which,
+		size_t n)
+{
+	const unsigned char *buf;
+	struct target *tgt;
+	size_t size, count;
+
+	for (size_t i = 0; i < n; i += count) {
+		count = MIN(n - i, TXBATCH_MAX);
+		txvec_clear(&o->v);
+		for (size_t k = 0; k < count; ++k) {
+			tgt = &t->v[which[i + k]];
+			buf = outbox_datagram(o, tgt->host, o->bufs[k], &size);
+			txvec_add(&o->v, buf, size, (struct sockaddr *)&tgt->addr, sizeof(tgt->addr));
+		}
+		fanout_send(&o->f, &o->v, sockfd);
+		for (size_t k = 0; k < count; ++k) {
+			tgt = &t->v[which[i + k]];
+			tgt->sends += tgt->sends < UINT8_MAX;
+			tgt->errors += !o->v.msgs[k].msg_len && tgt->errors < UINT8_MAX;
+		}
+	}
+}
+
+/* ack_str:	Return what ack status $ack means */
+static const char *ack_str(uint16_t ack)
+{
+	switch (ack) {
+	case ACK_GRANTED:
+		return "granted";
+	case ACK_REPLAYED:
+		/* a copy sent before was granted, the dedupe cache forgot it */
+		return "granted before";
+	case ACK_DISABLED:
+		return "disabled";
+	}
+	return "denied";
+}
+
+/* print_target:	Print what became of the request sent to $tgt */
+static void print_target(const struct target *tgt)
+{
+	char ipstr[INET_ADDRSTRLEN], cmd[16];
+
+	inet_ntop(AF_INET, &tgt->addr.sin_addr, ipstr, sizeof(ipstr));
+	if (tgt->state == TARGET_WAITING) {
+		if (!tgt->sends)
+			printf("%s: not sent, out of time\n", ipstr);
+		else if (tgt->errors == tgt->sends)
+			printf("%s: error sending request\n", ipstr);
+		else
+			printf("%s: no reply, sent %u time(s)\n", ipstr, tgt->sends);
+		return;
+	}
+	if (tgt->ack == ACK_NO_SESSION) {
+		printf("%s: session expired, request ignored\n", ipstr);
+		return;
+	}
+	printf("%s: %s, skew %ld ms, %u pending", ipstr, ack_str(tgt->ack), (long)tgt->skew,
+		tgt->npending);
+	if (tgt->failed)
+		printf(", batch not applied, request %u failed", tgt->failed);
+	if (tgt->fired.id)
+		printf(", %s %u carried out at %ld (%+ld ms)",
+			reqstr(tgt->fired.powcmd, cmd, sizeof(cmd)) ? cmd : "command",
+			tgt->fired.id, (long)tgt->fired_at, (long)(tgt->fired_at - tgt->fired.due));
+	if (tgt->fallback)
+		printf(", session lost, sent signed");
+	if (tgt->sends > 1)
+		printf(", sent %u times", tgt->sends);
+	putchar('\n');
+}
+
+/* print_sweep:	Print what $tgt, queried by a sweep, answered in $ack */
+static void print_sweep(const struct target *tgt, const struct sstate *ack)
+{
+	char ipstr[INET_ADDRSTRLEN], cmd[16];
+
+	if (sweep_refused(ack)) {
+		print_target(tgt);
+		return;
+	}
+	inet_ntop(AF_INET, &tgt->addr.sin_addr, ipstr, sizeof(ipstr));
+	printf("%s:", ipstr);
+	if (!ack->npending)
+		printf(" nothing pending");
+	for (int i = 0; i < ack->npending; ++i)
+		printf("%s %s %u in %ld s", i ? "," : "",
+			reqstr(ack->pending[i].powcmd & ~REQ_FLAG_BITS, cmd, sizeof(cmd))
+			? cmd : "command", ack->pending[i].id, (long)(sweep_left(ack, i) / 1000));
+	putchar('\n');
+}
+
+/*
+ * fall_back:
+ * 	Send $tgt, whose session the server no longer knows, the request of
+ * 	$o signed from now on, as if never sent before.
+ * 	Returns -1 on error and 0 on success.
+ */
+static int fall_back(struct outbox *o, struct target *tgt)
+{
+	if (outbox_sign(o) == -1)
+		return -1;
+	o->sessions[tgt->host].id = 0;
+	tgt->fallback = 1;
+	tgt->sends = 0;
+	tgt->errors = 0;
+	tgt->next = 0;
 	return 0;
 }
 
+/*
+ * receive_acks:
+ * 	Take the acks received in $batch for the hosts of $t, the hosts
+ * 	answering a broadcast being added to it. Hosts refusing the request of
+ * 	$o sealed with their session are sent it signed instead. Returns the
+ * 	number of hosts that answered.
+ */
+static size_t receive_acks(struct rxbatch *batch, struct outbox *o, struct targets *t)
+{
+	const struct sockaddr_in *addr;
+	struct target *tgt;
+	struct sstate ack;
+	char path[PATH_MAX];
+	size_t answered = 0;
+
+	for (unsigned int i = 0; i < batch->count; ++i) {
+		addr = (struct sockaddr_in *)&batch->slots[i].addr;
+		if (batch->slots[i].addrlen != sizeof(*addr)
+				|| unpack_sstate(&ack, (char *)batch->slots[i].buf,
+					batch->slots[i].len) == -1)
+			continue;
+		if ((tgt = targets_find(t, addr)) == NULL && argopts.broadcast)
+			tgt = targets_add(t, addr, 0, NULL);
+		/* strays, copies of an ack, and our own broadcast */
+		if (!tgt || tgt->state != TARGET_WAITING)
+			continue;
+		/*
+		 * Anyone can send a refusal: the session is dropped only once
+		 * the signed request is answered, the next run opening another
+		 */
+		if (ack.ack == ACK_NO_SESSION && o->sessions && o->sessions[tgt->host].id
+				&& fall_back(o, tgt) == 0)
+			continue;
+		if (tgt->fallback && ack.ack != ACK_NO_SESSION)
+			unlink(session_path(addr, path, sizeof(path)));
+		target_answer(tgt, &ack);
+		if (argopts.window) {
+			print_sweep(tgt, &ack);
+			sweep_add(&sweep, &ack);
+		} else if (argopts.verbose)
+			print_target(tgt);
+		++answered;
+	}
+	return answered;
+}
+
+/*
+ * send_request:
+ * 	Send every host of $t its request in $o, then, with argopts.timeout,
+ * 	wait that many seconds for their acks. Hosts not answering are sent it
+ * 	again, up to argopts.ntries times in all, with the wait doubling from
+ * 	RETRY_MS each time. The requests sent again are the very same, so a
+ * 	server that got one before answers from its dedupe cache. A broadcast
+ * 	is sent argopts.ntries times, as who has to answer it is unknown.
+ * 	A sweep (argopts.window) has at most that many hosts waiting for an
+ * 	ack at once, gives up on a host after the wait following its last
+ * 	send, and waits for all of them unless argopts.timeout says otherwise.
+ * 	Its query is stamped anew every RESTAMP_MS, so the hosts queried last
+ * 	do not find it stale.
+ */
+void send_request(int sockfd, struct outbox *o, struct targets *t)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	struct rxbatch batch = { 0 };
+	struct pacer p;
+	size_t nresent = 0;
+	bool wait = argopts.timeout || argopts.window, first = true;
+	int64_t now, end, wake;
+
+	if (pacer_init(&p, t->count, argopts.window, argopts.ntries, argopts.window) == -1
+			|| (wait && rxbatch_init(&batch, ACK_BATCH) == -1)) {
+		perror("error allocating hosts");
+		pacer_free(&p);
+		return;
+	}
+	o->f = (struct fanout){ .start = mono_us() };
+	now = mono_us() / 1000;
+	end = argopts.timeout ? now + argopts.timeout * 1000LL : INT64_MAX;
+	do {
+		/* forget the hosts that answered, and send again to those due */
+		wake = pacer_due(&p, t, now, end, print_target);
+		if (p.ndue && argopts.window && now - o->stamped >= RESTAMP_MS) {
+			printfv("stamping the query anew\n");
+			if (outbox_stamp(o) == -1)
+				break;
+		}
+		if (p.ndue) {
+			if (p.nretry)
+				printfv("sending again to %zu host(s)\n", p.nretry);
+			outbox_send(o, sockfd, t, p.due, p.ndue);
+			nresent += p.nretry;
+			wake = pacer_sent(&p, t, now, wake);
+		}
+		if (first && !argopts.window)
+			fanout_report(&o->f);
+		first = false;
+		if (!wait || !p.nwaiting)
+			break;
+		if (poll(&pfd, 1, MIN(MAX(wake - now, 0), INT_MAX)) > 0
+				&& rxbatch_recv(&batch, sockfd) > 0)
+			receive_acks(&batch, o, t);
+		now = mono_us() / 1000;
+	} while (now < end);
+	if (argopts.window)
+		fanout_report(&o->f);
+	if (nresent)
+		printf("sent %zu request(s) again\n", nresent);
+	rxbatch_free(&batch);
+	pacer_free(&p);
+}
+
+/*
+ * report_acks:
+ * 	Print what became of the request for every host of $t, but for those
+ * 	printed as they answered with -v, and sum it up. The last command
+ * 	carried out by each host is compared with its deadline, so a query
+ * 	after a command sent with --at shows how closely the hosts kept to it.
+ */
+void report_acks(const struct targets *t)
+{
+	int64_t first = 0, last = 0, minlate = 0, maxlate = 0, minskew = 0, maxskew = 0, late;
+	size_t nacks = 0, nskews = 0, nfired = 0, nsilent = 0;
+	const struct target *tgt;
+
+	for (size_t i = 0; i < t->count; ++i) {
+		tgt = &t->v[i];
+		if (tgt->state == TARGET_BROADCAST)
+			continue;
+		if (!argopts.verbose || tgt->state != TARGET_ANSWERED)
+			print_target(tgt);
+		if (tgt->state == TARGET_WAITING) {
+			++nsilent;
+			continue;
+		}
+		++nacks;
+		if (tgt->ack == ACK_NO_SESSION)
+			continue;
+		/* answered late for a copy seen before, its skew says nothing */
+		if (tgt->ack != ACK_REPLAYED) {
+			minskew = nskews ? MIN(minskew, tgt->skew) : tgt->skew;
+			maxskew = nskews ? MAX(maxskew, tgt->skew) : tgt->skew;
+			++nskews;
+		}
+		if (tgt->fired.id) {
+			late = tgt->fired_at - tgt->fired.due;
+			first = nfired ? MIN(first, tgt->fired_at) : tgt->fired_at;
+			last = nfired ? MAX(last, tgt->fired_at) : tgt->fired_at;
+			minlate = nfired ? MIN(minlate, late) : late;
+			maxlate = nfired ? MAX(maxlate, late) : late;
+			++nfired;
+		}
+	}
+	printf("%zu ack(s)", nacks);
+	if (nskews)
+		printf(", skew %ld..%ld ms", (long)minskew, (long)maxskew);
+	if (nfired)
+		printf(", execution spread %ld ms (%+ld..%+ld ms from deadline)",
+			(long)(last - first), (long)minlate, (long)maxlate);
+	if (nsilent)
+		printf(", %zu host(s) not answering", nsilent);
+	putchar('\n');
+}
+
+/*
+ * report_sweep:
+ * 	Sum up what the hosts of $t queried by a sweep have pending, and list
+ * 	those that did not answer.
+ */
+void report_sweep(const struct targets *t)
+{
+	char ipstr[INET_ADDRSTRLEN], cmd[16];
+	size_t nacks = 0, nsilent = 0;
+
+	for (size_t i = 0; i < t->count; ++i)
+		if (t->v[i].state == TARGET_ANSWERED)
+			++nacks;
+		else
+			++nsilent;
+	printf("%zu of %zu host(s) answered", nacks, nacks + nsilent);
+	if (sweep.refused)
+		printf(", %zu refusing the query", sweep.refused);
+	putchar('\n');
+	for (uint16_t c = 0; c <= REQ_MAX; ++c)
+		if (sweep.hosts[c])
+			printf("%-12s %zu host(s), due in %ld..%ld s\n",
+				reqstr(c, cmd, sizeof(cmd)) ? cmd : "command", sweep.hosts[c],
+				(long)(sweep.first[c] / 1000), (long)(sweep.last[c] / 1000));
+	if (sweep.idle)
+		printf("%-12s %zu host(s)\n", "idle", sweep.idle);
+	if (!nsilent)
+		return;
+	printf("%-12s", "no reply");
+	for (size_t i = 0; i < t->count; ++i) {
+		if (t->v[i].state == TARGET_ANSWERED)
+			continue;
+		inet_ntop(AF_INET, &t->v[i].addr.sin_addr, ipstr, sizeof(ipstr));
+		printf(" %s", ipstr);
+	}
+	putchar('\n');
+}
+
 int create_socket(int domain, bool bcast)
 {
-	int sockfd;
+	int sockfd, rcvbuf = ACK_RCVBUF;
 
 	sockfd = socket(domain, SOCK_DGRAM, 0);
 	if (sockfd < 0) {
 		perror("error creating socket");
 		return -1;
 	}
+	/* capped by net.core.rmem_max, acks dropped beyond it are asked again */
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1)
+		perror("setsockopt: cannot enlarge receive buffer");
 	if (bcast) {
 		int optval = 1, ret;
 		ret = setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval));
@@ -184,15 +1088,25 @@ static void parse_args(int *argc, char *argv[])
 {
 	int c;
 
-	argopts.timer = DEFAULT_TIMER;
+	argopts.timer_ms = DEFAULT_TIMER * 1000;
+	argopts.wire = PROTO_VERSION;
 	argopts.port = DEFAULT_PORT;
 	argopts.pvtkey = DEFAULT_PVTKEY;
+	argopts.ntries = DEFAULT_TRIES;
 	static struct option long_options[] = {
 		{"port", required_argument, NULL, 'p'},
 		{"key", required_argument, NULL, 'k'},
+		{"key-id", no_argument, NULL, 'K'},
 		{"timer", required_argument, NULL, 't'},
+		{"id", required_argument, NULL, 'I'},
+		{"at", required_argument, NULL, 'a'},
+		{"stagger", required_argument, NULL, 's'},
+		{"wire", required_argument, NULL, 'W'},
+		{"client-id", required_argument, NULL, 'C'},
+		{"session", required_argument, NULL, 'S'},
 		{"timeout", required_argument, NULL, 'T'},
 		{"tries", required_argument, NULL, 'n'},
+		{"sweep", required_argument, NULL, 'Q'},
 		{"request", required_argument, NULL, 'r'},
 		{"interface", required_argument, NULL, 'i'},
 		{"message", required_argument, NULL, 'm'},
@@ -202,7 +1116,7 @@ static void parse_args(int *argc, char *argv[])
 		{NULL, 0, NULL, 0}
 	};
 	while (1) {
-		if ((c = getopt_long(*argc, argv, "vp:k:t:T:n:r:i:m:bf6", long_options, NULL))
+		if ((c = getopt_long(*argc, argv, "vp:k:Kt:I:a:s:W:C:S:T:n:Q:r:i:m:bf6", long_options, NULL))
 				== -1)
 			break;
 		switch (c) {
@@ -223,14 +1137,58 @@ static void parse_args(int *argc, char *argv[])
 			PDEBUG("pvtkey='%s'\n", argopts.pvtkey);
 			printfv("pvtkey='%s'\n", argopts.pvtkey);
 			break;
+		case 'K':
+			argopts.key_id = true;
+			PDEBUG("key-id\n");
+			break;
 		case 't':
-			argopts.timer = strtol(optarg, NULL, 10);
-			PDEBUG("timer=%d\n", argopts.timer);
-			if (argopts.timer < 0) {
+			/* fractions of a second are sent in milliseconds */
+			argopts.timer_ms = strtod(optarg, NULL) * 1000 + 0.5;
+			PDEBUG("timer=%ld ms\n", (long)argopts.timer_ms);
+			if (argopts.timer_ms < 0) {
 				fprintf(stderr, "invalid timer value, should be >= 0\n");
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'a':
+			/* seconds since the epoch, or from now with a leading '+' */
+			argopts.deadline = strtod(optarg, NULL) * 1000 + 0.5;
+			if (optarg[0] == '+')
+				argopts.deadline += now_ms();
+			PDEBUG("deadline=%ld ms\n", (long)argopts.deadline);
+			if (argopts.deadline <= 0) {
+				fprintf(stderr, "invalid deadline\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			argopts.stagger_ms = strtod(optarg, NULL) * 1000 + 0.5;
+			PDEBUG("stagger=%ld ms\n", (long)argopts.stagger_ms);
+			if (argopts.stagger_ms <= 0) {
+				fprintf(stderr, "invalid stagger, should be > 0\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'W':
+			argopts.wire = strtol(optarg, NULL, 10);
+			if (argopts.wire < 1 || argopts.wire > PROTO_VERSION) {
+				fprintf(stderr, "wire format version should be 1 to %d\n",
+					PROTO_VERSION);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'C':
+			argopts.client_id = strtoull(optarg, NULL, 16);
+			PDEBUG("client_id=%llx\n", (unsigned long long)argopts.client_id);
+			break;
+		case 'S':
+			argopts.sessions = optarg;
+			PDEBUG("sessions='%s'\n", argopts.sessions);
+			break;
+		case 'I':
+			argopts.id = strtoul(optarg, NULL, 10);
+			PDEBUG("id=%u\n", argopts.id);
+			break;
 		case 'T':
 			argopts.timeout = strtol(optarg, NULL, 10);
 			PDEBUG("timeout=%d\n", argopts.timeout);
@@ -242,6 +1200,19 @@ static void parse_args(int *argc, char *argv[])
 		case 'n':
 			argopts.ntries = strtol(optarg, NULL, 10);
 			PDEBUG("ntries=%d\n", argopts.ntries);
+			if (argopts.ntries < 1 || argopts.ntries > UINT8_MAX) {
+				fprintf(stderr, "invalid number of tries, should be 1 to %d\n",
+					UINT8_MAX);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'Q':
+			argopts.window = strtol(optarg, NULL, 10);
+			PDEBUG("window=%d\n", argopts.window);
+			if (argopts.window <= 0) {
+				fprintf(stderr, "invalid sweep window, should be > 0\n");
+				exit(EXIT_FAILURE);
+			}
 			break;
 		case 'r':
 			argopts.request = optarg;
@@ -272,6 +1243,26 @@ static void parse_args(int *argc, char *argv[])
 			break;
 		}
 	}
+	if (argopts.key_id && argopts.wire < 2) {
+		fprintf(stderr, "key ids need wire format 2\n");
+		exit(EXIT_FAILURE);
+	}
+	if (argopts.sessions && argopts.wire < 2) {
+		fprintf(stderr, "sessions need wire format 2\n");
+		exit(EXIT_FAILURE);
+	}
+	if (argopts.stagger_ms && (argopts.wire < 2 || argopts.broadcast)) {
+		fprintf(stderr, "staggered requests need wire format 2 and no broadcast\n");
+		exit(EXIT_FAILURE);
+	}
+	if (argopts.window) {
+		if (!argopts.request)
+			argopts.request = "query";
+		if (strcmp(argopts.request, "query") != 0 || argopts.broadcast) {
+			fprintf(stderr, "sweeps only query, and need the host addresses\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 	if (argopts.broadcast && !argopts.ifname) {
 		fprintf(stderr, "ifname required if broadcast\n");
 		exit(EXIT_FAILURE);
@@ -299,10 +1290,44 @@ void usage(char *pgmname)
 	"\nUsage: %s [options] ip(s)\n\n"
 	"-p, --port=PORT           specify port number of daemon on server\n"
 	"\n"
-	"-t, --timer=SECONDS       when to schedule command\n"
+	"-t, --timer=SECONDS       when to schedule command, with millisecond resolution\n"
+	"\n"
+	"-a, --at=TIME             when to carry out command, in seconds since the epoch or\n"
+	"                          from now with a leading '+'; the same for all hosts\n"
+	"\n"
+	"-s, --stagger=SECONDS     carry out the command this much later on each host than\n"
+	"                          on the one before it; the requests are signed at once\n"
+	"\n"
+	"-I, --id=ID               scheduled command to abort (default: all of them)\n"
+	"\n"
+	"-W, --wire=VERSION        wire format to send, 1 for servers predating version 2\n"
+	"                          (default: 2)\n"
+	"\n"
+	"-C, --client-id=HEX       id the server tracks the sequence numbers of requests by;\n"
+	"                          senders sharing one take them from ~/.lsd-seq-ID, so\n"
+	"                          they must share that file to send concurrently\n"
+	"                          (default: derived from host name and user)\n"
+	"\n"
+	"-S, --session=DIR         authenticate requests with a session key per host,\n"
+	"                          kept in DIR, instead of signing each of them; a\n"
+	"                          signed handshake opens the sessions not in DIR\n"
+	"\n"
+	"-T, --timeout=SECONDS     wait this long for acks, and show what each host answered,\n"
+	"                          the skew and the spread of execution times of the hosts\n"
+	"\n"
+	"-n, --tries=N             with -T, send the request up to N times to hosts not\n"
+	"                          answering, waiting twice as long each time (default: 3)\n"
+	"\n"
+	"-Q, --sweep=N             query the hosts, N of them at a time, printing what each\n"
+	"                          has pending as it answers, then the hosts by pending\n"
+	"                          command and those not answering; -T limits how long\n"
+	"                          the whole sweep takes, -r is not needed\n"
 	"\n"
 	"-r, --request=REQ         specify the request to send to server; valid options are\n"
-	"                          shutdown, reboot, hibernate, sleep, abort, notify\n"
+	"                          shutdown, reboot, hibernate, sleep, abort, notify,\n"
+	"                          query; several separated by commas (e.g. notify,shutdown)\n"
+	"                          are sent as one batch, carried out all or none, power\n"
+	"                          commands first\n"
 	"\n"
 	"-b, --broadcast           broadcast request on network out of given interface\n"
 	"                          NOTE: interface must be specified (-i) when using this flag\n"
@@ -310,7 +1335,10 @@ void usage(char *pgmname)
 	"-i, --interface=IFNAME    specify network interface to use for sending broadcast message\n"
 	"\n"
 	"-m, --message=MSG         message to send for notification on server\n\n"
-	"-k, --key=pvtkey          private key to use for signing message\n\n"
+	"-k, --key=pvtkey          private key to use for signing message: P-384, P-256\n"
+	"                          or Ed25519, see `make certs`\n\n"
+	"-K, --key-id              name the key in requests, for servers trusting several\n"
+	"                          keys with --trust; older servers reject them\n\n"
 	, pgmname);
 	exit(EXIT_FAILURE);
 }
@@ -11,6 +11,7 @@
 #define printfv(fmt, args...)	printf((argopts.verbose) ? fmt : "", ## args)
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
 
 #define DEFAULT_PORT	6969
 
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <openssl/rand.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "stats.h"
+#include "dedupe.h"
+
+_Static_assert((DEDUPE_SLOTS & (DEDUPE_SLOTS - 1)) == 0, "DEDUPE_SLOTS must be a power of two");
+
+struct dedupe_entry {
+	uint64_t		hash;		/* 0 if the slot is free */
+	int64_t			expires;
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	uint16_t		len;		/* of the datagram */
+	uint8_t			state;		/* DEDUPE_* */
+	uint16_t		replylen;
+	unsigned char		reply[DEDUPE_REPLY_MAX];
+};
+
+/*
+ * Direct mapped: a datagram takes the slot its hash points to, whatever was
+ * there. The hash covers the source address too, so a copy replayed from
+ * another address is verified as any datagram, and the cached reply only
+ * ever goes where the original one went.
+ */
+static pthread_mutex_t dedupe_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dedupe_entry entries[DEDUPE_SLOTS];
+static uint64_t hash_key[2];
+
+#define ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+/* SipHash-2-4 of the $len bytes at $in, chained from $seed */
+static uint64_t siphash(uint64_t seed, const unsigned char *in, size_t len)
+{
+	uint64_t v0 = 0x736f6d6570736575ULL ^ hash_key[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ hash_key[1] ^ seed;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ hash_key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ hash_key[1];
+	uint64_t m, b = (uint64_t)len << 56;
+	const unsigned char *end = in + len - len % 8;
+
+	for (; in != end; in += 8) {
+		memcpy(&m, in, sizeof(m));
+		m = le64toh(m);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+	for (size_t i = 0; i < len % 8; ++i)
+		b |= (uint64_t)in[i] << (8 * i);
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void dedupe_init(void)
+{
+	if (RAND_bytes((unsigned char *)hash_key, sizeof(hash_key)) != 1)
+		fprintf(stderr, "no random key for the dedupe cache, using a fixed one\n");
+}
+
+/* entry of $slot if it still holds its datagram, with dedupe_lock held */
+static struct dedupe_entry *lookup(const struct rxslot *slot)
+{
+	struct dedupe_entry *e = &entries[slot->dedupe & (DEDUPE_SLOTS - 1)];
+
+	if (e->hash != slot->dedupe || e->len != slot->len || e->addrlen != slot->addrlen
+			|| memcmp(&e->addr, &slot->addr, slot->addrlen) != 0)
+		return NULL;
+	return e;
+}
+
+int dedupe_check(struct rxslot *slot, unsigned char *reply, size_t *replylen)
+{
+	struct dedupe_entry *e;
+	int state = DEDUPE_NEW;
+
+	slot->dedupe = siphash(siphash(0, (unsigned char *)&slot->addr, slot->addrlen),
+			slot->buf, slot->len) | 1;
+	pthread_mutex_lock(&dedupe_lock);
+	if ((e = lookup(slot)) != NULL && e->expires > slot->stamp) {
+		state = e->state;
+		if (state == DEDUPE_ANSWERED) {
+			memcpy(reply, e->reply, e->replylen);
+			*replylen = e->replylen;
+		}
+	} else {
+		e = &entries[slot->dedupe & (DEDUPE_SLOTS - 1)];
+		e->hash = slot->dedupe;
+		e->len = slot->len;
+		memcpy(&e->addr, &slot->addr, slot->addrlen);
+		e->addrlen = slot->addrlen;
+		e->state = DEDUPE_PENDING;
+		e->expires = slot->stamp + DEDUPE_PENDING_MS;
+	}
+	pthread_mutex_unlock(&dedupe_lock);
+
+	if (state == DEDUPE_NEW)
+		STATS_INC(dedupe_miss);
+	else
+		STATS_INC(dedupe_hit);
+	return state;
+}
+
+/* move the pending entry of $slot to $state, keeping $len bytes of $reply */
+static void settle(const struct rxslot *slot, int state, const void *reply, size_t len)
+{
+	struct dedupe_entry *e;
+
+	if (!slot->dedupe || len > DEDUPE_REPLY_MAX)
+		return;
+	pthread_mutex_lock(&dedupe_lock);
+	if ((e = lookup(slot)) != NULL && e->state == DEDUPE_PENDING) {
+		e->state = state;
+		e->expires = slot->stamp + DEDUPE_TTL_MS;
+		if (len)
+			memcpy(e->reply, reply, len);
+		e->replylen = len;
+	}
+	pthread_mutex_unlock(&dedupe_lock);
+}
+
+void dedupe_answer(const struct rxslot *slot, const void *reply, size_t len)
+{
+	settle(slot, DEDUPE_ANSWERED, reply, len);
+}
+
+void dedupe_reject(const struct rxslot *slot)
+{
+	settle(slot, DEDUPE_INVALID, NULL, 0);
+}
+
+void dedupe_flush(void)
+{
+	pthread_mutex_lock(&dedupe_lock);
+	memset(entries, 0, sizeof(entries));
+	pthread_mutex_unlock(&dedupe_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef DEDUPE_H
+#define DEDUPE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "rx.h"
+
+/*
+ * Copies of a datagram, from a client retrying or a broadcast reaching the
+ * server over several paths, are answered from a cache without verifying or
+ * dispatching them again. It is keyed by a SipHash, with a key chosen at
+ * startup, of the whole datagram and its source address: a copy signed
+ * differently, which may not be authentic, is never taken for the original.
+ */
+
+#define DEDUPE_SLOTS		512	/* datagrams remembered, a power of two */
+#define DEDUPE_TTL_MS		(30 * 1000)	/* longer than clients keep retrying */
+#define DEDUPE_PENDING_MS	1000	/* most a datagram may take to be answered */
+#define DEDUPE_REPLY_MAX	MAX(SSTATE_SIZE, SESSION_REPLY_SIZE)
+
+enum {
+	DEDUPE_NEW,		/* first seen, to be verified */
+	DEDUPE_PENDING,		/* a copy is still being verified */
+	DEDUPE_INVALID,		/* a copy failed verification */
+	DEDUPE_ANSWERED,	/* a copy was answered, the reply is returned */
+};
+
+/* dedupe_init:	Pick the hash key; the cache works without, less safely */
+void dedupe_init(void);
+
+/*
+ * dedupe_check:
+ * 	Look up the datagram in $slot, received at slot->stamp, and set
+ * 	slot->dedupe for dedupe_answer() and dedupe_reject(). A datagram first
+ * 	seen is remembered as pending until then. For one answered already, the
+ * 	reply it got is copied into $reply, which has room for DEDUPE_REPLY_MAX
+ * 	bytes, and its size into *$replylen, 0 if there was none.
+ * 	Returns one of DEDUPE_*. Thread safe, as are the functions below.
+ */
+int dedupe_check(struct rxslot *slot, unsigned char *reply, size_t *replylen);
+
+/*
+ * dedupe_answer:
+ * 	Remember the $len byte $reply sent to the datagram in $slot, for its
+ * 	copies. Does nothing if slot->dedupe is 0.
+ */
+void dedupe_answer(const struct rxslot *slot, const void *reply, size_t len);
+
+/* dedupe_reject:	Remember that the datagram in $slot failed verification */
+void dedupe_reject(const struct rxslot *slot);
+
+/* dedupe_flush:	Forget every datagram, when the key verifying them changes */
+void dedupe_flush(void);
+
+#endif /* ifndef DEDUPE_H */
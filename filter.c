@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "filter.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF	51
+#endif
+
+/*
+ * Field offsets, from the tables in protocol.h: every field becomes a byte
+ * array of its size, so the structures have no padding.
+ */
+#define LAYOUT_FIELD(type, name)	uint8_t name[PROTO_##type##_SIZE];
+
+struct v1_layout {
+	REQUEST_V1_FIELDS(LAYOUT_FIELD)
+};
+
+struct v2_layout {
+	REQUEST_V2_HEADER(LAYOUT_FIELD)
+	REQUEST_V2_FIELDS(LAYOUT_FIELD)
+};
+
+_Static_assert(sizeof(struct v2_layout) == REQUEST_V2_FIXED_SIZE, "v2 layout out of sync");
+
+/* socket filters see the UDP header, reuseport programs only the payload */
+#define V1_OFF(field)	(sizeof(struct udphdr) + offsetof(struct v1_layout, field))
+#define V2_OFF(field)	(sizeof(struct udphdr) + offsetof(struct v2_layout, field))
+#define SIGSIZE_SIZE	sizeof(uint16_t)
+#define SIG_MAXSIZE	sizeof(((struct signature *)0)->sig)
+
+/*
+ * Jumps forward to a label are written with the label as their offset and
+ * resolved by assemble(), which also drops the label pseudo-instructions.
+ */
+enum { DROP = 0xf0, V1, SIGNATURE, LABEL_END };
+#define LABEL(l)	{ .code = 0xffff, .k = (l) }
+
+#define CHECK_REQ_TYPE \
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, (uint16_t)~REQ_FLAG_BITS), \
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, REQ_POW_SHUTDOWN, 0, DROP), \
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, REQ_MAX, DROP, 0)
+
+/*
+ * Accepts what unpack_request() may accept, and drops what it rejects as far
+ * as a program without loops can tell. Loads past the end of the datagram
+ * drop it as well. M[0] holds the size of the datagram, M[2] the SIG_MERKLE
+ * bit of v2 requests and M[3] the size of their key id.
+ */
+static const struct sock_filter request_filter[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+		sizeof(struct udphdr) + sizeof(struct v1_layout) + SIGSIZE_SIZE, 0, DROP),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K,
+		sizeof(struct udphdr) + REQUEST_MAX_SIZE, DROP, 0),
+	BPF_STMT(BPF_ST, 0),
+	BPF_STMT(BPF_LD | BPF_IMM, 0),
+	BPF_STMT(BPF_ST, 2),
+	/* v2 starts with the magic, v1 with a timestamp */
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, V2_OFF(magic)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROTO_MAGIC, 0, V1),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, V2_OFF(version)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROTO_VERSION, 0, DROP),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, V2_OFF(sigalg)),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, SIG_MERKLE),
+	BPF_STMT(BPF_ST, 2),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, V2_OFF(sigalg)),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, SIG_KEYID),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),
+	BPF_STMT(BPF_LD | BPF_IMM, REQUEST_V2_KEYID_SIZE),
+	BPF_STMT(BPF_ST, 3),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, V2_OFF(sigalg)),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, (uint8_t)~SIG_FLAG_BITS),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, SIG_ALG_MAX, DROP, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, V2_OFF(req_type)),
+	CHECK_REQ_TYPE,
+	/* batches carry their commands in place of the message */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, REQ_BATCH, 0, 2),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, V2_OFF(msg_size)),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, BATCH_MAXSIZE, DROP, 2),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, V2_OFF(msg_size)),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, MSG_MAXSIZE, DROP, 0),
+	/* the length in the header covers the fixed fields, key id and message */
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, REQUEST_V2_FIXED_SIZE),
+	BPF_STMT(BPF_LDX | BPF_MEM, 3),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, V2_OFF(length)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, 0, DROP),
+	BPF_JUMP(BPF_JMP | BPF_JA, SIGNATURE, 0, 0),
+
+	LABEL(V1),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, V1_OFF(msg_size)),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, MSG_MAXSIZE, DROP, 0),
+	BPF_STMT(BPF_ST, 1),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, V1_OFF(req_type)),
+	CHECK_REQ_TYPE,
+	/* the deadline and send time follow the message with the abstime bit */
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, V1_OFF(req_type)),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, GET_ABSTIME_BIT(REQ_FLAG_BITS)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),
+	BPF_STMT(BPF_LD | BPF_IMM, 2 * sizeof(int64_t)),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, sizeof(struct v1_layout)),
+	BPF_STMT(BPF_LDX | BPF_MEM, 1),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+
+	/*
+	 * X is the size of the signed part, the signature follows it, or a
+	 * Merkle proof whose size takes a loop to work out
+	 */
+	LABEL(SIGNATURE),
+	BPF_STMT(BPF_LD | BPF_MEM, 2),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	BPF_STMT(BPF_LD | BPF_H | BPF_IND, sizeof(struct udphdr)),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, SIG_MAXSIZE, DROP, 0),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, sizeof(struct udphdr) + SIGSIZE_SIZE),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_MEM, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_X, 0, 0, DROP),
+	BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+
+	LABEL(DROP),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+#define NINSNS(prog)	(sizeof(prog) / sizeof((prog)[0]))
+
+/* offset of the jump at $pc to label $target, at $labels[$target] */
+static uint32_t resolve(uint32_t target, unsigned int pc, const unsigned int *labels)
+{
+	return target >= DROP ? labels[target - DROP] - pc - 1 : target;
+}
+
+/* copy $n instructions from $src to $dst without labels; returns how many */
+static unsigned int assemble(const struct sock_filter *src, unsigned int n,
+		struct sock_filter *dst)
+{
+	unsigned int labels[LABEL_END - DROP], pc = 0;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		if (src[i].code == 0xffff)
+			labels[src[i].k - DROP] = pc;
+		else
+			++pc;
+	}
+	pc = 0;
+	for (unsigned int i = 0; i < n; ++i) {
+		if (src[i].code == 0xffff)
+			continue;
+		dst[pc] = src[i];
+		if (BPF_CLASS(dst[pc].code) == BPF_JMP && BPF_OP(dst[pc].code) == BPF_JA) {
+			dst[pc].k = resolve(dst[pc].k, pc, labels);
+		} else if (BPF_CLASS(dst[pc].code) == BPF_JMP) {
+			dst[pc].jt = resolve(dst[pc].jt, pc, labels);
+			dst[pc].jf = resolve(dst[pc].jf, pc, labels);
+		}
+		++pc;
+	}
+	return pc;
+}
+
+int filter_attach(int sockfd)
+{
+	struct sock_filter insns[NINSNS(request_filter)];
+	struct sock_fprog prog = { .filter = insns };
+
+	prog.len = assemble(request_filter, NINSNS(request_filter), insns);
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1) {
+		perror("setsockopt(SO_ATTACH_FILTER) failed");
+		return -1;
+	}
+	return 0;
+}
+
+int filter_attach_reuseport(int sockfd, unsigned int nsocks)
+{
+	/* an index past the last socket makes the kernel fall back to hashing */
+	struct sock_filter insns[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offsetof(struct v2_layout, magic)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROTO_MAGIC, 0, 3),
+		/* low half of the sequence number */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct v2_layout, seq) + 4),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nsocks),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		BPF_STMT(BPF_RET | BPF_K, nsocks),
+	};
+	struct sock_fprog prog = { .len = NINSNS(insns), .filter = insns };
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+				sizeof(prog)) == -1) {
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef FILTER_H
+#define FILTER_H 1
+
+/*
+ * Classic BPF programs built from the wire format in protocol.h, run by the
+ * kernel on every datagram before it is queued to a socket.
+ */
+
+/*
+ * filter_attach:
+ * 	Attach a socket filter to UDP socket $sockfd dropping datagrams that
+ * 	cannot be requests: wrong size, unknown request type or signature
+ * 	algorithm, msg_size over MSG_MAXSIZE (BATCH_MAXSIZE for batches), or
+ * 	a signature over 192 bytes or running past the end. The proof and
+ * 	signature of requests signed with a Merkle root are left to
+ * 	unpack_request().
+ * 	They never wake up the server. Returns -1 on error and 0 on success.
+ */
+int filter_attach(int sockfd);
+
+/*
+ * filter_attach_reuseport:
+ * 	Spread the datagrams received by the $nsocks SO_REUSEPORT sockets bound
+ * 	to the port of $sockfd by the sequence number of v2 requests, so a
+ * 	single busy sender does not pile up on one of them. Other datagrams are
+ * 	spread by the kernel's usual hash of their addresses.
+ * 	Returns -1 on error and 0 on success.
+ */
+int filter_attach_reuseport(int sockfd, unsigned int nsocks);
+
+#endif /* ifndef FILTER_H */
@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "auth.h"
+#include "stats.h"
+#include "merkle.h"
+
+#define LEAF_PREFIX	0x00
+#define NODE_PREFIX	0x01
+#define ROOT_MSG_SIZE	(sizeof(MERKLE_LABEL) + sizeof(uint32_t) + MERKLE_HASH_SIZE)
+
+_Static_assert((MERKLE_CACHE_SLOTS & (MERKLE_CACHE_SLOTS - 1)) == 0,
+		"MERKLE_CACHE_SLOTS must be a power of two");
+
+/* the nodes of every level, leaves first, the root last */
+struct merkle_tree {
+	uint32_t	count;
+	int		depth;
+	uint32_t	level[MERKLE_MAX_DEPTH + 1];	/* index of the first node */
+	unsigned char	nodes[][MERKLE_HASH_SIZE];
+};
+
+/* a root verified with the key currently loaded */
+struct cached_root {
+	unsigned char	root[MERKLE_HASH_SIZE];
+	uint32_t	count;
+	uint8_t		alg;
+	uint64_t	keyid;
+	int64_t		expires;	/* 0 if the slot is free */
+};
+
+/*
+ * Roots are spread over the slots by their first bytes, which nobody
+ * without the key can pick, since only verified roots get in. A root
+ * replaces whatever was in its slot.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_root cache[MERKLE_CACHE_SLOTS];
+
+void merkle_leaf(uint32_t host, const unsigned char *buf, size_t size,
+		unsigned char out[MERKLE_HASH_SIZE])
+{
+	unsigned char leaf[1 + sizeof(host) + REQUEST_MAX_SIZE];
+
+	size = MIN(size, REQUEST_MAX_SIZE);
+	leaf[0] = LEAF_PREFIX;
+	memcpy(leaf + 1, &host, sizeof(host));
+	memcpy(leaf + 1 + sizeof(host), buf, size);
+	SHA256(leaf, 1 + sizeof(host) + size, out);
+}
+
+/* hash $left and $right into $out, which may be either of them */
+static void merkle_node(const unsigned char *left, const unsigned char *right,
+		unsigned char *out)
+{
+	unsigned char node[1 + 2 * MERKLE_HASH_SIZE];
+
+	node[0] = NODE_PREFIX;
+	memcpy(node + 1, left, MERKLE_HASH_SIZE);
+	memcpy(node + 1 + MERKLE_HASH_SIZE, right, MERKLE_HASH_SIZE);
+	SHA256(node, sizeof(node), out);
+}
+
+/* what is signed for the root $root of a tree of $count leaves */
+static void root_message(const unsigned char *root, uint32_t count, unsigned char *msg)
+{
+	memcpy(msg, MERKLE_LABEL, sizeof(MERKLE_LABEL));
+	msg += sizeof(MERKLE_LABEL);
+	count = htobe32(count);
+	memcpy(msg, &count, sizeof(count));
+	msg += sizeof(count);
+	memcpy(msg, root, MERKLE_HASH_SIZE);
+}
+
+struct merkle_tree *merkle_build(const unsigned char (*leaves)[MERKLE_HASH_SIZE], uint32_t count)
+{
+	struct merkle_tree *t;
+	uint32_t total = 0, w, i;
+	int l;
+
+	if (count == 0 || count > MERKLE_MAX_LEAVES)
+		return NULL;
+	for (w = count; w > 1; w = (w + 1) / 2)
+		total += w;
+	if ((t = malloc(sizeof(*t) + (total + 1) * MERKLE_HASH_SIZE)) == NULL)
+		return NULL;
+	t->count = count;
+	memcpy(t->nodes, leaves, count * MERKLE_HASH_SIZE);
+	t->level[0] = 0;
+	for (l = 0, w = count; w > 1; ++l, w = (w + 1) / 2) {
+		t->level[l + 1] = t->level[l] + w;
+		for (i = 0; i + 1 < w; i += 2)
+			merkle_node(t->nodes[t->level[l] + i], t->nodes[t->level[l] + i + 1],
+					t->nodes[t->level[l + 1] + i / 2]);
+		if (i < w)
+			memcpy(t->nodes[t->level[l + 1] + i / 2], t->nodes[t->level[l] + i],
+					MERKLE_HASH_SIZE);
+	}
+	t->depth = l;
+	return t;
+}
+
+void merkle_tree_free(struct merkle_tree *t)
+{
+	free(t);
+}
+
+int merkle_sign(const struct merkle_tree *t, const char *pvtkey, uint8_t alg,
+		unsigned char *sig, size_t *siglen)
+{
+	unsigned char msg[ROOT_MSG_SIZE];
+
+	root_message(t->nodes[t->level[t->depth]], t->count, msg);
+	return signbuf(pvtkey, alg, msg, sizeof(msg), sig, siglen);
+}
+
+size_t merkle_seal(const struct merkle_tree *t, uint32_t index, const unsigned char *sig,
+		size_t siglen, unsigned char *buf, size_t size, size_t bufsize)
+{
+	unsigned char hashes[MERKLE_MAX_DEPTH][MERKLE_HASH_SIZE];
+	struct merkle_proof proof = { index, t->count, 0, hashes[0] };
+	uint16_t sigsize = htobe16(siglen);
+	uint32_t i = index, w = t->count;
+	size_t packed;
+	int n = 0;
+
+	for (int l = 0; w > 1; ++l, i >>= 1, w = (w + 1) / 2)
+		if ((i ^ 1) < w)
+			memcpy(hashes[n++], t->nodes[t->level[l] + (i ^ 1)], MERKLE_HASH_SIZE);
+	if ((packed = pack_merkle_proof(&proof, buf + size, bufsize - size)) == 0
+			|| bufsize - size - packed < sizeof(sigsize) + siglen)
+		return 0;
+	buf += size + packed;
+	memcpy(buf, &sigsize, sizeof(sigsize));
+	memcpy(buf + sizeof(sigsize), sig, siglen);
+	return size + packed + sizeof(sigsize) + siglen;
+}
+
+/* whether $root of $count leaves was verified for $alg and $keyid, at $now_ms */
+static int cache_lookup(const unsigned char *root, uint32_t count, uint8_t alg,
+		uint64_t keyid, int64_t now_ms)
+{
+	struct cached_root *c;
+	uint32_t slot;
+	int found;
+
+	memcpy(&slot, root, sizeof(slot));
+	c = &cache[slot & (MERKLE_CACHE_SLOTS - 1)];
+	pthread_mutex_lock(&cache_lock);
+	found = c->expires > now_ms && c->count == count && c->alg == alg
+		&& c->keyid == keyid && memcmp(c->root, root, MERKLE_HASH_SIZE) == 0;
+	pthread_mutex_unlock(&cache_lock);
+	return found;
+}
+
+static void cache_insert(const unsigned char *root, uint32_t count, uint8_t alg,
+		uint64_t keyid, int64_t now_ms)
+{
+	struct cached_root *c;
+	uint32_t slot;
+
+	memcpy(&slot, root, sizeof(slot));
+	c = &cache[slot & (MERKLE_CACHE_SLOTS - 1)];
+	pthread_mutex_lock(&cache_lock);
+	memcpy(c->root, root, MERKLE_HASH_SIZE);
+	c->count = count;
+	c->alg = alg;
+	c->keyid = keyid;
+	c->expires = now_ms + MERKLE_CACHE_MS;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+int merkle_verify(const unsigned char *buf, size_t size, const struct request *req,
+		uint32_t host, int64_t now_ms)
+{
+	const struct merkle_proof *proof = &req->proof;
+	const unsigned char *sibling = proof->hashes;
+	unsigned char h[MERKLE_HASH_SIZE], msg[ROOT_MSG_SIZE], sig[sizeof(req->sig.sig)];
+	size_t siglen = req->sig.sigsize;
+	uint32_t i = proof->index, w = proof->count;
+
+	/* a request whose host is unknown cannot be told from one for another */
+	if (w == 0 || req->sigalg == SIG_HMAC_SHA256 || host == 0)
+		return 0;
+	merkle_leaf(host, buf, size, h);
+	for (; w > 1; i >>= 1, w = (w + 1) / 2) {
+		if ((i ^ 1) >= w)
+			continue;
+		if (i & 1)
+			merkle_node(sibling, h, h);
+		else
+			merkle_node(h, sibling, h);
+		sibling += MERKLE_HASH_SIZE;
+	}
+
+	if (cache_lookup(h, proof->count, req->sigalg, req->keyid, now_ms)) {
+		STATS_INC(merkle_cached);
+		return 1;
+	}
+	root_message(h, proof->count, msg);
+	memcpy(sig, req->sig.sig, siglen);
+	if (!verifysig(req->sigalg, req->keyid, msg, sizeof(msg), sig, &siglen))
+		return 0;
+	cache_insert(h, proof->count, req->sigalg, req->keyid, now_ms);
+	return 1;
+}
+
+void merkle_cache_flush(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	memset(cache, 0, sizeof(cache));
+	pthread_mutex_unlock(&cache_lock);
+}
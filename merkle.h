@@ -0,0 +1,87 @@
+#ifndef MERKLE_H
+#define MERKLE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * A client sending a different request to each of many servers signs them
+ * all at once: the requests are the leaves of a Merkle tree, and only its
+ * root is signed. Each server gets its own request, flagged SIG_MERKLE,
+ * followed by the proof of its place in the tree and the signature of the
+ * root, so it verifies one signature and a hash per level of the tree.
+ *
+ * 	leaf:	SHA-256(0x00 || host IPv4 address || signed part of the request)
+ * 	node:	SHA-256(0x01 || left || right)
+ * 	signed:	MERKLE_LABEL, the number of leaves (u32) and the root
+ *
+ * The last node of a level without a sibling moves up as it is. Verified
+ * roots are remembered for MERKLE_CACHE_MS, so further requests under the
+ * same root only cost the hashes.
+ *
+ * Each leaf is bound to the address its request is sent to, which the
+ * server hashes in as the one the datagram reached it on: a request sealed
+ * for another host leads to another root and is refused, however it got
+ * there. The sender gives them all the same client id and sequence number.
+ */
+
+#define MERKLE_LABEL		"lsd merkle root v2"
+#define MERKLE_CACHE_SLOTS	256	/* verified roots, a power of two */
+#define MERKLE_CACHE_MS		(60 * 1000)
+
+struct merkle_tree;
+
+/*
+ * merkle_leaf:
+ * 	Hash the request for the host at IPv4 address $host (network byte
+ * 	order) packed in the $size bytes at $buf, up to REQUEST_MAX_SIZE,
+ * 	into the leaf $out.
+ */
+void merkle_leaf(uint32_t host, const unsigned char *buf, size_t size,
+		unsigned char out[MERKLE_HASH_SIZE]);
+
+/*
+ * merkle_build:
+ * 	Build the tree over the $count leaves in $leaves, at most
+ * 	MERKLE_MAX_LEAVES. Returns NULL on error.
+ */
+struct merkle_tree *merkle_build(const unsigned char (*leaves)[MERKLE_HASH_SIZE], uint32_t count);
+
+void merkle_tree_free(struct merkle_tree *t);
+
+/*
+ * merkle_sign:
+ * 	Sign the root of $t with algorithm $alg and the private key in PEM
+ * 	file $pvtkey, like signbuf(). Returns -1 on error and 0 on success.
+ */
+int merkle_sign(const struct merkle_tree *t, const char *pvtkey, uint8_t alg,
+		unsigned char *sig, size_t *siglen);
+
+/*
+ * merkle_seal:
+ * 	Append the proof of leaf $index of $t and the $siglen byte signature
+ * 	$sig of its root to the request packed in the $size bytes at $buf,
+ * 	whose proof.count was set when packing it. $buf holds $bufsize bytes.
+ * 	Returns the size of the sealed request, or 0 if it does not fit.
+ */
+size_t merkle_seal(const struct merkle_tree *t, uint32_t index, const unsigned char *sig,
+		size_t siglen, unsigned char *buf, size_t size, size_t bufsize);
+
+/*
+ * merkle_verify:
+ * 	Check request $req, whose signed part is the $size bytes at $buf, and
+ * 	which carries a proof, received on IPv4 address $host (network byte
+ * 	order, 0 if unknown) at wall clock time $now_ms: the root its proof
+ * 	leads to has to be one verified recently or signed by req->sig with the
+ * 	key req->keyid names (see verifysig()). Thread safe.
+ * 	Returns 1 if the request is authentic and for $host, and 0 otherwise.
+ */
+int merkle_verify(const unsigned char *buf, size_t size, const struct request *req,
+		uint32_t host, int64_t now_ms);
+
+/* merkle_cache_flush:	Forget the verified roots, when the keys change */
+void merkle_cache_flush(void);
+
+#endif /* ifndef MERKLE_H */
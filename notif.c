@@ -1,76 +1,335 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <sys/pidfd.h>
 
 #include "common.h"
 #include "protocol.h"
 #include "notif.h"
+#include "reactor.h"
+#include "stats.h"
 
-int confirm_shutdown(struct request *req, unsigned int timeout)
+/* exit status of zenity when its --timeout expires */
+#define ZENITY_TIMEOUT	5
+/* grace period before a dialog outliving its own timeout is killed */
+#define CONFIRM_GRACE	5
+
+#define NOTIF_DEDUPE_SECS	10	/* identical messages shown once in this window */
+#define NOTIF_RECENT		32	/* messages remembered for deduplication */
+#define NOTIF_BURST_MS		300	/* messages this close together are merged */
+#define NOTIF_MAX_LIVE		4	/* notification windows open at once */
+#define NOTIF_TEXT_MAX		1024	/* room for merged messages */
+
+/*
+ * Notifications are not shown right away: they are collected for
+ * NOTIF_BURST_MS and then shown as one window, as long as fewer than
+ * NOTIF_MAX_LIVE windows are open. Otherwise they wait until one closes.
+ */
+static struct {
+	pthread_mutex_t	lock;
+	struct {
+		uint64_t	hash;
+		time_t		at;
+	} recent[NOTIF_RECENT];		/* ring of recently queued messages */
+	unsigned int	recent_next;
+	char		text[NOTIF_TEXT_MAX];	/* messages waiting to be shown */
+	size_t		len;
+	unsigned int	nmsgs;
+	int		live;		/* notification windows open */
+	int		timerfd;	/* end of the current burst */
+	bool		timer_armed;
+} notif = { .lock = PTHREAD_MUTEX_INITIALIZER, .timerfd = -1 };
+
+extern char **environ;
+
+/* a confirmation dialog waiting for an answer */
+struct confirm {
+	pid_t			pid;
+	int			pidfd;		/* signals it, even once reaped */
+	bool			overdue;	/* killed by confirm_overdue() */
+	int			timerfd;	/* deadline for the helper */
+	struct reactor_handler	*timer;
+	confirm_cb		done;
+	void			*arg;
+};
+
+/*
+ * spawn_helper:
+ * 	Start $argv[0] (looked up in PATH) with $argv, without a shell, so the
+ * 	text in the arguments is never interpreted. Returns the pid or -1.
+ */
+static pid_t spawn_helper(char *const argv[])
 {
-	FILE *fp;
-	char msg[16];
-	char cmd[256];
+	pid_t pid;
+	int err;
+
+	if ((err = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ)) != 0) {
+		fprintf(stderr, "posix_spawnp: %s: %s\n", argv[0], strerror(err));
+		return -1;
+	}
+	return pid;
+}
+
+/* the dialog exited: translate its exit status into an answer */
+static void confirm_exited(pid_t pid, int status, void *arg)
+{
+	struct confirm *c = arg;
+	int confirmed;
+
+	if (WIFEXITED(status)) {
+		/* 0, 1, or 5 depending on whether user pressed OK, Cancel, or
+		 * timeout has been reached */
+		PDEBUG("confirmation status code: %d\n", WEXITSTATUS(status));
+		confirmed = WEXITSTATUS(status) == 0
+			|| WEXITSTATUS(status) == ZENITY_TIMEOUT;
+		if (WEXITSTATUS(status) == ZENITY_TIMEOUT)
+			printf("[-] confirm prompt timed out\n");
+	} else {
+		/* killed by us when it overran its deadline, else cancelled or crashed */
+		confirmed = c->overdue && WTERMSIG(status) == SIGKILL;
+	}
+	reactor_del(c->timer);
+	close(c->timerfd);
+	c->done(confirmed, c->arg);
+	close(c->pidfd);
+	free(c);
+}
+
+/* the dialog should have timed out on its own by now */
+static void confirm_overdue(int fd, uint32_t events, void *arg)
+{
+	struct confirm *c = arg;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	fprintf(stderr, "confirmation dialog %d overdue, killing it\n", c->pid);
+	if (pidfd_send_signal(c->pidfd, SIGKILL, NULL, 0) == 0)
+		c->overdue = true;
+}
+
+struct confirm *confirm_async(struct request *req, unsigned int timeout, confirm_cb done,
+		void *arg)
+{
+	struct itimerspec its = { .it_value.tv_sec = timeout + CONFIRM_GRACE };
+	struct confirm *c;
+	char msg[16], text[128], timeoutarg[32];
 	uint16_t req_type;
 
 	req_type = req->req_type;
 	RESET_FORCE_BIT(req_type);
+	RESET_MSEC_BIT(req_type);
+	RESET_ABSTIME_BIT(req_type);
 	if (reqstr(req_type, msg, sizeof(msg)) == NULL) {
 		PDEBUG("[*] invalid request type: %x\n", req_type);
-		return 0;
+		return NULL;
 	}
-	snprintf(cmd, sizeof(cmd),
-			"zenity --question \
-			--width 400 --height 100 \
-			--timeout=%d \
-			--title 'Confirm' \
-			--text 'Confirm %s in %d seconds? (y/n)'",
-			timeout, msg, req->timer);
-	// Test if Zenity is installed (get version)
-	fp=popen(cmd, "r");
-	if (fp==NULL) {
-		perror("popen: zenity");
-	} else {
-		int ret = WEXITSTATUS(pclose(fp));
-		/* ret = 0, 1, or 5 depending on whether user pressed OK, Cancel, or
-		 * timeout has been reached */
-		PDEBUG("confirmation status code: %d\n", ret);
-		/* return true if user pressed OK or prompt timed out */
-		if (ret == 5) {
-			printf("[-] confirm prompt timed out\n");
-			return 1;
+	snprintf(text, sizeof(text), "Confirm %s in %g seconds? (y/n)", msg,
+			request_timer_ms(req) / 1000.0);
+	snprintf(timeoutarg, sizeof(timeoutarg), "--timeout=%u", timeout);
+	char *const argv[] = {
+		"zenity", "--question", "--width", "400", "--height", "100",
+		timeoutarg, "--title", "Confirm", "--text", text, NULL
+	};
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+	c->done = done;
+	c->arg = arg;
+	/* the deadline is armed first so it exists whenever the child exits */
+	c->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (c->timerfd == -1) {
+		perror("timerfd_create");
+		goto err;
+	}
+	if ((c->timer = reactor_add(c->timerfd, EPOLLIN, confirm_overdue, c)) == NULL)
+		goto err_close;
+	if ((c->pid = spawn_helper(argv)) == -1)
+		goto err_del;
+	/* not reaped before reactor_watch_child(), so $pid is still the dialog */
+	if ((c->pidfd = pidfd_open(c->pid, 0)) == -1)
+		perror("pidfd_open");
+	timerfd_settime(c->timerfd, 0, &its, NULL);
+	if (c->pidfd == -1 || reactor_watch_child(c->pid, confirm_exited, c) == -1) {
+		kill(c->pid, SIGKILL);
+		waitpid(c->pid, NULL, 0);
+		if (c->pidfd != -1)
+			close(c->pidfd);
+		goto err_del;
+	}
+	return c;
+
+err_del:
+	reactor_del(c->timer);
+err_close:
+	close(c->timerfd);
+err:
+	free(c);
+	return NULL;
+}
+
+void confirm_cancel(struct confirm *c)
+{
+	/* answered as "not confirmed" once the event loop reaps it */
+	pidfd_send_signal(c->pidfd, SIGTERM, NULL, 0);
+}
+
+static uint64_t hash_text(const char *text)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	while (*text) {
+		h ^= (unsigned char)*text++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static time_t monotonic_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void notif_exited(pid_t pid, int status, void *arg);
+
+/* show the queued messages as one window if allowed, with notif.lock held */
+static void flush_locked(void)
+{
+	pid_t pid;
+
+	if (notif.nmsgs == 0 || notif.timer_armed)
+		return;
+	if (notif.live >= NOTIF_MAX_LIVE) {
+		PDEBUG("[-] %d notifications open, deferring\n", notif.live);
+		return;		/* retried when one of them closes */
+	}
+	char *const argv[] = { "zenity", "--info", "--text", notif.text, NULL };
+
+	if ((pid = spawn_helper(argv)) != -1) {
+		++notif.live;
+		if (reactor_watch_child(pid, notif_exited, NULL) == -1)
+			fprintf(stderr, "notification helper %d will not be reaped\n", pid);
+		STATS_INC(notif_shown);
+		STATS_ADD(notif_merged, notif.nmsgs - 1);
+		PDEBUG("[-] sent notification: '%s'\n", notif.text);
+	}
+	notif.len = 0;
+	notif.nmsgs = 0;
+}
+
+/* a notification window was closed */
+static void notif_exited(pid_t pid, int status, void *arg)
+{
+	pthread_mutex_lock(&notif.lock);
+	--notif.live;
+	flush_locked();
+	pthread_mutex_unlock(&notif.lock);
+}
+
+/* the burst is over: show what was collected */
+static void burst_ended(int fd, uint32_t events, void *arg)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	pthread_mutex_lock(&notif.lock);
+	notif.timer_armed = false;
+	flush_locked();
+	pthread_mutex_unlock(&notif.lock);
+}
+
+int notif_init(void)
+{
+	notif.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (notif.timerfd == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+	if (reactor_add(notif.timerfd, EPOLLIN, burst_ended, NULL) == NULL) {
+		close(notif.timerfd);
+		return -1;
+	}
+	return 0;
+}
+
+/* queue $text to be shown, unless it was shown recently */
+static void notify_text(const char *text)
+{
+	struct itimerspec its = { .it_value.tv_nsec = NOTIF_BURST_MS * 1000000L };
+	uint64_t hash = hash_text(text);
+	time_t now = monotonic_secs();
+	size_t len = strlen(text);
+
+	pthread_mutex_lock(&notif.lock);
+	for (int i = 0; i < NOTIF_RECENT; ++i) {
+		if (notif.recent[i].hash == hash && notif.recent[i].at
+				&& now - notif.recent[i].at < NOTIF_DEDUPE_SECS) {
+			STATS_INC(notif_suppressed);
+			PDEBUG("[-] duplicate notification suppressed\n");
+			goto out;
 		}
-		return !ret;
 	}
+	notif.recent[notif.recent_next].hash = hash;
+	notif.recent[notif.recent_next].at = now;
+	notif.recent_next = (notif.recent_next + 1) % NOTIF_RECENT;
+
+	/* +1 for the newline separating merged messages */
+	if (notif.len + len + 1 >= sizeof(notif.text)) {
+		STATS_INC(notif_dropped);
+		goto out;
+	}
+	if (notif.nmsgs)
+		notif.text[notif.len++] = '\n';
+	memcpy(notif.text + notif.len, text, len + 1);
+	notif.len += len;
+	++notif.nmsgs;
+
+	if (!notif.timer_armed) {
+		if (timerfd_settime(notif.timerfd, 0, &its, NULL) == -1) {
+			perror("timerfd_settime");
+			flush_locked();
+		} else {
+			notif.timer_armed = true;
+		}
+	}
+out:
+	pthread_mutex_unlock(&notif.lock);
 }
 
 void send_notification(struct request *req)
 {
 	uint16_t req_type;
-	FILE *fp;
-	char msg[16], *m = msg;
-	char cmd[512];
+	char msg[16];
+	char text[MSG_MAXSIZE + 64];
 
 	req_type = req->req_type;
 	RESET_FORCE_BIT(req_type);
+	RESET_MSEC_BIT(req_type);
+	RESET_ABSTIME_BIT(req_type);
 
 	if (req_type == REQ_NOTIFY) {
-		m = req->msg;
-		snprintf(cmd, sizeof(cmd), "zenity --info --text='%s'",
-				m, req->timer);
+		snprintf(text, sizeof(text), "%.*s",
+				req->msg_size, req->msg ? (char *)req->msg : "");
 	} else {
 		if (reqstr(req_type, msg, sizeof(msg)) == NULL) {
 			PDEBUG("[*] invalid request type: %x\n", req_type);
 			return;
 		}
-		snprintf(cmd, sizeof(cmd), "zenity --info --text='%s in %d seconds'",
-				m, req->timer);
+		snprintf(text, sizeof(text), "%s in %g seconds", msg,
+				request_timer_ms(req) / 1000.0);
 	}
-
-	fp = popen(cmd, "r");
-	if (fp == NULL)
-		perror("popen: zenity");
-	else
-		PDEBUG("[-] sent notification: '%s'\n",
-			m, req->timer);
+	notify_text(text);
 }
@@ -3,7 +3,46 @@
 
 #include "protocol.h"
 
-int confirm_shutdown(struct request *req, unsigned int timeout);
-void send_notification(struct request *req_type);
+#include <sys/types.h>
+
+typedef void (*confirm_cb)(int confirmed, void *arg);
+
+struct confirm;
+
+/*
+ * confirm_async:
+ * 	Ask the user to confirm the power command in $req with a dialog that
+ * 	times out after $timeout seconds, without waiting for the answer. Once
+ * 	the dialog exits, the event loop calls $done(confirmed, $arg), where
+ * 	$confirmed is true if the user pressed OK or the prompt timed out.
+ * 	Returns the dialog, valid until $done returns, or NULL if it could not
+ * 	be started ($done is then never called).
+ */
+struct confirm *confirm_async(struct request *req, unsigned int timeout, confirm_cb done,
+		void *arg);
+
+/*
+ * confirm_cancel:
+ * 	Close dialog $c, before its $done has returned; it is then answered
+ * 	as not confirmed.
+ */
+void confirm_cancel(struct confirm *c);
+
+/*
+ * notif_init:
+ * 	Set up the timer used to merge bursts of notifications and register it
+ * 	with the event loop. Returns -1 on error and 0 on success.
+ */
+int notif_init(void);
+
+/*
+ * send_notification:
+ * 	Show the message in $req, or a notice about the power command in $req,
+ * 	on the desktop. Does not wait for the user to close it. Messages that
+ * 	were shown in the last few seconds are dropped, messages arriving
+ * 	together are merged into one window, and the number of open windows
+ * 	is capped.
+ */
+void send_notification(struct request *req);
 
 #endif /* ifndef NOTIF_H */
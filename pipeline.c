@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "common.h"
+#include "pipeline.h"
+
+static struct {
+	struct pipe_entry	*ring;
+	unsigned long		mask;
+	/* sequence numbers of the next entry each stage will take */
+	atomic_ulong		rx_seq;
+	atomic_ulong		verify_seq;
+	atomic_ulong		dispatch_seq;
+	sem_t			received;	/* posted once per received entry */
+	sem_t			verified;	/* posted once per verified entry */
+	void			(*verify)(struct pipe_entry *);
+	void			(*dispatch)(struct pipe_entry *);
+	/* per-stage counters */
+	atomic_ulong		rx_dropped;	/* ring full */
+	atomic_ulong		verify_rejected;
+	atomic_ulong		dispatched;
+} pl;
+
+static void *verifier_main(void *arg);
+static void *dispatcher_main(void *arg);
+
+int pipeline_start(unsigned int qsize, int nverifiers,
+		void (*verify)(struct pipe_entry *),
+		void (*dispatch)(struct pipe_entry *))
+{
+	unsigned long size = 1;
+	pthread_t tid;
+
+	while (size < qsize)
+		size <<= 1;
+	pl.ring = calloc(size, sizeof(*pl.ring));
+	if (!pl.ring)
+		return -1;
+	pl.mask = size - 1;
+	for (unsigned long i = 0; i < size; ++i)
+		pl.ring[i].rx.buf = pl.ring[i].data;
+	pl.verify = verify;
+	pl.dispatch = dispatch;
+	sem_init(&pl.received, 0, 0);
+	sem_init(&pl.verified, 0, 0);
+
+	for (int i = 0; i < nverifiers; ++i) {
+		if ((errno = pthread_create(&tid, NULL, verifier_main, NULL)) != 0)
+			return -1;
+		pthread_detach(tid);
+	}
+	if ((errno = pthread_create(&tid, NULL, dispatcher_main, NULL)) != 0)
+		return -1;
+	pthread_detach(tid);
+	PDEBUG("[+] pipeline: %lu entries, %d verifier(s)\n", size, nverifiers);
+
+	return 0;
+}
+
+int pipeline_push(struct rxslot *slot)
+{
+	struct pipe_entry *e;
+	unsigned long seq;
+
+	/* claim the next sequence number, but only if its entry is free */
+	seq = atomic_load(&pl.rx_seq);
+	do {
+		e = &pl.ring[seq & pl.mask];
+		if (atomic_load_explicit(&e->state, memory_order_acquire) != PIPE_FREE) {
+			atomic_fetch_add_explicit(&pl.rx_dropped, 1,
+					memory_order_relaxed);
+			return -1;
+		}
+	} while (!atomic_compare_exchange_weak(&pl.rx_seq, &seq, seq + 1));
+
+	atomic_store_explicit(&e->state, PIPE_FILLING, memory_order_relaxed);
+	memcpy(e->rx.buf, slot->buf, slot->len);
+	e->rx.len = slot->len;
+	memcpy(&e->rx.addr, &slot->addr, slot->addrlen);
+	e->rx.addrlen = slot->addrlen;
+	e->rx.sockfd = slot->sockfd;
+	e->rx.dst = slot->dst;
+	e->rx.stamp = slot->stamp;
+	e->rx.dedupe = slot->dedupe;
+	atomic_store_explicit(&e->state, PIPE_RECEIVED, memory_order_release);
+	sem_post(&pl.received);
+
+	return 0;
+}
+
+static void *verifier_main(void *arg)
+{
+	struct pipe_entry *e;
+	unsigned long seq;
+
+	while (true) {
+		if (sem_wait(&pl.received) == -1)
+			continue;
+		seq = atomic_fetch_add(&pl.verify_seq, 1);
+		e = &pl.ring[seq & pl.mask];
+		/* another receive thread may still be copying into this entry */
+		while (atomic_load_explicit(&e->state, memory_order_acquire)
+				!= PIPE_RECEIVED)
+			sched_yield();
+		pl.verify(e);
+		if (!e->valid)
+			atomic_fetch_add_explicit(&pl.verify_rejected, 1,
+					memory_order_relaxed);
+		atomic_store_explicit(&e->state, PIPE_VERIFIED, memory_order_release);
+		sem_post(&pl.verified);
+	}
+	return NULL;
+}
+
+static void *dispatcher_main(void *arg)
+{
+	struct pipe_entry *e;
+	unsigned long seq;
+
+	while (true) {
+		if (sem_wait(&pl.verified) == -1)
+			continue;
+		/*
+		 * Entries may finish verification out of order; dispatch every
+		 * entry from the head of the ring that is ready. Posts for
+		 * entries handled here just cause empty wakeups later.
+		 */
+		seq = atomic_load(&pl.dispatch_seq);
+		e = &pl.ring[seq & pl.mask];
+		while (atomic_load_explicit(&e->state, memory_order_acquire)
+				== PIPE_VERIFIED) {
+			pl.dispatch(e);
+			atomic_fetch_add_explicit(&pl.dispatched, 1,
+					memory_order_relaxed);
+			atomic_store(&pl.dispatch_seq, ++seq);
+			atomic_store_explicit(&e->state, PIPE_FREE, memory_order_release);
+			e = &pl.ring[seq & pl.mask];
+		}
+	}
+	return NULL;
+}
+
+void pipeline_dump(FILE *fp)
+{
+	unsigned long rx = atomic_load(&pl.rx_seq);
+	unsigned long vf = atomic_load(&pl.verify_seq);
+	unsigned long dp = atomic_load(&pl.dispatch_seq);
+
+	fprintf(fp, "pipeline\n========\n"
+		"receive:  queued %lu, dropped %lu (queue full)\n"
+		"verify:   depth %lu, rejected %lu\n"
+		"dispatch: depth %lu, dispatched %lu\n",
+		rx, atomic_load(&pl.rx_dropped),
+		rx - vf, atomic_load(&pl.verify_rejected),
+		vf - dp, atomic_load(&pl.dispatched));
+	fflush(fp);
+}
@@ -0,0 +1,58 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H 1
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "protocol.h"
+#include "rx.h"
+
+/*
+ * Staged request pipeline:
+ *
+ * 	receive thread(s) --> verifier pool --> dispatcher
+ *
+ * All stages share one ring of entries. Receive threads copy datagrams into
+ * free entries in arrival order, any verifier may pick up the next received
+ * entry, and the single dispatcher hands entries to the dispatch callback
+ * strictly in arrival order, whatever order their verification finished in.
+ */
+
+/* entry states, in the order an entry goes through them */
+#define PIPE_FREE	0
+#define PIPE_FILLING	1	/* being copied in by a receive thread */
+#define PIPE_RECEIVED	2	/* waiting for a verifier */
+#define PIPE_VERIFIED	3	/* waiting for the dispatcher */
+
+struct pipe_entry {
+	atomic_int	state;
+	struct rxslot	rx;		/* rx.buf points to data */
+	unsigned char	data[RXBUF_SIZE];
+	struct request	req;
+	int		valid;		/* set by the verify callback */
+};
+
+/*
+ * pipeline_start:
+ * 	Allocate a ring of $qsize entries (rounded up to a power of two), start
+ * 	$nverifiers threads running $verify on received entries and one thread
+ * 	running $dispatch on verified entries in arrival order.
+ * 	$verify fills in entry->req and entry->valid. $dispatch has to release
+ * 	whatever $verify allocated.
+ * 	Returns -1 on error and 0 on success.
+ */
+int pipeline_start(unsigned int qsize, int nverifiers,
+		void (*verify)(struct pipe_entry *),
+		void (*dispatch)(struct pipe_entry *));
+
+/*
+ * pipeline_push:
+ * 	Copy the datagram in $slot into the next free entry. Never blocks.
+ * 	Returns -1 if the ring is full and the datagram was dropped, else 0.
+ */
+int pipeline_push(struct rxslot *slot);
+
+/* pipeline_dump:	Print queue depths and drop counters of each stage */
+void pipeline_dump(FILE *fp);
+
+#endif /* ifndef PIPELINE_H */
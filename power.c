@@ -1,27 +1,40 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
-#include <signal.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "protocol.h"
 #include "notif.h"
 #include "power.h"
+#include "sched.h"
 
 #define CONFIRM_TIMEOUT	10
 
-uint16_t g_powcmd;
-
-static void doit(uint16_t req_type);
-
-void sigalrm_handler(int signum)
-{
-	PDEBUG("[-] alarm rang: calling doit()\n");
-	doit(g_powcmd);
-}
-
-static void doit(uint16_t req_type)
+/* a power command waiting for the user to confirm it */
+struct pending {
+	unsigned long	gen;
+	struct confirm	*dialog;	/* valid while on the confirms list */
+	int64_t		delay_ms;
+	int64_t		deadline;	/* absolute, instead of delay_ms if not 0 */
+	uint16_t	powcmd;
+	bool		cancelled;	/* by power_unschedule() */
+	struct pending	*next;
+};
+
+/*
+ * Shared between the request handlers and the confirmation callbacks run
+ * by the event loop, and protected by power_lock. Scheduled commands live
+ * in the scheduler, which has its own lock.
+ */
+static pthread_mutex_t power_lock = PTHREAD_MUTEX_INITIALIZER;
+/* bumped by every abort of all commands, outdating pending confirmations */
+static unsigned long g_gen;
+static struct pending *confirms;	/* dialogs waiting for an answer */
+
+static void doit(uint16_t req_type, uint32_t id)
 {
 	switch (req_type) {
 	case REQ_POW_SHUTDOWN:
@@ -41,55 +54,184 @@ static void doit(uint16_t req_type)
 
 }
 
-int power_schedule(struct request *req, struct sstate *state)
+int power_init(void)
 {
-	struct sigaction act;
-	int scheduled = 0;		/* return value: 0 if not scheduled */
-
-	/* copy request type and reset force bit for switch case */
-	g_powcmd = req->req_type;
-	RESET_FORCE_BIT(g_powcmd);
-
-	if (GET_FORCE_BIT(req->req_type) == 0) {
-		PDEBUG("[-] no force bit\n");
-		if (!confirm_shutdown(req, CONFIRM_TIMEOUT)) {
-			PDEBUG("[-] shutdown cancelled by user\n");
-			return scheduled;
+	return sched_init(doit);
+}
+
+/*
+ * schedule $powcmd, due at wall clock time $deadline if not 0, else in
+ * $delay_ms; returns the id of the entry, 0 if it was dropped
+ */
+static uint32_t schedule(uint16_t powcmd, int64_t delay_ms, int64_t deadline)
+{
+	uint32_t id;
+
+	if (deadline)
+		id = sched_add_at(powcmd, deadline);
+	else
+		id = sched_add(powcmd, MAX(delay_ms, 0));
+	if (id == 0)
+		fprintf(stderr, "too many scheduled power commands, dropping %x\n", powcmd);
+	return id;
+}
+
+/* answer to a confirmation dialog, called from the event loop */
+static void confirmed(int ok, void *arg)
+{
+	struct pending *p = arg, **pp;
+	bool outdated;
+
+	pthread_mutex_lock(&power_lock);
+	for (pp = &confirms; *pp; pp = &(*pp)->next) {
+		if (*pp == p) {
+			*pp = p->next;
+			break;
 		}
-	} else {
+	}
+	outdated = p->gen != g_gen || p->cancelled;
+	pthread_mutex_unlock(&power_lock);
+
+	if (outdated)
+		PDEBUG("[-] confirmation for aborted command ignored\n");
+	else if (ok)
+		schedule(p->powcmd, p->delay_ms, p->deadline);
+	else
+		PDEBUG("[-] shutdown cancelled by user\n");
+	free(p);
+}
+
+int power_schedule(struct request *req, struct power_handle *h)
+{
+	struct pending *p;
+	uint16_t powcmd;
+	int64_t deadline;
+
+	/* copy request type and reset flag bits for switch case */
+	powcmd = req->req_type;
+	RESET_FORCE_BIT(powcmd);
+	RESET_MSEC_BIT(powcmd);
+	RESET_ABSTIME_BIT(powcmd);
+	/*
+	 * An absolute deadline is kept as is, so the time taken to deliver the
+	 * request and to confirm it does not shift it, unlike a timer.
+	 */
+	deadline = GET_ABSTIME_BIT(req->req_type) ? MAX(req->deadline, 1) : 0;
+
+	h->id = 0;
+	h->pending = NULL;
+	if (GET_FORCE_BIT(req->req_type)) {
 		PDEBUG("[-] force bit set\n");
+		if ((h->id = schedule(powcmd, request_timer_ms(req), deadline)) == 0)
+			return 0;
 		send_notification(req);
+		return POWER_SCHEDULED;
 	}
 
-	act.sa_handler = sigalrm_handler;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = SA_RESTART;
-
-	alarm(0);	/* cancel any pending commands */
-	PDEBUG("[+] cancelled any pending alarm\n");
-	if (sigaction(SIGALRM, &act, NULL) < 0) {
-		perror("sigaction: error setting SIGALRM handler");
+	PDEBUG("[-] no force bit\n");
+	if ((p = malloc(sizeof(*p))) == NULL)
+		return 0;
+	p->delay_ms = request_timer_ms(req);
+	p->deadline = deadline;
+	p->powcmd = powcmd;
+	p->cancelled = false;
+	/*
+	 * Held across the spawn so the dialog is on the list before its answer
+	 * can arrive: confirmed() runs on the event loop and takes the lock.
+	 */
+	pthread_mutex_lock(&power_lock);
+	p->gen = g_gen;
+	if ((p->dialog = confirm_async(req, CONFIRM_TIMEOUT, confirmed, p)) == NULL) {
+		pthread_mutex_unlock(&power_lock);
+		free(p);
 		return 0;
 	}
-	PDEBUG("[+] signal handler registered\n");
+	p->next = confirms;
+	confirms = p;
+	h->pending = p;
+	pthread_mutex_unlock(&power_lock);
 
+	return POWER_PENDING;
+}
 
-	/* no timer, do it immediately */
-	if (req->timer == 0) {
-		doit(g_powcmd);
-		/* may not reach here depending on request type */
-	} else {
-		alarm(req->timer);
-		PDEBUG("[+] alarm set for %d seconds\n", req->timer);
+void power_unschedule(const struct power_handle *h)
+{
+	if (h->id)
+		sched_cancel(h->id);
+	if (!h->pending)
+		return;
+	pthread_mutex_lock(&power_lock);
+	/* only dereferenced while on the list, confirmed() frees it once off */
+	for (struct pending *p = confirms; p; p = p->next) {
+		if (p == h->pending) {
+			p->cancelled = true;
+			confirm_cancel(p->dialog);
+			break;
+		}
 	}
-	scheduled = 1;
-	state->issued_at = time(NULL);
+	pthread_mutex_unlock(&power_lock);
+}
 
-	return scheduled;
+/* whether confirmation $p is one of the $nkeep of $keep */
+static bool kept(const struct pending *p, const struct power_handle *keep, size_t nkeep)
+{
+	for (size_t i = 0; i < nkeep; ++i)
+		if (keep[i].pending == p)
+			return true;
+	return false;
 }
 
-void power_abort(void)
+int power_abort(uint32_t id, const struct power_handle *keep, size_t nkeep)
 {
+	uint32_t ids[BATCH_MAX];
+	size_t nids = 0;
+
+	if (id != 0) {
+		PDEBUG("[-] aborting entry %u\n", id);
+		return sched_cancel(id);
+	}
+
 	PDEBUG("[-] aborting any pending requests\n");
-	alarm(0);
+	pthread_mutex_lock(&power_lock);
+	++g_gen;
+	for (struct pending *p = confirms; p; p = p->next) {
+		if (kept(p, keep, nkeep))
+			p->gen = g_gen;
+		else
+			confirm_cancel(p->dialog);
+	}
+	pthread_mutex_unlock(&power_lock);
+	for (size_t i = 0; i < MIN(nkeep, BATCH_MAX); ++i)
+		if (keep[i].id)
+			ids[nids++] = keep[i].id;
+	sched_cancel_all(ids, nids);
+	return 0;
+}
+
+size_t power_room(void)
+{
+	return sched_room();
+}
+
+void power_get_state(struct sstate *state)
+{
+	int64_t now;
+	struct timespec ts;
+
+	state->npending = sched_list(state->pending, SSTATE_MAX_PENDING);
+	if (sched_last(&state->fired, &state->fired_at) == -1) {
+		state->fired.id = 0;
+		state->fired_at = 0;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	state->issued_at = ts.tv_sec;
+	if (state->npending > 0) {
+		state->powcmd = state->pending[0].powcmd;
+		/* seconds left, rounded up */
+		state->timer = (MAX(state->pending[0].due - now, 0) + 999) / 1000;
+	} else {
+		state->powcmd = 0;
+		state->timer = 0;
+	}
 }
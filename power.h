@@ -3,8 +3,59 @@
 
 #include "protocol.h"	/* get definition of struct request and state */
 
-int power_schedule(struct request *req, struct sstate *state);
+/*
+ * power_init:
+ * 	Set up the scheduler for power commands, which carries out each command
+ * 	from the event loop when it is due.
+ * 	Returns -1 on error and 0 on success.
+ */
+int power_init(void);
 
-void power_abort(void);
+/* return values of power_schedule() */
+#define POWER_SCHEDULED	1
+#define POWER_PENDING	2	/* waiting for the user to confirm */
+
+/* what power_schedule() did, for power_unschedule() to undo */
+struct power_handle {
+	uint32_t	id;		/* of the scheduled entry, 0 if none */
+	struct pending	*pending;	/* confirmation asked for, NULL if none */
+};
+
+/*
+ * power_schedule:
+ * 	Schedule the power command in $req alongside any already scheduled ones
+ * 	(see sched.h for which one wins when several are due). Unless the force
+ * 	bit is set, the user is asked first and the command is only
+ * 	scheduled once confirmed; this function does not wait for the answer.
+ * 	What was done is kept in *$h.
+ * 	Returns POWER_SCHEDULED, POWER_PENDING, or 0 if it was not scheduled.
+ */
+int power_schedule(struct request *req, struct power_handle *h);
+
+/*
+ * power_unschedule:
+ * 	Cancel the command scheduled through $h, or the confirmation asked for
+ * 	it. A confirmation already answered cannot be taken back.
+ */
+void power_unschedule(const struct power_handle *h);
+
+/*
+ * power_abort:
+ * 	Cancel scheduled command $id, or if $id is 0 every scheduled command and
+ * 	pending confirmation but the $nkeep (at most BATCH_MAX) of $keep.
+ * 	Returns -1 if there is no command $id.
+ */
+int power_abort(uint32_t id, const struct power_handle *keep, size_t nkeep);
+
+/* power_room:	Return how many more commands can be scheduled */
+size_t power_room(void);
+
+/*
+ * power_get_state:
+ * 	Fill in the pending list of $state, the last command carried out, and
+ * 	its powcmd, timer (seconds left) and issued_at fields from the command
+ * 	due first.
+ */
+void power_get_state(struct sstate *state);
 
 #endif /* #ifndef POWER_H */
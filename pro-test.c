@@ -1,14 +1,75 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include "common.h"
 #include "protocol.h"
 #include "auth.h"
+#include "replay.h"
+#include "admit.h"
+#include "stats.h"
+#include "filter.h"
+#include "acl.h"
+#include "session.h"
+#include "merkle.h"
+#include "dedupe.h"
+#include "tx.h"
+#include "targets.h"
+#include "sweep.h"
 
 int sstate_pack_unpack_test(void);
 int request_pack_unpack_test(void);
+int request_noalloc_test(void);
+int replay_window_test(void);
+int replay_seq_test(void);
+int admit_test(void);
+int socket_filter_test(void);
+int acl_test(void);
+int sig_backends_test(void);
+int session_test(void);
+int batch_test(void);
+int merkle_test(void);
+int dedupe_test(void);
+int truststore_test(void);
+int pubkey_reload_test(void);
+int txvec_test(void);
+int targets_test(void);
+int sweep_test(void);
+
+/*
+ * malloc() and friends are wrapped to count the allocations made while
+ * counting_allocs is set, passing them on to glibc.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static int counting_allocs, nallocs;
+
+void *malloc(size_t size)
+{
+	nallocs += counting_allocs;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	nallocs += counting_allocs;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	nallocs += counting_allocs;
+	return __libc_realloc(ptr, size);
+}
 
 int
 main(void)
@@ -22,6 +83,134 @@ main(void)
 		ret = 1;
 	}
 
+	printf("request_noalloc: ");
+	if (request_noalloc_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("replay_window: ");
+	if (replay_window_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("replay_seq: ");
+	if (replay_seq_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("admit: ");
+	if (admit_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("socket_filter: ");
+	if (socket_filter_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("acl: ");
+	if (acl_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("sig_backends: ");
+	if (sig_backends_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("session: ");
+	if (session_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("batch: ");
+	if (batch_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("merkle: ");
+	if (merkle_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("dedupe: ");
+	if (dedupe_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("truststore: ");
+	if (truststore_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("pubkey_reload: ");
+	if (pubkey_reload_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("txvec: ");
+	if (txvec_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("targets: ");
+	if (targets_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
+	printf("sweep: ");
+	if (sweep_test()) {
+		puts("PASSED");
+	} else {
+		puts("FAILED");
+		ret = 1;
+	}
+
 	printf("sstate_pack_unpack: ");
 	if (sstate_pack_unpack_test()) {
 		puts("PASSED");
@@ -52,7 +241,8 @@ int request_pack_unpack_test(void)
 
 	sprintf(before, "%lld %x %x %d",
 		req.when, req.req_type, req.timer, req.msg_size);
-	char *reqbuf = pack_request(&req, &size);
+	unsigned char reqbuf[REQUEST_MAX_SIZE];
+	size = pack_request(&req, reqbuf, sizeof(reqbuf));
 	sigstart = size;
 	sign_request(reqbuf, &size, &sigsize, "pvtkey.pem");
 	printf("reqbuf size after signing: %zu\n", size);
@@ -75,37 +265,1010 @@ int request_pack_unpack_test(void)
 		PDEBUG("%02hhx ", reqbuf[i]);
 	PDEBUG("\n=========\n");
 
-	char *rp = unpack_request_fixed(&req, reqbuf);
-	req.msg = strdup(rp);		// copy message string
-	rp += strlen(req.msg)+1;	// move past message string
-	unpack_signature(&req.sig, rp);
-	if (verifysig("pubkey.pem", reqbuf, size, req.sig.sig, &sigsize))
+	if (unpack_request(&req, reqbuf, size) == sigstart && pubkey_load("pubkey.pem") == 0
+			&& verifysig(req.sigalg, 0, reqbuf, sigstart, req.sig.sig, &sigsize))
 		printf("verification successful!!!\n");
+	pubkey_unload();
 	sprintf(after, "%lld %x %x %d",
 		req.when, req.req_type, req.timer, req.msg_size);
 
-	free(reqbuf);
-
 	return !strcmp(before, after);
 }
 
+/*
+ * The server parses requests in place: nothing may be allocated parsing
+ * a datagram, and nothing may be read past its end.
+ */
+int request_noalloc_test(void)
+{
+	unsigned char buf[REQUEST_MAX_SIZE];
+	size_t size, sigsize;
+	ssize_t signedsize;
+	struct request req;
+
+	for (uint8_t version = 1; version <= PROTO_VERSION; ++version) {
+		req = (struct request){
+			.when = time(NULL),
+			.req_type = REQ_NOTIFY,
+			.msg_size = 5,
+			.msg = "hello",
+			.version = version
+		};
+		size = pack_request(&req, buf, sizeof(buf));
+		if (size == 0 || !sign_request(buf, &size, &sigsize, "pvtkey.pem"))
+			return 0;
+
+		memset(&req, 0, sizeof(req));
+		counting_allocs = 1;
+		signedsize = unpack_request(&req, buf, size);
+		counting_allocs = 0;
+		if (nallocs != 0 || signedsize != size - sigsize - 2 || req.version != version)
+			return 0;
+		/* the message is a view of the datagram, not a copy */
+		if (req.msg != buf + signedsize - 5 || memcmp(req.msg, "hello", 5) != 0)
+			return 0;
+
+		/* every truncation is caught, whichever field it cuts */
+		for (size_t len = 0; len < size; ++len)
+			if (unpack_request(&req, buf, len) != -1)
+				return 0;
+	}
+	return 1;
+}
+
+int replay_window_test(void)
+{
+	int64_t now = 1700000000000;
+	uint64_t seq = 1000000;
+
+	replay_reset();
+	/* new, reordered within the window, and duplicates */
+	if (replay_check(0, 1, seq, now, now) != REPLAY_OK
+			|| replay_check(0, 1, seq + 5, now, now) != REPLAY_OK
+			|| replay_check(0, 1, seq + 2, now, now) != REPLAY_OK)
+		return 0;
+	/* a duplicate is told apart by whether its first copy was granted */
+	replay_grant(0, 1, seq + 5, now);
+	replay_grant(0, 2, seq, now);	/* not checked, so not tracked either */
+	if (replay_check(0, 1, seq + 5, now, now) != REPLAY_DUP
+			|| replay_check(0, 1, seq, now, now) != REPLAY_REFUSED)
+		return 0;
+	/* another client, or the same one under another key, is tracked separately */
+	if (replay_check(0, 2, seq, now, now) != REPLAY_OK
+			|| replay_check(7, 1, seq, now, now) != REPLAY_OK)
+		return 0;
+	/* sliding far ahead forgets what fell out of the window */
+	if (replay_check(0, 1, seq + 5 * REPLAY_WINDOW, now, now) != REPLAY_OK
+			|| replay_check(0, 1, seq + 4 * REPLAY_WINDOW, now, now) != REPLAY_OLD
+			|| replay_check(0, 1, seq + 5, now, now) != REPLAY_OLD
+			|| replay_check(0, 1, seq + 4 * REPLAY_WINDOW + 1, now, now) != REPLAY_OK
+			|| replay_check(0, 1, seq + 5 * REPLAY_WINDOW - 1, now, now) != REPLAY_OK)
+		return 0;
+	/* send times too far from ours, either way */
+	if (replay_check(0, 1, seq + 6 * REPLAY_WINDOW, now - REPLAY_FRESH_MS - 1, now)
+				!= REPLAY_STALE
+			|| replay_check(0, 1, seq + 6 * REPLAY_WINDOW, now + REPLAY_FRESH_MS + 1, now)
+				!= REPLAY_STALE)
+		return 0;
+	/* once its requests can only be stale, a client is forgotten */
+	now += 2 * REPLAY_FRESH_MS + 1;
+	if (replay_check(0, 1, seq, now, now) != REPLAY_OK)
+		return 0;
+	/* thousands of clients fit */
+	for (uint64_t id = 100; id < 100 + REPLAY_SLOTS - 1; ++id)
+		if (replay_check(0, id, seq, now, now) != REPLAY_OK)
+			return 0;
+	return replay_check(0, ~0ULL, seq, now, now) == REPLAY_FULL;
+}
+
+/*
+ * Two senders sharing a client id take their sequence numbers from one
+ * counter, so the server takes each of their requests once, however they
+ * overtake each other and whatever the clock does.
+ */
+int replay_seq_test(void)
+{
+	char path[] = "/tmp/lsd-seq-XXXXXX";
+	uint64_t a[100], b[100], first = 0;
+	int64_t now = 1800000000000;
+	int fd, ok = 1;
+
+	if ((fd = mkstemp(path)) == -1)
+		return 0;
+	close(fd);
+	replay_reset();
+	/* an empty counter starts from the clock */
+	ok &= replay_next_seq(path, &first) == 0 && first > 1700000000000000ULL;
+	for (int i = 0; i < 100; ++i)
+		ok &= replay_next_seq(path, &a[i]) == 0 && replay_next_seq(path, &b[i]) == 0;
+	ok &= a[0] == first + 1 && b[99] == first + 200;
+	/* b's requests, latest first, overtake all of a's, sent 30 s earlier */
+	for (int i = 99; i >= 0; --i)
+		ok &= replay_check(0, 42, b[i], now, now) == REPLAY_OK;
+	for (int i = 0; i < 100; ++i)
+		ok &= replay_check(0, 42, a[i], now - 30000, now) == REPLAY_OK;
+	/* the clock stepped back: numbering goes on all the same */
+	ok &= replay_next_seq(path, &first) == 0 && first == b[99] + 1
+		&& replay_check(0, 42, first, now - 1000, now) == REPLAY_OK;
+	ok &= replay_check(0, 42, a[50], now, now) == REPLAY_REFUSED
+		&& replay_check(0, 42, b[0], now, now) == REPLAY_REFUSED;
+	unlink(path);
+	return ok;
+}
+
+int admit_test(void)
+{
+	unsigned char buf[REQUEST_MAX_SIZE + 1] = { 0 };
+	struct request req = { .when = 1, .req_type = REQ_QUERY, .version = 2 };
+	struct sockaddr_in *sin;
+	struct rxslot slot = { .buf = buf, .stamp = 1700000000000 };
+	int n;
+
+	sin = (struct sockaddr_in *)&slot.addr;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0x7f000001);
+	/* followed by an empty signature, as far as admission cares it is fine */
+	slot.len = pack_request(&req, buf, sizeof(buf)) + 2;
+	admit_init(10, 5);
+
+	/* a burst goes through, then one request per 100 ms */
+	for (n = 0; admit_datagram(&slot) == ADMIT_OK; ++n)
+		;
+	if (n != 5 || admit_datagram(&slot) != ADMIT_LIMITED)
+		return 0;
+	slot.stamp += 100;
+	if (admit_datagram(&slot) != ADMIT_OK || admit_datagram(&slot) != ADMIT_LIMITED)
+		return 0;
+	/* other sources are not affected */
+	sin->sin_addr.s_addr = htonl(0x7f000002);
+	if (admit_datagram(&slot) != ADMIT_OK)
+		return 0;
+	/* malformed datagrams are dropped before costing any tokens */
+	slot.len -= 3;
+	if (admit_datagram(&slot) != ADMIT_MALFORMED)
+		return 0;
+	slot.len = sizeof(buf);
+	if (admit_datagram(&slot) != ADMIT_MALFORMED)
+		return 0;
+	return STATS_GET(admit_limited) == 3 && STATS_GET(admit_malformed) == 2;
+}
+
+/* pack $req followed by a signature of $sigsize bytes, returning its size */
+static size_t pack_signed(struct request *req, unsigned char *buf, uint16_t sigsize)
+{
+	size_t size = pack_request(req, buf, REQUEST_MAX_SIZE);
+
+	buf[size++] = sigsize >> 8;
+	buf[size++] = sigsize & 0xff;
+	memset(buf + size, 0x5a, MIN(sigsize, 192));
+	return size + MIN(sigsize, 192);
+}
+
+/*
+ * Crafted datagrams are sent to a socket with the filter attached: only the
+ * well-formed ones, each marked by its timer, may come out of it.
+ */
+int socket_filter_test(void)
+{
+	static unsigned char buf[REQUEST_MAX_SIZE + 64], batch[BATCH_MAXSIZE];
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t addrlen = sizeof(addr);
+	struct request req = { .req_type = REQ_NOTIFY, .msg = (unsigned char *)"hi",
+		.msg_size = 2, .version = 2 };
+	int rx, tx, ok = 1;
+	ssize_t n;
+	size_t size;
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	rx = socket(AF_INET, SOCK_DGRAM, 0);
+	tx = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rx == -1 || tx == -1 || bind(rx, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| getsockname(rx, (struct sockaddr *)&addr, &addrlen) == -1
+			|| connect(tx, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| filter_attach(rx) == -1)
+		return 0;
+
+	/* well-formed: v2, v1 and v1 with a deadline, largest signature */
+	req.timer = 1;
+	send(tx, buf, pack_signed(&req, buf, 102), 0);
+	req.timer = 2;
+	req.version = 1;
+	send(tx, buf, pack_signed(&req, buf, 0), 0);
+	req.timer = 3;
+	req.req_type = REQ_POW_SHUTDOWN;
+	SET_ABSTIME_BIT(req.req_type);
+	send(tx, buf, pack_signed(&req, buf, 192), 0);
+	/* batches may be longer than a message */
+	req.timer = 4;
+	req.version = 2;
+	req.req_type = REQ_BATCH;
+	req.msg = batch;
+	req.msg_size = sizeof(batch);
+	send(tx, buf, pack_signed(&req, buf, 102), 0);
+	req.msg = (unsigned char *)"hi";
+	req.msg_size = 2;
+	/* a proof between the request and the signature of its Merkle root */
+	req.timer = 5;
+	req.req_type = REQ_NOTIFY;
+	req.proof = (struct merkle_proof){ .index = 1, .count = 2, .hashes = batch };
+	size = pack_request(&req, buf, sizeof(buf));
+	size += pack_merkle_proof(&req.proof, buf + size, sizeof(buf) - size);
+	buf[size++] = 0;
+	buf[size++] = 64;
+	send(tx, buf, size + 64, 0);
+	req.proof.count = 0;
+	/* the id of the key between the fixed fields and the message */
+	req.timer = 6;
+	req.keyid = 0x1234;
+	send(tx, buf, pack_signed(&req, buf, 64), 0);
+	req.keyid = 0;
+
+	/* malformed, in either version */
+	req.timer = 0;
+	for (req.version = 1; req.version <= 2; ++req.version) {
+		req.req_type = REQ_QUERY;
+		size = pack_signed(&req, buf, 102);
+		send(tx, buf, 5, 0);				/* truncated */
+		send(tx, buf, size - 1, 0);			/* signature cut short */
+		send(tx, buf, sizeof(buf), 0);			/* too long */
+		send(tx, buf, pack_signed(&req, buf, 193), 0);	/* signature too long */
+		req.req_type = 0;
+		send(tx, buf, pack_signed(&req, buf, 102), 0);	/* unknown types */
+		req.req_type = REQ_MAX + 1;
+		send(tx, buf, pack_signed(&req, buf, 102), 0);
+	}
+	/* v1 and v2 msg_size, after when, timer and req_type, over MSG_MAXSIZE */
+	req.req_type = REQ_NOTIFY;
+	req.version = 1;
+	size = pack_signed(&req, buf, 0);
+	buf[15] = MSG_MAXSIZE + 1;
+	send(tx, buf, size + MSG_MAXSIZE, 0);
+	req.version = 2;
+	size = pack_signed(&req, buf, 0);
+	buf[REQUEST_V2_HEADER_SIZE + 15] = MSG_MAXSIZE + 1;
+	send(tx, buf, size, 0);
+	/* v2 length not matching msg_size, or the key id flagged but missing */
+	pack_signed(&req, buf, 0);
+	buf[REQUEST_V2_HEADER_SIZE - 1] += 1;
+	send(tx, buf, size, 0);
+	pack_signed(&req, buf, 0);
+	buf[3] |= SIG_KEYID;
+	send(tx, buf, size, 0);
+	/* v1 with a deadline missing */
+	req.version = 1;
+	SET_ABSTIME_BIT(req.req_type);
+	size = pack_request(&req, buf, sizeof(buf)) - 2 * sizeof(int64_t);
+	buf[size++] = 0;
+	buf[size++] = 0;
+	send(tx, buf, size, 0);
+
+	/* what came through, in order, in the timer field */
+	for (int32_t want = 1; want <= 7; ++want) {
+		n = recv(rx, buf, sizeof(buf), want == 7 ? MSG_DONTWAIT : 0);
+		if (want == 7) {
+			ok &= n == -1;
+		} else {
+			ok &= n > 0 && unpack_request(&req, buf, n) != -1
+				&& req.timer == want;
+		}
+	}
+	close(rx);
+	close(tx);
+	return ok;
+}
+
+/* acl_check() for a request of type $type from $ip */
+static int acl_check_ip(const char *ip, uint16_t type)
+{
+	struct sockaddr_storage ss = { 0 };
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+	if (inet_pton(AF_INET, ip, &sin->sin_addr) == 1)
+		ss.ss_family = AF_INET;
+	else if (inet_pton(AF_INET6, ip, &sin6->sin6_addr) == 1)
+		ss.ss_family = AF_INET6;
+	return acl_check(&ss, type);
+}
+
+int acl_test(void)
+{
+	char path[] = "/tmp/lsd-acl-XXXXXX";
+	FILE *fp;
+	int fd, ok;
+
+	if ((fd = mkstemp(path)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+		return 0;
+	fputs("# test ACL\n"
+		"10.20.0.0/16 notify query\n"
+		"10.20.5.0/24 all\n"
+		"10.20.5.7/32 shutdown\n"
+		"10.20.99.0/24\n"
+		"10.20.0.0/16 abort	# adds to the first line\n"
+		"2001:db8::/32 notify,QUERY\n"
+		"2001:db8:1:2::/64 reboot\n", fp);
+	fclose(fp);
+
+	/* nothing loaded: everything allowed */
+	ok = acl_check_ip("192.0.2.1", REQ_POW_REBOOT) == ACL_ALLOW;
+	ok &= acl_load(path) == 0;
+	/* the longest prefix decides, flag bits do not matter */
+	ok &= acl_check_ip("10.20.1.1", REQ_NOTIFY) == ACL_ALLOW;
+	ok &= acl_check_ip("10.20.1.1", REQ_POW_ABORT) == ACL_ALLOW;
+	ok &= acl_check_ip("10.20.1.1", REQ_POW_SHUTDOWN | 0x8000) == ACL_DISABLED;
+	ok &= acl_check_ip("10.20.5.1", REQ_POW_SHUTDOWN | 0x8000) == ACL_ALLOW;
+	ok &= acl_check_ip("10.20.5.7", REQ_POW_SHUTDOWN) == ACL_ALLOW;
+	ok &= acl_check_ip("10.20.5.7", REQ_QUERY) == ACL_DISABLED;
+	ok &= acl_check_ip("10.20.99.3", REQ_QUERY) == ACL_DISABLED;
+	ok &= acl_check_ip("10.21.0.1", REQ_QUERY) == ACL_DENIED;
+	ok &= acl_check_ip("2001:db8:1:2::9", REQ_POW_REBOOT) == ACL_ALLOW;
+	ok &= acl_check_ip("2001:db8:1:2::9", REQ_NOTIFY) == ACL_DISABLED;
+	ok &= acl_check_ip("2001:db8:ffff::1", REQ_QUERY) == ACL_ALLOW;
+	ok &= acl_check_ip("2001:db9::1", REQ_QUERY) == ACL_DENIED;
+	/* an IPv4 address mapped into IPv6 is the same host */
+	ok &= acl_check_ip("::ffff:10.20.5.7", REQ_POW_SHUTDOWN) == ACL_ALLOW;
+
+	/* a broken ACL is not loaded, the previous one stays */
+	if ((fp = fopen(path, "w")) != NULL) {
+		fputs("10.0.0.0/33 all\n", fp);
+		fclose(fp);
+	}
+	ok &= acl_load(path) == -1;
+	ok &= acl_check_ip("10.20.5.7", REQ_POW_SHUTDOWN) == ACL_ALLOW;
+	acl_unload();
+	unlink(path);
+	return ok;
+}
+
+/*
+ * Requests signed by every backend verify with the right key and algorithm,
+ * with fixed size signatures where the algorithm has them, and not with
+ * another algorithm or once tampered with.
+ */
+int sig_backends_test(void)
+{
+	static const size_t sizes[] = {
+		[SIG_ECDSA_P256] = 64, [SIG_ECDSA_P384] = 96, [SIG_ED25519] = 64
+	};
+	const char *pvt = "/tmp/lsd-test-pvtkey.pem", *pub = "/tmp/lsd-test-pubkey.pem";
+	unsigned char buf[REQUEST_MAX_SIZE];
+	struct request req;
+	struct stat st;
+	size_t size, sigsize;
+	ssize_t signedsize;
+	int fd, ok = 1;
+
+	/* a private key is readable by its owner alone, even written over */
+	if ((fd = open(pvt, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		return 0;
+	close(fd);
+	chmod(pvt, 0644);
+	for (uint8_t alg = SIG_LEGACY; alg <= SIG_ED25519 && ok; ++alg) {
+		if (sig_keygen(alg, pvt, pub) == -1 || pubkey_load(pub) == -1)
+			return 0;
+		ok &= stat(pvt, &st) == 0 && (st.st_mode & 0777) == 0600;
+		req = (struct request){ .req_type = REQ_QUERY, .version = 2 };
+		req.sigalg = sig_key_alg(pvt);
+		ok &= req.sigalg == (alg == SIG_LEGACY ? SIG_ECDSA_P384 : alg);
+		req.sigalg = alg;
+		size = pack_request(&req, buf, sizeof(buf));
+		ok &= sign_request(buf, &size, &sigsize, pvt) != NULL;
+		ok &= (signedsize = unpack_request(&req, buf, size)) != -1;
+		if (!ok)
+			break;
+		ok &= req.sigalg == alg && (alg == SIG_LEGACY || sigsize == sizes[alg]);
+		ok &= verifysig(alg, 0, buf, signedsize, req.sig.sig, &sigsize);
+		/* another algorithm, or another size, with the same bytes */
+		ok &= !verifysig(alg % SIG_ALG_MAX + 1, 0, buf, signedsize,
+				req.sig.sig, &sigsize);
+		--sigsize;
+		ok &= !verifysig(alg, 0, buf, signedsize, req.sig.sig, &sigsize);
+		++sigsize;
+		req.sig.sig[sigsize / 2] ^= 1;
+		ok &= !verifysig(alg, 0, buf, signedsize, req.sig.sig, &sigsize);
+	}
+	pubkey_unload();
+	unlink(pvt);
+	unlink(pub);
+	return ok;
+}
+
+int session_test(void)
+{
+	unsigned char pub[SESSION_PUB_SIZE], buf[REQUEST_MAX_SIZE], wire[SESSION_REPLY_SIZE];
+	struct request req = { .req_type = REQ_QUERY, .version = 2, .sigalg = SIG_HMAC_SHA256,
+		.client_id = 42, .seq = 1 };
+	struct session_reply reply;
+	struct session_kex *kex;
+	struct session s = { 0 };
+	int64_t now = 1700000000000;
+	ssize_t signedsize;
+	uint64_t keyid = 0;
+	size_t size;
+	int ok = 1;
+
+	/* handshake, through the wire format of the reply */
+	if ((kex = session_kex_new(pub)) == NULL
+			|| session_open(7, 42, pub, sizeof(pub), now, &reply) == -1
+			|| pack_session_reply(&reply, wire, sizeof(wire)) != SESSION_REPLY_SIZE
+			|| unpack_session_reply(&reply, wire, sizeof(wire)) == -1)
+		return 0;
+	ok &= session_kex_finish(kex, 42, &reply, now, &s) == 0;
+	session_kex_free(kex);
+
+	size = session_seal(&s, buf, pack_request(&req, buf, sizeof(buf)));
+	if (!ok || (signedsize = unpack_request(&req, buf, size)) == -1)
+		return 0;
+	ok &= req.sigalg == SIG_HMAC_SHA256 && req.sig.sigsize == SESSION_TAG_SIZE;
+	ok &= session_verify(42, buf, signedsize, req.sig.sig, req.sig.sigsize, now, &keyid) == 1;
+	ok &= keyid == 7;
+	/* the session is the client's alone, and only lasts so long */
+	ok &= session_verify(43, buf, signedsize, req.sig.sig, req.sig.sigsize, now, &keyid) == 0;
+	ok &= session_verify(42, buf, signedsize, req.sig.sig, req.sig.sigsize,
+			now + SESSION_LIFETIME_MS, &keyid) == -1;
+	buf[signedsize - 1] ^= 1;
+	ok &= session_verify(42, buf, signedsize, req.sig.sig, req.sig.sigsize, now, &keyid) == 0;
+	buf[signedsize - 1] ^= 1;
+	/* another session id */
+	req.sig.sig[0] ^= 1;
+	ok &= session_verify(42, buf, signedsize, req.sig.sig, req.sig.sigsize, now, &keyid) == -1;
+	req.sig.sig[0] ^= 1;
+	/* key 7 is not in any trust store, its sessions go with a reload */
+	session_drop_untrusted();
+	ok &= session_verify(42, buf, signedsize, req.sig.sig, req.sig.sigsize, now, &keyid) == -1;
+	return ok;
+}
+
+int batch_test(void)
+{
+	unsigned char cmdbuf[BATCH_MAXSIZE], buf[REQUEST_MAX_SIZE];
+	struct request cmds[BATCH_MAX] = {
+		{ .req_type = REQ_NOTIFY, .msg = (unsigned char *)"going down", .msg_size = 10 },
+		{ .req_type = REQ_POW_SHUTDOWN, .timer = 300 },
+		{ .req_type = REQ_POW_REBOOT | (1 << 13), .deadline = 1700000000123 },
+	};
+	struct request req = { .req_type = REQ_BATCH, .version = 2, .client_id = 7, .seq = 9 };
+	struct request out[BATCH_MAX];
+	int ok = 1;
+
+	req.msg = cmdbuf;
+	req.msg_size = pack_batch(cmds, 3, cmdbuf, sizeof(cmdbuf));
+	if (unpack_request(&req, buf, pack_signed(&req, buf, 64)) == -1
+			|| unpack_batch(&req, out, BATCH_MAX) != 3)
+		return 0;
+	for (int i = 0; i < 3; ++i) {
+		ok &= out[i].req_type == cmds[i].req_type && out[i].timer == cmds[i].timer
+			&& out[i].msg_size == cmds[i].msg_size && out[i].seq == 9
+			&& out[i].client_id == 7;
+		ok &= !cmds[i].msg_size || !memcmp(out[i].msg, cmds[i].msg, cmds[i].msg_size);
+	}
+	ok &= out[2].deadline == cmds[2].deadline;
+	/* more commands than room for them, or cut short */
+	ok &= unpack_batch(&req, out, 2) == -1;
+	--req.msg_size;
+	ok &= unpack_batch(&req, out, BATCH_MAX) == -1;
+	/* no batches or session requests in batches */
+	req.msg = cmdbuf;
+	cmds[1].req_type = REQ_BATCH;
+	req.msg_size = pack_batch(cmds, 3, cmdbuf, sizeof(cmdbuf));
+	ok &= unpack_batch(&req, out, BATCH_MAX) == -1;
+	cmds[1].req_type = REQ_SESSION;
+	pack_batch(cmds, 3, cmdbuf, sizeof(cmdbuf));
+	ok &= unpack_batch(&req, out, BATCH_MAX) == -1;
+	/* empty */
+	req.msg_size = 0;
+	ok &= unpack_batch(&req, out, BATCH_MAX) == -1;
+	return ok;
+}
+
+int merkle_test(void)
+{
+	const char *pvt = "/tmp/lsd-test-pvtkey.pem", *pub = "/tmp/lsd-test-pubkey.pem";
+	static unsigned char buf[13][REQUEST_MAX_SIZE], leaves[13][MERKLE_HASH_SIZE];
+	unsigned char sig[sizeof(((struct signature *)0)->sig)];
+	struct request req, out;
+	struct merkle_tree *tree;
+	size_t size[13], siglen;
+	ssize_t signedsize;
+	int64_t now = 1700000000000;
+	unsigned long cached;
+	int ok = 1;
+
+	if (sig_keygen(SIG_ED25519, pvt, pub) == -1 || pubkey_load(pub) == -1)
+		return 0;
+	/* an odd number of leaves, so some move up a level without a sibling */
+	for (int i = 0; i < 13; ++i) {
+		req = (struct request){ .req_type = REQ_POW_SHUTDOWN, .timer = 60 + i, .version = 2,
+			.sigalg = SIG_ED25519, .client_id = 3, .seq = 5 };
+		req.proof.count = 13;
+		size[i] = pack_request(&req, buf[i], sizeof(buf[i]));
+		merkle_leaf(htonl(0x0a000001 + i), buf[i], size[i], leaves[i]);
+	}
+	if ((tree = merkle_build(leaves, 13)) == NULL
+			|| merkle_sign(tree, pvt, SIG_ED25519, sig, &siglen) == -1)
+		return 0;
+	for (int i = 0; i < 13; ++i) {
+		signedsize = size[i];
+		size[i] = merkle_seal(tree, i, sig, siglen, buf[i], size[i], sizeof(buf[i]));
+		ok &= unpack_request(&out, buf[i], size[i]) == signedsize;
+		ok &= out.proof.index == (uint32_t)i && out.proof.count == 13
+			&& out.sigalg == SIG_ED25519 && out.timer == 60 + i;
+		/* the first one verifies the signature, the others hit the cache */
+		cached = STATS_GET(merkle_cached);
+		ok &= merkle_verify(buf[i], signedsize, &out, htonl(0x0a000001 + i), now) == 1;
+		ok &= STATS_GET(merkle_cached) == cached + (i > 0);
+		/* another leaf's proof, a tampered request, a truncated proof */
+		out.proof.index ^= 1;
+		ok &= merkle_verify(buf[i], signedsize, &out, htonl(0x0a000001 + i), now) == 0;
+		out.proof.index ^= 1;
+		buf[i][signedsize - 1] ^= 1;
+		ok &= merkle_verify(buf[i], signedsize, &out, htonl(0x0a000001 + i), now) == 0;
+		buf[i][signedsize - 1] ^= 1;
+		/* sent to another server, or one not knowing its address */
+		ok &= merkle_verify(buf[i], signedsize, &out, htonl(0x0a000001 + (i + 1) % 13),
+				now) == 0;
+		ok &= merkle_verify(buf[i], signedsize, &out, 0, now) == 0;
+		ok &= unpack_request(&out, buf[i], signedsize + 8 + 31) == -1;
+	}
+	/* once forgotten the root is checked again, and only for so long */
+	merkle_cache_flush();
+	if ((signedsize = unpack_request(&out, buf[0], size[0])) == -1)
+		return 0;
+	out.sig.sig[0] ^= 1;
+	ok &= merkle_verify(buf[0], signedsize, &out, htonl(0x0a000001), now) == 0;
+	out.sig.sig[0] ^= 1;
+	ok &= merkle_verify(buf[0], signedsize, &out, htonl(0x0a000001), now) == 1;
+	cached = STATS_GET(merkle_cached);
+	ok &= merkle_verify(buf[0], signedsize, &out, htonl(0x0a000001),
+			now + MERKLE_CACHE_MS) == 1
+		&& STATS_GET(merkle_cached) == cached;
+	merkle_tree_free(tree);
+	pubkey_unload();
+	unlink(pvt);
+	unlink(pub);
+	return ok;
+}
+
+int dedupe_test(void)
+{
+	unsigned char buf[64] = "a signed request", reply[DEDUPE_REPLY_MAX];
+	struct sockaddr_in *sin;
+	struct rxslot slot = { .buf = buf, .len = sizeof(buf), .stamp = 1700000000000 };
+	unsigned long hits = STATS_GET(dedupe_hit);
+	size_t replylen = 0;
+	int ok = 1;
+
+	sin = (struct sockaddr_in *)&slot.addr;
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(1234);
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	slot.addrlen = sizeof(*sin);
+	dedupe_init();
+
+	/* a copy waits for the first one to be answered, then gets its reply */
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_NEW;
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_PENDING;
+	dedupe_answer(&slot, "ack", 3);
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_ANSWERED
+		&& replylen == 3 && !memcmp(reply, "ack", 3);
+	/* answered once only, and not to another address */
+	dedupe_answer(&slot, "again", 5);
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_ANSWERED && replylen == 3;
+	ok &= STATS_GET(dedupe_hit) == hits + 3;
+	sin->sin_port = htons(1235);
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_NEW;
+	sin->sin_port = htons(1234);
+	/* another datagram, failing verification */
+	buf[0] ^= 1;
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_NEW;
+	dedupe_reject(&slot);
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_INVALID;
+	buf[0] ^= 1;
+	/* forgotten after a while, or when flushed */
+	slot.stamp += DEDUPE_TTL_MS;
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_NEW;
+	slot.stamp -= DEDUPE_TTL_MS;
+	dedupe_flush();
+	ok &= dedupe_check(&slot, reply, &replylen) == DEDUPE_NEW;
+	return ok;
+}
+
+/* sign with key $name of trust store $dir, packing $req into $buf */
+static ssize_t sign_with(const char *dir, const char *name, struct request *req,
+		unsigned char *buf)
+{
+	char pvt[64];
+	size_t size, sigsize;
+
+	snprintf(pvt, sizeof(pvt), "%s/%s.key", dir, name);
+	req->sigalg = sig_key_alg(pvt);
+	if (sig_key_id(pvt, &req->keyid) == -1)
+		return -1;
+	size = pack_request(req, buf, REQUEST_MAX_SIZE);
+	if (!sign_request(buf, &size, &sigsize, pvt))
+		return -1;
+	return unpack_request(req, buf, size);
+}
+
+/*
+ * Requests name the key of the trust store they were signed with, which
+ * verifies them alone; keys removed from it are revoked by a reload, the
+ * others keep their counters.
+ */
+int truststore_test(void)
+{
+	static const char *const names[] = { "a", "b", "c" };
+	static const uint8_t algs[] = { SIG_ED25519, SIG_ECDSA_P256, SIG_ED25519 };
+	char dir[] = "/tmp/lsd-trust-XXXXXX", pvt[64], pub[64], line[128], *dump = NULL;
+	unsigned char buf[REQUEST_MAX_SIZE], wire[REQUEST_MAX_SIZE];
+	struct request req = { .req_type = REQ_QUERY, .version = 2, .client_id = 1, .seq = 1 };
+	struct request reqb = req;
+	uint64_t ida, idb, idc;
+	ssize_t signed_a, signed_b;
+	size_t dumpsize, siglen;
+	FILE *fp;
+	int ok = 1;
+
+	if (mkdtemp(dir) == NULL)
+		return 0;
+	for (int i = 0; i < 3; ++i) {
+		snprintf(pvt, sizeof(pvt), "%s/%s.key", dir, names[i]);
+		snprintf(pub, sizeof(pub), "%s/%s.pem", dir, names[i]);
+		ok &= sig_keygen(algs[i], pvt, pub) == 0;
+	}
+	ok &= truststore_load(dir) == 0;
+	ok &= (signed_b = sign_with(dir, "b", &reqb, wire)) != -1;
+	idb = reqb.keyid;
+	ok &= (signed_a = sign_with(dir, "a", &req, buf)) != -1;
+	ida = req.keyid;
+	if (!ok)
+		goto out;
+	/* the id goes through the wire format, and picks the key */
+	ok &= ida != 0 && ida != idb;
+	siglen = req.sig.sigsize;
+	ok &= verifysig(req.sigalg, ida, buf, signed_a, req.sig.sig, &siglen) == 1;
+	ok &= verifysig(req.sigalg, idb, buf, signed_a, req.sig.sig, &siglen) == 0;
+	ok &= verifysig(req.sigalg, ida ^ 1, buf, signed_a, req.sig.sig, &siglen) == 0;
+	/* no default key was loaded */
+	ok &= verifysig(req.sigalg, 0, buf, signed_a, req.sig.sig, &siglen) == 0;
+
+	/* a revoked key verifies nothing, the others go on counting */
+	snprintf(pub, sizeof(pub), "%s/a.pem", dir);
+	unlink(pub);
+	ok &= truststore_load(dir) == 0;
+	ok &= !truststore_has(ida) && truststore_has(idb) && truststore_has(0);
+	ok &= verifysig(req.sigalg, ida, buf, signed_a, req.sig.sig, &siglen) == 0;
+	siglen = reqb.sig.sigsize;
+	ok &= verifysig(reqb.sigalg, idb, wire, signed_b, reqb.sig.sig, &siglen) == 1;
+
+	/* an unreadable key is skipped, and does not hold up revoking another */
+	snprintf(pub, sizeof(pub), "%s/d.pem", dir);
+	if ((fp = fopen(pub, "w")) != NULL) {
+		fputs("not a key\n", fp);
+		fclose(fp);
+	}
+	snprintf(pvt, sizeof(pvt), "%s/c.key", dir);
+	ok &= sig_key_id(pvt, &idc) == 0 && truststore_has(idc);
+	snprintf(line, sizeof(line), "%s/c.pem", dir);
+	unlink(line);
+	ok &= truststore_load(dir) == 0 && truststore_has(idb) && !truststore_has(idc);
+	unlink(pub);
+
+	if ((fp = open_memstream(&dump, &dumpsize)) == NULL)
+		goto out;
+	truststore_dump(fp);
+	fclose(fp);
+	snprintf(line, sizeof(line), "%016llx %-24s %lu verified, %lu failed",
+		(unsigned long long)idb, "b.pem", 1UL, 1UL);
+	ok &= strstr(dump, line) != NULL;
+	snprintf(line, sizeof(line), "%016llx", (unsigned long long)ida);
+	ok &= strstr(dump, line) == NULL;
+	snprintf(line, sizeof(line), "%-41s %lu", "unknown key ids", 2UL);
+	ok &= strstr(dump, line) != NULL;
+	free(dump);
+out:
+	truststore_unload();
+	for (int i = 0; i < 3; ++i) {
+		snprintf(pvt, sizeof(pvt), "%s/%s.key", dir, names[i]);
+		snprintf(pub, sizeof(pub), "%s/%s.pem", dir, names[i]);
+		unlink(pvt);
+		unlink(pub);
+	}
+	rmdir(dir);
+	return ok;
+}
+
+/* open a session of client $client_id with key $keyid, sealing $req into $buf */
+static ssize_t seal_with_session(uint64_t keyid, uint64_t client_id, int64_t now,
+		struct request *req, unsigned char *buf)
+{
+	unsigned char pub[SESSION_PUB_SIZE];
+	struct session_reply reply;
+	struct session_kex *kex;
+	struct session s = { 0 };
+	int err;
+
+	if ((kex = session_kex_new(pub)) == NULL)
+		return -1;
+	err = session_open(keyid, client_id, pub, sizeof(pub), now, &reply) == -1
+		|| session_kex_finish(kex, client_id, &reply, now, &s) == -1;
+	session_kex_free(kex);
+	if (err)
+		return -1;
+	req->client_id = client_id;
+	return unpack_request(req, buf, session_seal(&s, buf,
+				pack_request(req, buf, REQUEST_MAX_SIZE)));
+}
+
+/*
+ * Reloading the default key, which may have been replaced, closes the
+ * sessions opened with it, and those alone; requests signed with the old
+ * key no longer verify.
+ */
+int pubkey_reload_test(void)
+{
+	char dir[] = "/tmp/lsd-pubkey-XXXXXX", pvt[64], pub[64];
+	unsigned char buf[REQUEST_MAX_SIZE], sbuf0[REQUEST_MAX_SIZE], sbuf7[REQUEST_MAX_SIZE];
+	struct request req = { .req_type = REQ_QUERY, .version = 2, .client_id = 1, .seq = 1 };
+	struct request sreq0 = { .req_type = REQ_QUERY, .version = 2, .sigalg = SIG_HMAC_SHA256,
+		.seq = 1 };
+	struct request sreq7 = sreq0;
+	int64_t now = 1700000000000;
+	ssize_t signedsize, signed0, signed7;
+	size_t size, sigsize;
+	uint64_t keyid;
+	int ok = 1;
+
+	if (mkdtemp(dir) == NULL)
+		return 0;
+	snprintf(pvt, sizeof(pvt), "%s/pvtkey.pem", dir);
+	snprintf(pub, sizeof(pub), "%s/pubkey.pem", dir);
+	req.sigalg = SIG_ED25519;
+	size = pack_request(&req, buf, sizeof(buf));
+	if (sig_keygen(SIG_ED25519, pvt, pub) == -1 || pubkey_load(pub) == -1
+			|| !sign_request(buf, &size, &sigsize, pvt)
+			|| (signedsize = unpack_request(&req, buf, size)) == -1
+			|| (signed0 = seal_with_session(0, 61, now, &sreq0, sbuf0)) == -1
+			|| (signed7 = seal_with_session(7, 62, now, &sreq7, sbuf7)) == -1) {
+		ok = 0;
+		goto out;
+	}
+	sigsize = req.sig.sigsize;
+	ok &= verifysig(req.sigalg, 0, buf, signedsize, req.sig.sig, &sigsize) == 1;
+	ok &= session_verify(61, sbuf0, signed0, sreq0.sig.sig, sreq0.sig.sigsize, now,
+			&keyid) == 1 && keyid == 0;
+
+	/* the key is replaced, and reloaded as a SIGHUP does */
+	ok &= sig_keygen(SIG_ED25519, pvt, pub) == 0 && pubkey_load(pub) == 0;
+	session_drop_key(0);
+	sigsize = req.sig.sigsize;
+	ok &= verifysig(req.sigalg, 0, buf, signedsize, req.sig.sig, &sigsize) == 0;
+	ok &= session_verify(61, sbuf0, signed0, sreq0.sig.sig, sreq0.sig.sigsize, now,
+			&keyid) == -1;
+	ok &= session_verify(62, sbuf7, signed7, sreq7.sig.sig, sreq7.sig.sigsize, now,
+			&keyid) == 1 && keyid == 7;
+	session_drop_key(7);
+out:
+	pubkey_unload();
+	unlink(pvt);
+	unlink(pub);
+	rmdir(dir);
+	return ok;
+}
+
 int sstate_pack_unpack_test(void)
 {
 	char sbuf[SSTATE_SIZE];
-	char before[256], after[256];
+	char before[512], after[512];
 	struct sstate s = {
 		.when = time(NULL),
 		.issued_at = time(NULL),
 		.powcmd = 0xdead,
 		.timer = 0x12345678,
-		.ack = ACK_GRANTED
+		.ack = ACK_DENIED,
+		.failed = 3,
+		.skew = -42,
+		.fired = { .id = 0x1234400, .powcmd = REQ_POW_SLEEP, .due = 1699999999000 },
+		.fired_at = 1699999999003,
+		.npending = 2,
+		.pending = {
+			{ .id = 0x1234501, .powcmd = REQ_POW_REBOOT, .due = 1700000000123 },
+			{ .id = 0x1234602, .powcmd = REQ_POW_SHUTDOWN, .due = 1700000004567 },
+		}
 	};
+	size_t size;
 
-	sprintf(before, "%ld %ld %x %x %x", s.when, s.issued_at, s.powcmd, s.timer, s.ack);
-	pack_sstate(&s, sbuf, SSTATE_SIZE);
-	for (int i = 0; i < SSTATE_SIZE; ++i)
+	sprintf(before, "%ld %ld %x %x %x %u %ld %u %ld %u %x %ld %u %x %ld", s.when,
+		s.issued_at, s.powcmd, s.timer, s.ack, s.failed, s.skew, s.fired.id, s.fired_at,
+		s.pending[0].id, s.pending[0].powcmd, s.pending[0].due,
+		s.pending[1].id, s.pending[1].powcmd, s.pending[1].due);
+	size = pack_sstate(&s, sbuf, SSTATE_SIZE);
+	for (size_t i = 0; i < size; ++i)
 		PDEBUG("%02hhx ", sbuf[i]);
-	unpack_sstate(&s, sbuf);
-	sprintf(after, "%ld %ld %x %x %x", s.when, s.issued_at, s.powcmd, s.timer, s.ack);
+	memset(&s, 0, sizeof(s));
+	/* a truncated state must be rejected */
+	if (unpack_sstate(&s, sbuf, size - 1) != -1 || unpack_sstate(&s, sbuf, size) == -1)
+		return 0;
+	sprintf(after, "%ld %ld %x %x %x %u %ld %u %ld %u %x %ld %u %x %ld", s.when,
+		s.issued_at, s.powcmd, s.timer, s.ack, s.failed, s.skew, s.fired.id, s.fired_at,
+		s.pending[0].id, s.pending[0].powcmd, s.pending[0].due,
+		s.pending[1].id, s.pending[1].powcmd, s.pending[1].due);
 	return !strcmp(before, after);
 }
+
+/*
+ * One payload fanned out over more than a batch of messages, one of which
+ * cannot be sent: it is skipped and the others still go out.
+ */
+int txvec_test(void)
+{
+	static unsigned char big[70000];
+	unsigned char payload[8] = "fan-out", buf[16];
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t addrlen = sizeof(addr);
+	size_t count = TXBATCH_MAX + 100;
+	struct txvec v;
+	int rx, tx, ok = 1;
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	rx = socket(AF_INET, SOCK_DGRAM, 0);
+	tx = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rx == -1 || tx == -1 || bind(rx, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| getsockname(rx, (struct sockaddr *)&addr, &addrlen) == -1
+			|| txvec_init(&v, count) == -1)
+		return 0;
+	for (size_t i = 0; i < count; ++i)
+		ok &= txvec_add(&v, i == 700 ? big : payload, i == 700 ? sizeof(big) : sizeof(payload),
+				(struct sockaddr *)&addr, sizeof(addr)) == 0;
+	ok &= txvec_add(&v, payload, sizeof(payload), (struct sockaddr *)&addr,
+			sizeof(addr)) == -1;
+	ok &= txvec_send(&v, tx) == count - 1;
+	ok &= v.sent == count - 1 && v.failed == 1 && v.error == EMSGSIZE;
+	/* sent up to the bad one, failed on it, sent the rest */
+	ok &= v.syscalls == 3;
+	ok &= v.msgs[699].msg_len == sizeof(payload) && v.msgs[700].msg_len == 0
+		&& v.msgs[count - 1].msg_len == sizeof(payload);
+	ok &= recv(rx, buf, sizeof(buf), MSG_DONTWAIT) == sizeof(payload)
+		&& !memcmp(buf, payload, sizeof(payload));
+	txvec_free(&v);
+	close(rx);
+	close(tx);
+	return ok;
+}
+
+/*
+ * Hosts added to a table sized for one, so that it grows many times over,
+ * are each found again by address and port and kept in the order added.
+ */
+int targets_test(void)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(6969) };
+	struct sstate ack = { .ack = ACK_DENIED, .skew = -3, .fired = { 7, REQ_POW_SHUTDOWN, 1000 },
+		.fired_at = 1002, .npending = 2 };
+	const size_t count = 50000;
+	struct target *tgt;
+	struct targets t;
+	int added, ok = 1;
+
+	if (targets_init(&t, 1) == -1)
+		return 0;
+	for (size_t i = 0; i < count; ++i) {
+		addr.sin_addr.s_addr = htonl(0x0a000000 + i);
+		tgt = targets_add(&t, &addr, i, &added);
+		ok &= tgt && added && tgt->host == i && tgt->state == TARGET_WAITING;
+	}
+	/* the same address on another port is another host, a copy is not */
+	addr.sin_port = htons(6970);
+	ok &= targets_add(&t, &addr, count, &added) != NULL && added;
+	addr.sin_port = htons(6969);
+	addr.sin_addr.s_addr = htonl(0x0a000000 + 1234);
+	ok &= (tgt = targets_add(&t, &addr, count + 1, &added)) != NULL && !added
+		&& tgt->host == 1234 && t.count == count + 1;
+	for (size_t i = 0; i < count; i += 997) {
+		addr.sin_addr.s_addr = htonl(0x0a000000 + i);
+		ok &= (tgt = targets_find(&t, &addr)) == &t.v[i] && tgt->host == i;
+	}
+	addr.sin_addr.s_addr = htonl(0x0b000000);
+	ok &= targets_find(&t, &addr) == NULL;
+
+	tgt = &t.v[42];
+	target_answer(tgt, &ack);
+	ok &= tgt->state == TARGET_ANSWERED && tgt->ack == ACK_DENIED && tgt->skew == -3
+		&& tgt->npending == 2 && tgt->fired.id == 7 && tgt->fired_at - tgt->fired.due == 2;
+	targets_free(&t);
+	return ok;
+}
+
+static int ngave_up;
+
+static void count_gave_up(const struct target *tgt)
+{
+	(void)tgt;
+	++ngave_up;
+}
+
+/* send the hosts due at $now, as send_request() does */
+static int64_t pacer_send(struct pacer *p, struct targets *t, int64_t now)
+{
+	int64_t wake = pacer_due(p, t, now, INT64_MAX, count_gave_up);
+
+	for (size_t i = 0; i < p->ndue; ++i)
+		++t->v[p->due[i]].sends;
+	return pacer_sent(p, t, now, wake);
+}
+
+/*
+ * A sweep of four hosts, two at a time and sent the query twice each, moves
+ * on to the next host as one answers or is given up on, and sends again to
+ * those that do not answer. Without a sweep, hosts sent it as many times as
+ * allowed are waited for without being due again. The answers are summed
+ * up by command type, a host with two of a type counting once.
+ */
+int sweep_test(void)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(6969) };
+	struct sstate granted = { .ack = ACK_GRANTED, .issued_at = 1, .npending = 2,
+		.pending = { { 1, REQ_POW_REBOOT, 5000 }, { 2, REQ_POW_REBOOT, 8000 } } };
+	struct sstate replayed = { .ack = ACK_REPLAYED, .issued_at = 1, .npending = 2,
+		.pending = { { 3, REQ_POW_REBOOT, 3000 }, { 4, REQ_POW_SHUTDOWN, 9000 } } };
+	struct sstate idle = { .ack = ACK_GRANTED }, denied = { .ack = ACK_DENIED };
+	struct sweep sw = { 0 };
+	struct targets t;
+	struct pacer p;
+	int ok = 1;
+
+	if (targets_init(&t, 4) == -1)
+		return 0;
+	for (uint32_t i = 0; i < 4; ++i) {
+		addr.sin_addr.s_addr = htonl(0x0a000000 + i);
+		ok &= targets_add(&t, &addr, i, NULL) != NULL;
+	}
+	if (!ok || pacer_init(&p, t.count, 2, 2, true) == -1) {
+		targets_free(&t);
+		return 0;
+	}
+	ok &= pacer_send(&p, &t, 0) == RETRY_MS && p.ndue == 2 && !p.nretry
+		&& p.due[0] == 0 && p.due[1] == 1;
+	/* host 0 answers, host 2 takes its place */
+	target_answer(&t.v[0], &idle);
+	ok &= pacer_send(&p, &t, 100) == RETRY_MS && p.ndue == 1 && p.due[0] == 2
+		&& p.nwaiting == 2;
+	/* host 1 is sent it again, then host 2 */
+	ok &= pacer_send(&p, &t, 500) == 100 + RETRY_MS && p.ndue == 1 && p.nretry == 1
+		&& p.due[0] == 1 && t.v[1].next == 500 + 2 * RETRY_MS;
+	ok &= pacer_send(&p, &t, 600) == 500 + 2 * RETRY_MS && p.nretry == 1
+		&& p.due[0] == 2;
+	/* nothing is due before the wait for host 1 is over */
+	ok &= pacer_send(&p, &t, 1000) == 500 + 2 * RETRY_MS && !p.ndue && !ngave_up;
+	/* then it is given up on, host 3 takes its place */
+	pacer_send(&p, &t, 500 + 2 * RETRY_MS);
+	ok &= ngave_up == 1 && p.ndue == 1 && !p.nretry && p.due[0] == 3 && p.nwaiting == 2;
+	pacer_send(&p, &t, 600 + 2 * RETRY_MS);
+	ok &= ngave_up == 2 && !p.ndue && p.nwaiting == 1;
+	pacer_free(&p);
+
+	/* outside a sweep, host 0 is sent it once and waited for */
+	for (size_t i = 0; i < t.count; ++i)
+		t.v[i] = (struct target){ .addr = t.v[i].addr, .host = i };
+	ngave_up = 0;
+	if (pacer_init(&p, 1, 0, 1, false) == -1) {
+		targets_free(&t);
+		return 0;
+	}
+	ok &= pacer_send(&p, &t, 0) == INT64_MAX && p.ndue == 1;
+	ok &= pacer_send(&p, &t, 10 * RETRY_MS) == INT64_MAX && !p.ndue && p.nwaiting == 1
+		&& !ngave_up && t.v[0].sends == 1;
+	pacer_free(&p);
+	targets_free(&t);
+
+	sweep_add(&sw, &granted);
+	sweep_add(&sw, &replayed);
+	sweep_add(&sw, &idle);
+	sweep_add(&sw, &denied);
+	ok &= sw.refused == 1 && sw.idle == 1;
+	ok &= sw.hosts[REQ_POW_REBOOT] == 2 && sw.first[REQ_POW_REBOOT] == 2000
+		&& sw.last[REQ_POW_REBOOT] == 7000;
+	ok &= sw.hosts[REQ_POW_SHUTDOWN] == 1 && sw.first[REQ_POW_SHUTDOWN] == 8000
+		&& sw.last[REQ_POW_SHUTDOWN] == 8000 && !sw.hosts[REQ_POW_STANDBY];
+	return ok;
+}
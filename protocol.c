@@ -1,156 +1,225 @@
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <endian.h>
 
 #include "common.h"
 #include "protocol.h"
 #include "auth.h"
 
-static unsigned char *pack_int64(unsigned char buf[8], uint64_t num)
+/*
+ * Big endian accessors. put_* store a value and return the next address in
+ * the buffer, get_* load one and advance *$p past it. Neither checks bounds:
+ * callers check the whole buffer once before encoding or decoding it.
+ */
+static inline unsigned char *put_u8(unsigned char *p, uint8_t v)
 {
-	unsigned char *p = buf;
+	*p = v;
+	return p + 1;
+}
 
-	for (int i = 56; i >= 0; i -= 8) {
-		*p = num >> i;
-		++p;
-	}
-	return p;
+static inline unsigned char *put_u16(unsigned char *p, uint16_t v)
+{
+	v = htobe16(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
 }
 
-static unsigned char *pack_int32(unsigned char buf[4], uint32_t num)
+static inline unsigned char *put_u32(unsigned char *p, uint32_t v)
 {
-	buf[0] = num >> 24;
-	buf[1] = num >> 16;
-	buf[2] = num >> 8;
-	buf[3] = num;
-	return &buf[4];
+	v = htobe32(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
 }
 
-static unsigned char *pack_int16(unsigned char buf[2], uint16_t num)
+static inline unsigned char *put_u64(unsigned char *p, uint64_t v)
 {
-	buf[0] = num >> 8;
-	buf[1] = num;
-	return &buf[2];
+	v = htobe64(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
 }
 
-static unsigned char *unpack_int64(unsigned char buf[8], uint64_t *num)
+static inline uint8_t get_u8(const unsigned char **p)
 {
-	*num = 0;
-	unsigned char *p = buf;
+	return *(*p)++;
+}
+
+static inline uint16_t get_u16(const unsigned char **p)
+{
+	uint16_t v;
 
-	for (int i = 56; i >= 0; i -= 8)
-		*num |= *p++ << i;
-	return p;
+	memcpy(&v, *p, sizeof(v));
+	*p += sizeof(v);
+	return be16toh(v);
 }
 
-static unsigned char *unpack_int32(unsigned char buf[4], uint32_t *num)
+static inline uint32_t get_u32(const unsigned char **p)
 {
-	*num = 0;
+	uint32_t v;
 
-	*num |= buf[0] << 24;
-	*num |= buf[1] << 16;
-	*num |= buf[2] << 8;
-	*num |= buf[3];
-	return &buf[4];
+	memcpy(&v, *p, sizeof(v));
+	*p += sizeof(v);
+	return be32toh(v);
 }
 
-static unsigned char *unpack_int16(unsigned char buf[2], uint16_t *num)
+static inline uint64_t get_u64(const unsigned char **p)
 {
-	*num = 0;
+	uint64_t v;
 
-	*num |= buf[0] << 8;
-	*num |= buf[1];
-	return &buf[2];
+	memcpy(&v, *p, sizeof(v));
+	*p += sizeof(v);
+	return be64toh(v);
 }
 
+/* header of v2 requests, see REQUEST_V2_HEADER */
+struct v2hdr {
+	uint16_t	magic;
+	uint8_t		version;
+	uint8_t		sigalg;
+	uint16_t	length;
+};
+
 /*
- * struct request {
- * 	when;
- * 	timer;
- * 	req_type;
- * 	msg_size;
- * 	*msg;		// variable part
- * 	struct signature sig;
- * };
+ * Encoders and decoders generated from the field tables in protocol.h: each
+ * field of the table is stored or loaded in turn, in network byte order.
  */
+#define ENCODE_FIELD(type, name)	p = put_##type(p, s->name);
+#define DECODE_FIELD(type, name)	s->name = get_##type(&p);
+
+#define DEFINE_CODEC(codec, type, FIELDS) \
+static unsigned char *encode_##codec(const type *s, unsigned char *p) \
+{ \
+	FIELDS(ENCODE_FIELD) \
+	return p; \
+} \
+static const unsigned char *decode_##codec(type *s, const unsigned char *p) \
+{ \
+	FIELDS(DECODE_FIELD) \
+	return p; \
+}
+
+DEFINE_CODEC(v2hdr, struct v2hdr, REQUEST_V2_HEADER)
+DEFINE_CODEC(v1, struct request, REQUEST_V1_FIELDS)
+DEFINE_CODEC(v2, struct request, REQUEST_V2_FIELDS)
+DEFINE_CODEC(sstate, struct sstate, SSTATE_FIELDS)
+DEFINE_CODEC(sstate_entry, struct sstate_entry, SSTATE_ENTRY_FIELDS)
+DEFINE_CODEC(session_reply, struct session_reply, SESSION_REPLY_FIELDS)
+DEFINE_CODEC(batch_cmd, struct request, BATCH_CMD_FIELDS)
+DEFINE_CODEC(merkle_proof, struct merkle_proof, MERKLE_PROOF_FIELDS)
+
+#define REQUEST_V1_SIZE		(0 REQUEST_V1_FIELDS(PROTO_FIELD_SIZE))
+#define BATCH_CMD_SIZE		(0 BATCH_CMD_FIELDS(PROTO_FIELD_SIZE))
+#define MERKLE_PROOF_FIXED_SIZE	(0 MERKLE_PROOF_FIELDS(PROTO_FIELD_SIZE))
+
+_Static_assert(MERKLE_PROOF_FIXED_SIZE + MERKLE_MAX_DEPTH * MERKLE_HASH_SIZE
+		== MERKLE_PROOF_MAXSIZE, "MERKLE_PROOF_MAXSIZE out of sync");
+
+_Static_assert(REQUEST_V1_SIZE + 2 * sizeof(int64_t) <= REQUEST_V2_FIXED_SIZE,
+		"REQUEST_MAX_SIZE must have room for v1 requests");
+
+/* largest message of $req: batches of v2 carry their commands in it */
+static int16_t msg_max(const struct request *req)
+{
+	if (req->version >= 2 && (req->req_type & ~REQ_FLAG_BITS) == REQ_BATCH)
+		return BATCH_MAXSIZE;
+	return MSG_MAXSIZE;
+}
+
+/* fixed part of v1 requests, i.e excluding the msg buffer */
 size_t request_struct_fixedsize(void)
 {
-	struct request r;
+	return REQUEST_V1_SIZE;
+}
 
-	return sizeof(r.when) + sizeof(r.req_type) + sizeof(r.timer)
-		+ sizeof(r.msg_size);
+/* sstate: SSTATE_FIELDS, then npending times SSTATE_ENTRY_FIELDS */
+size_t sstate_struct_size(uint16_t npending)
+{
+	return (0 SSTATE_FIELDS(PROTO_FIELD_SIZE))
+		+ npending * (0 SSTATE_ENTRY_FIELDS(PROTO_FIELD_SIZE));
 }
 
-/*
- * struct sstate {
- * 	when;
- * 	issued_at;
- * 	timer;
- * 	powcmd;
- * 	ack;
- * }
- */
-size_t sstate_struct_size(void)
+size_t request_ext_size(struct request *req)
 {
-	struct sstate s;
+	if (GET_ABSTIME_BIT(req->req_type))
+		return sizeof(req->deadline) + sizeof(req->sent);
+	return 0;
+}
 
-	return sizeof(s.when) + sizeof(s.issued_at) + sizeof(s.powcmd) + sizeof(s.timer)
-		+ sizeof(s.ack);
+int64_t request_timer_ms(struct request *req)
+{
+	struct timespec now;
+
+	if (GET_ABSTIME_BIT(req->req_type)) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		return req->deadline - ((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	}
+	if (GET_MSEC_BIT(req->req_type))
+		return req->timer;
+	return (int64_t)req->timer * 1000;
 }
 /*
  * pack_request:
- * 	Pack request structure into a character array and return a pointer to it.
- * 	The character array is dynamically allocated and has to be freed by the caller.
- * 	$size  is set to the size of the array. The signature is NOT set here, it has
- * 	to be manually set 
+ * 	Pack request structure into $buf. The signature is NOT set here, it has
+ * 	to be appended with sign_request().
  *
- * 	struct request {
- * 		uint64_t	when;
- * 		int32_t		timer;
- * 		uint16_t	req_type;
- * 		int16_t		msg_size;
- * 		char		*msg;
- * 		struct signature sig;
- * 	}
+ * 	v1: REQUEST_V1_FIELDS, message, deadline and sent with the abstime bit
+ * 	v2: REQUEST_V2_HEADER, REQUEST_V2_FIELDS, message
  */
-unsigned char *pack_request(struct request *req, size_t *size)
+size_t pack_request(struct request *req, unsigned char *buf, size_t size)
 {
-	/* size needed for buffer is the fixed size + size of message */
-	unsigned char *buf, *ret;
-	unsigned char sig[192];
-	size_t msg_size, sigsize;
+	struct v2hdr hdr = { PROTO_MAGIC, PROTO_VERSION, req->sigalg, 0 };
+	unsigned char *p;
+	size_t packed;
+
+	if (req->proof.count)
+		hdr.sigalg |= SIG_MERKLE;
+	if (req->keyid)
+		hdr.sigalg |= SIG_KEYID;
 
 	/* limit on message size */
-	msg_size = MIN(req->msg_size, MSG_MAXSIZE);
-	*size = request_struct_fixedsize() + msg_size;
-	buf = malloc(*size + sizeof(struct signature));
-	if (buf == NULL) {
-		*size = 0;
-		return NULL;
-	}
-	ret = buf;
-	/* pack_* returns the next address in the buffer after packing */
-	buf = pack_int64(buf, req->when);
-	buf = pack_int32(buf, req->timer);
-	buf = pack_int16(buf, req->req_type);
-	buf = pack_int16(buf, msg_size);
-	if (req->msg_size > 0)
-		strncpy(buf, req->msg, req->msg_size+1);
+	req->msg_size = req->msg_size > 0 ? MIN(req->msg_size, msg_max(req)) : 0;
+	if (req->version >= 2)
+		packed = REQUEST_V2_FIXED_SIZE + (req->keyid ? REQUEST_V2_KEYID_SIZE : 0)
+			+ req->msg_size;
+	else
+		packed = REQUEST_V1_SIZE + req->msg_size + request_ext_size(req);
+	if (size < packed)
+		return 0;
 
-	return ret;
+	if (req->version >= 2) {
+		hdr.length = packed;
+		p = encode_v2hdr(&hdr, buf);
+		p = encode_v2(req, p);
+		if (req->keyid)
+			p = put_u64(p, req->keyid);
+		memcpy(p, req->msg, req->msg_size);
+	} else {
+		p = encode_v1(req, buf);
+		memcpy(p, req->msg, req->msg_size);
+		p += req->msg_size;
+		if (GET_ABSTIME_BIT(req->req_type)) {
+			p = put_u64(p, req->deadline);
+			p = put_u64(p, req->sent);
+		}
+	}
+	return packed;
 }
 
 unsigned char *sign_request(unsigned char *buf, size_t *bufsize, size_t *sigsize,
 		const char *keyfile)
 {
 	unsigned char sig[192];	// temporarily hold signature in buffer
+	const unsigned char *p = buf;
+	struct v2hdr hdr = { .sigalg = SIG_LEGACY };
 	int16_t size;
 
-	if (signbuf(keyfile, buf, *bufsize, (unsigned char **)&sig, sigsize) == -1)
+	if (*bufsize >= REQUEST_V2_HEADER_SIZE && get_u16(&p) == PROTO_MAGIC)
+		decode_v2hdr(&hdr, buf);
+	if (signbuf(keyfile, hdr.sigalg & ~SIG_FLAG_BITS, buf, *bufsize, sig, sigsize) == -1)
 		return NULL;
 	size = *sigsize;
-	unsigned char *p = buf;
-	buf = pack_int16(buf+*bufsize, size);
-	*bufsize += buf - (p+*bufsize);	// increment size after packing int16, could just add 2
+	buf = put_u16(buf + *bufsize, size);
+	*bufsize += sizeof(size);
 	memcpy(buf, sig, *sigsize);
 	*bufsize += *sigsize;
 
@@ -159,11 +228,189 @@ unsigned char *sign_request(unsigned char *buf, size_t *bufsize, size_t *sigsize
 
 void unpack_signature(struct signature *sig, unsigned char *buf)
 {
-	int16_t sigsize = 0;
+	const unsigned char *p = buf;
+
+	sig->sigsize = get_u16(&p);
+	memcpy(sig->sig, p, sig->sigsize);
+}
+
+/* unpack the proof in the $size bytes at $buf, pointing to its hashes there */
+static int unpack_merkle_proof(struct merkle_proof *proof, const unsigned char *buf, size_t size)
+{
+	const unsigned char *p;
+	size_t packed;
+
+	if (size < MERKLE_PROOF_FIXED_SIZE)
+		return -1;
+	p = decode_merkle_proof(proof, buf);
+	if (proof->count == 0 || proof->count > MERKLE_MAX_LEAVES || proof->index >= proof->count)
+		return -1;
+	packed = MERKLE_PROOF_FIXED_SIZE
+		+ merkle_proof_hashes(proof->index, proof->count) * MERKLE_HASH_SIZE;
+	if (size < packed)
+		return -1;
+	proof->hashes = p;
+	proof->size = packed;
+	return 0;
+}
+
+/* unpack the v2 request in $buf, returning the size of the signed part */
+static ssize_t unpack_v2(struct request *req, const unsigned char *buf, size_t size)
+{
+	struct v2hdr hdr;
+	const unsigned char *p;
+	size_t fixed = REQUEST_V2_FIXED_SIZE;
+	uint8_t alg;
+
+	/* one check covers every fixed field, the header gives the rest */
+	if (size < REQUEST_V2_FIXED_SIZE)
+		return -1;
+	p = decode_v2hdr(&hdr, buf);
+	alg = hdr.sigalg & ~SIG_FLAG_BITS;
+	if (hdr.sigalg & SIG_KEYID)
+		fixed += REQUEST_V2_KEYID_SIZE;
+	/* session tags stand for the key, and sign each request alone */
+	if (hdr.version != 2 || alg > SIG_ALG_MAX
+			|| (alg == SIG_HMAC_SHA256 && (hdr.sigalg & SIG_FLAG_BITS))
+			|| hdr.length < fixed || hdr.length > size)
+		return -1;
+	p = decode_v2(req, p);
+	req->version = 2;
+	req->keyid = 0;
+	if (hdr.sigalg & SIG_KEYID)
+		req->keyid = get_u64(&p);
+	if (req->msg_size < 0 || req->msg_size > msg_max(req)
+			|| req->msg_size != hdr.length - fixed)
+		return -1;
+	req->msg = req->msg_size > 0 ? (unsigned char *)p : NULL;
+	req->sigalg = alg;
+	if ((hdr.sigalg & SIG_MERKLE) && unpack_merkle_proof(&req->proof,
+				buf + hdr.length, size - hdr.length) == -1)
+		return -1;
+	return hdr.length;
+}
+
+/* unpack the v1 request in $buf, returning the size of the signed part */
+static ssize_t unpack_v1(struct request *req, const unsigned char *buf, size_t size)
+{
+	const unsigned char *p = buf, *end = buf + size;
+
+	if (size < REQUEST_V1_SIZE)
+		return -1;
+	p = decode_v1(req, p);
+	if (req->msg_size < 0 || req->msg_size > MSG_MAXSIZE
+			|| (size_t)(end - p) < req->msg_size + request_ext_size(req))
+		return -1;
+	req->msg = req->msg_size > 0 ? (unsigned char *)p : NULL;
+	p = unpack_request_ext(req, (unsigned char *)p + req->msg_size);
+	req->version = 1;
+	req->keyid = 0;
+	req->sigalg = SIG_LEGACY;
+	return p - buf;
+}
+
+ssize_t unpack_request(struct request *req, unsigned char *buf, size_t size)
+{
+	const unsigned char *p = buf;
+	ssize_t signedsize;
+	size_t sigoff;
+	uint16_t sigsize;
 
-	buf = unpack_int16(buf, &sigsize);
-	sig->sigsize = sigsize;
-	memcpy(sig->sig, buf, sigsize);
+	req->proof = (struct merkle_proof){ 0 };
+	/*
+	 * v1 requests start with a 64 bit timestamp in seconds, whose top bytes
+	 * stay zero for a few million years, so they never look like the magic.
+	 */
+	if (size >= sizeof(uint16_t) && get_u16(&p) == PROTO_MAGIC)
+		signedsize = unpack_v2(req, buf, size);
+	else
+		signedsize = unpack_v1(req, buf, size);
+	if (signedsize == -1)
+		return -1;
+
+	/* the signature follows the signed part and the proof, if any */
+	sigoff = signedsize + req->proof.size;
+	p = buf + sigoff;
+	if (size - sigoff < sizeof(sigsize))
+		return -1;
+	sigsize = get_u16(&p);
+	if (sigsize > sizeof(req->sig.sig) || size - sigoff - sizeof(sigsize) < sigsize)
+		return -1;
+	unpack_signature(&req->sig, buf + sigoff);
+	return signedsize;
+}
+
+size_t pack_batch(struct request *cmds, int n, unsigned char *buf, size_t size)
+{
+	unsigned char *p = buf;
+
+	for (int i = 0; i < n; ++i) {
+		cmds[i].msg_size = cmds[i].msg_size > 0 ? MIN(cmds[i].msg_size, MSG_MAXSIZE) : 0;
+		if ((size_t)(buf + size - p) < BATCH_CMD_SIZE + cmds[i].msg_size)
+			return 0;
+		p = encode_batch_cmd(&cmds[i], p);
+		memcpy(p, cmds[i].msg, cmds[i].msg_size);
+		p += cmds[i].msg_size;
+	}
+	return p - buf;
+}
+
+int unpack_batch(const struct request *batch, struct request *cmds, int max)
+{
+	const unsigned char *p = batch->msg, *end = p + batch->msg_size;
+	uint16_t type;
+	int n;
+
+	if (batch->version < 2 || (batch->req_type & ~REQ_FLAG_BITS) != REQ_BATCH)
+		return -1;
+	for (n = 0; p < end; ++n) {
+		if (n == max || end - p < BATCH_CMD_SIZE)
+			return -1;
+		cmds[n] = *batch;
+		p = decode_batch_cmd(&cmds[n], p);
+		type = cmds[n].req_type & ~REQ_FLAG_BITS;
+		if (type < REQ_POW_SHUTDOWN || type > REQ_QUERY || cmds[n].msg_size < 0
+				|| cmds[n].msg_size > MSG_MAXSIZE || end - p < cmds[n].msg_size)
+			return -1;
+		cmds[n].msg = cmds[n].msg_size > 0 ? (unsigned char *)p : NULL;
+		p += cmds[n].msg_size;
+	}
+	return n > 0 ? n : -1;
+}
+
+int merkle_proof_hashes(uint32_t index, uint32_t count)
+{
+	int n = 0;
+
+	/* the last node of a level without a sibling moves up as it is */
+	for (; count > 1; index >>= 1, count = (count + 1) / 2)
+		if ((index ^ 1) < count)
+			++n;
+	return n;
+}
+
+size_t pack_merkle_proof(const struct merkle_proof *proof, unsigned char *buf, size_t size)
+{
+	size_t packed = MERKLE_PROOF_FIXED_SIZE
+		+ merkle_proof_hashes(proof->index, proof->count) * MERKLE_HASH_SIZE;
+	unsigned char *p;
+
+	if (size < packed)
+		return 0;
+	p = encode_merkle_proof(proof, buf);
+	memcpy(p, proof->hashes, packed - MERKLE_PROOF_FIXED_SIZE);
+	return packed;
+}
+
+unsigned char *unpack_request_ext(struct request *req, unsigned char *buf)
+{
+	const unsigned char *p = buf;
+
+	if (GET_ABSTIME_BIT(req->req_type)) {
+		req->deadline = get_u64(&p);
+		req->sent = get_u64(&p);
+	}
+	return (unsigned char *)p;
 }
 
 /*
@@ -178,39 +425,59 @@ void unpack_signature(struct signature *sig, unsigned char *buf)
  */
 unsigned char *unpack_request_fixed(struct request *req, unsigned char *reqbuf)
 {
-	/* unpack_* returns the next address in the buffer after unpacking */
-	reqbuf = unpack_int64(reqbuf, &req->when);
-	reqbuf = unpack_int32(reqbuf, &req->timer);
-	reqbuf = unpack_int16(reqbuf, &req->req_type);
-	reqbuf = unpack_int16(reqbuf, &req->msg_size);
-	return reqbuf;
+	return (unsigned char *)decode_v1(req, reqbuf);
 }
 
-/*
- * struct sstate contains the following fields:
- * 	int64_t		when;
- * 	int32_t		timer;
- * 	uint16_t	powcmd;
- */
-void pack_sstate(struct sstate *res, char resbuf[], size_t size)
+size_t pack_sstate(struct sstate *res, char resbuf[], size_t size)
+{
+	struct sstate r = *res;
+	unsigned char *p = (unsigned char *)resbuf;
+
+	r.npending = MIN(res->npending, SSTATE_MAX_PENDING);
+	if (size < sstate_struct_size(r.npending))
+		return 0;
+	p = encode_sstate(&r, p);
+	for (int i = 0; i < r.npending; ++i)
+		p = encode_sstate_entry(&r.pending[i], p);
+	return sstate_struct_size(r.npending);
+}
+
+int unpack_sstate(struct sstate *res, char resbuf[], size_t size)
 {
-	size_t s = sstate_struct_size();
-	if (size < s)
-		return;
-	resbuf = pack_int64(resbuf, res->when);
-	resbuf = pack_int64(resbuf, res->issued_at);
-	resbuf = pack_int32(resbuf, res->timer);
-	resbuf = pack_int16(resbuf, res->powcmd);
-	resbuf = pack_int16(resbuf, res->ack);
+	const unsigned char *p = (unsigned char *)resbuf;
+
+	if (size < sstate_struct_size(0))
+		return -1;
+	p = decode_sstate(res, p);
+	if (res->npending > SSTATE_MAX_PENDING || size < sstate_struct_size(res->npending))
+		return -1;
+	for (int i = 0; i < res->npending; ++i)
+		p = decode_sstate_entry(&res->pending[i], p);
+	return 0;
 }
 
-void unpack_sstate(struct sstate *res, char resbuf[])
+size_t pack_session_reply(const struct session_reply *reply, unsigned char *buf, size_t size)
 {
-	resbuf = unpack_int64(resbuf, &res->when);
-	resbuf = unpack_int64(resbuf, &res->issued_at);
-	resbuf = unpack_int32(resbuf, &res->timer);
-	resbuf = unpack_int16(resbuf, &res->powcmd);
-	resbuf = unpack_int16(resbuf, &res->ack);
+	unsigned char *p;
+
+	if (size < SESSION_REPLY_SIZE)
+		return 0;
+	p = encode_session_reply(reply, buf);
+	memcpy(p, reply->pub, sizeof(reply->pub));
+	return SESSION_REPLY_SIZE;
+}
+
+int unpack_session_reply(struct session_reply *reply, const unsigned char *buf, size_t size)
+{
+	const unsigned char *p;
+
+	if (size != SESSION_REPLY_SIZE)
+		return -1;
+	p = decode_session_reply(reply, buf);
+	if (reply->magic != PROTO_MAGIC)
+		return -1;
+	memcpy(reply->pub, p, sizeof(reply->pub));
+	return 0;
 }
 
 int parse_request(uint16_t *reqtype, char *reqstr)
@@ -231,8 +498,11 @@ int parse_request(uint16_t *reqtype, char *reqstr)
 		*reqtype = REQ_NOTIFY;
 	else if (!strcasecmp("QUERY", reqstr))
 		*reqtype = REQ_QUERY;
+	else if (!strcasecmp("SESSION", reqstr))
+		*reqtype = REQ_SESSION;
 	else
 		return -1;
+	return 0;
 }
 
 char *reqstr(uint16_t reqtype, char *str, size_t size)
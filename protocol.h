@@ -2,6 +2,7 @@
 #define	LSDPROTO_H 1
 
 #include <stdint.h>
+#include <sys/types.h>
 
 /* signature structure */
 struct signature {
@@ -9,6 +10,14 @@ struct signature {
 	unsigned char	sig[192];
 };
 
+/* where a request is in a Merkle tree of requests signed together */
+struct merkle_proof {
+	uint32_t	index;		/* of the request among the leaves */
+	uint32_t	count;		/* leaves, 0 if the request is signed alone */
+	uint16_t	size;		/* of the proof on the wire */
+	const unsigned char *hashes;	/* siblings from the leaf up, in the buffer */
+};
+
 /*
  * This structure is used to send the request to the server by the client.
  */
@@ -18,15 +27,157 @@ struct request {
 	uint16_t	req_type;	/* request type */
 	int16_t		msg_size;
 	unsigned char	*msg;		/* optional nul-terminated string */
+	/* always sent by v2, by v1 only with the abstime bit set */
+	int64_t		deadline;	/* wall clock time to act, in milliseconds */
+	int64_t		sent;		/* wall clock time the client sent it, in ms */
+	/* v2 only, for replay protection */
+	uint64_t	client_id;
+	uint64_t	seq;		/* increasing with every request of client_id */
+	uint64_t	keyid;		/* v2 with SIG_KEYID, else 0 for the default key */
+	uint8_t		version;	/* wire format, 0 or 1 for v1 */
+	uint8_t		sigalg;		/* SIG_*, always SIG_LEGACY for v1 */
+	struct merkle_proof proof;	/* with SIG_MERKLE, see merkle.h */
 	struct signature sig;
 };
 
+/* a scheduled power command */
+struct sstate_entry {
+	uint32_t	id;		/* to abort this command alone */
+	uint16_t	powcmd;
+	int64_t		due;		/* wall clock time in milliseconds */
+};
+
+#define SSTATE_MAX_PENDING	16	/* entries listed in a sstate */
+
+/*
+ * Wire format. All integers are in network byte order, and each table lists
+ * the fields of a part of a message in the order they are sent, along with
+ * their size (u8, u16, u32 or u64). Encoders and decoders are generated from
+ * the tables.
+ *
+ * v1 request: REQUEST_V1_FIELDS, msg, deadline and sent (only with the
+ *             abstime bit), signature
+ * v2 request: REQUEST_V2_HEADER, REQUEST_V2_FIELDS, key id (u64, only with
+ *             SIG_KEYID), msg, signature, or with SIG_MERKLE:
+ *             REQUEST_V2_HEADER, REQUEST_V2_FIELDS, key id, msg, proof,
+ *             signature of the Merkle root
+ * proof:      MERKLE_PROOF_FIELDS, a hash for each level of the tree where
+ *             the request has a sibling
+ * batch:      v2 request of type REQ_BATCH whose msg holds its commands, each
+ *             BATCH_CMD_FIELDS and msg
+ * signature:  sigsize (u16), sig, made with the algorithm in the v2 header
+ *             (or SIG_LEGACY for v1); for SIG_HMAC_SHA256 the session id
+ *             (u64) and tag, see session.h
+ * sstate:     SSTATE_FIELDS, npending times SSTATE_ENTRY_FIELDS
+ * session:    SESSION_REPLY_FIELDS, pub, answering a REQ_SESSION request
+ *
+ * v1 requests start with a timestamp instead of the magic, which is how the
+ * server tells them apart; it accepts both.
+ */
+#define PROTO_MAGIC		0x4c53	/* "LS" */
+#define PROTO_VERSION		2
+
+/* signature algorithms */
+#define SIG_LEGACY		0	/* the server key's, DER for ECDSA, any size */
+#define SIG_ECDSA_P256		1	/* r and s, 64 bytes */
+#define SIG_ECDSA_P384		2	/* r and s, 96 bytes */
+#define SIG_ED25519		3	/* 64 bytes */
+#define SIG_HMAC_SHA256		4	/* session id and tag, 40 bytes, no key */
+#define SIG_ALG_MAX		SIG_HMAC_SHA256
+/* or'ed with a key's algorithm, which signed a Merkle root instead */
+#define SIG_MERKLE		0x80
+/* or'ed with a key's algorithm, the id of the key follows the fixed fields */
+#define SIG_KEYID		0x40
+#define SIG_FLAG_BITS		(SIG_MERKLE | SIG_KEYID)
+
+#define REQUEST_V2_HEADER(X) \
+	X(u16, magic) \
+	X(u8, version) \
+	X(u8, sigalg) \
+	X(u16, length)		/* header, fields and msg: the signed part */
+
+#define REQUEST_V1_FIELDS(X) \
+	X(u64, when) \
+	X(u32, timer) \
+	X(u16, req_type) \
+	X(u16, msg_size)
+
+#define REQUEST_V2_FIELDS(X) \
+	REQUEST_V1_FIELDS(X) \
+	X(u64, deadline) \
+	X(u64, sent) \
+	X(u64, client_id) \
+	X(u64, seq)
+
+#define BATCH_CMD_FIELDS(X) \
+	X(u16, req_type) \
+	X(u32, timer) \
+	X(u64, deadline) \
+	X(u16, msg_size)
+
+#define MERKLE_PROOF_FIELDS(X) \
+	X(u32, index) \
+	X(u32, count)
+
+#define MERKLE_HASH_SIZE	32	/* SHA-256 */
+#define MERKLE_MAX_DEPTH	16
+#define MERKLE_MAX_LEAVES	(1 << MERKLE_MAX_DEPTH)
+#define MERKLE_PROOF_MAXSIZE	(8 + MERKLE_MAX_DEPTH * MERKLE_HASH_SIZE)
+
+#define SSTATE_FIELDS(X) \
+	X(u64, when) \
+	X(u64, issued_at) \
+	X(u32, timer) \
+	X(u16, powcmd) \
+	X(u16, ack) \
+	X(u8, failed) \
+	X(u64, skew) \
+	X(u32, fired.id) \
+	X(u16, fired.powcmd) \
+	X(u64, fired.due) \
+	X(u64, fired_at) \
+	X(u16, npending)
+
+#define SSTATE_ENTRY_FIELDS(X) \
+	X(u32, id) \
+	X(u16, powcmd) \
+	X(u64, due)
+
+#define SESSION_REPLY_FIELDS(X) \
+	X(u16, magic)		/* acks never start with it */ \
+	X(u64, id) \
+	X(u32, lifetime)
+
+#define PROTO_u8_SIZE		1
+#define PROTO_u16_SIZE		2
+#define PROTO_u32_SIZE		4
+#define PROTO_u64_SIZE		8
+#define PROTO_FIELD_SIZE(type, name)	+ PROTO_##type##_SIZE
+
+#define REQUEST_V2_HEADER_SIZE	(0 REQUEST_V2_HEADER(PROTO_FIELD_SIZE))
+#define REQUEST_V2_FIXED_SIZE	(REQUEST_V2_HEADER_SIZE REQUEST_V2_FIELDS(PROTO_FIELD_SIZE))
+#define REQUEST_V2_KEYID_SIZE	PROTO_u64_SIZE
+
 struct sstate {
 	int64_t		when;		/* when the power command was scheduled */
 	int64_t		issued_at;
 	int32_t		timer;		/* timer for power command */
 	uint16_t	powcmd;		/* type of scheduled power command */
 	uint16_t	ack;
+	uint8_t		failed;		/* 1 + index of the batch command that failed */
+	int64_t		skew;		/* receive time minus client send time, in ms */
+	struct sstate_entry fired;	/* last command carried out, if id is not 0 */
+	int64_t		fired_at;	/* when it was carried out, wall clock ms */
+	uint16_t	npending;	/* entries in pending[], earliest first */
+	struct sstate_entry pending[SSTATE_MAX_PENDING];
+};
+
+/* answer to a REQ_SESSION request, see session.h */
+struct session_reply {
+	uint16_t	magic;		/* PROTO_MAGIC */
+	uint64_t	id;		/* session id, never 0 */
+	uint32_t	lifetime;	/* in seconds */
+	unsigned char	pub[32];	/* X25519 public key of the server */
 };
 
 /*
@@ -44,34 +195,57 @@ struct sstate {
 #define	REQ_NOTIFY		0x0007
 /* query commands */
 #define	REQ_QUERY		0x0008	/* get shutdown timer on server */
+/* open a session, see session.h */
+#define REQ_SESSION		0x0009
+/* several of the above, applied in order as one request */
+#define REQ_BATCH		0x000a
+#define REQ_MAX			REQ_BATCH
 
 #define SET_FORCE_BIT(reqtype)		((reqtype) = ((1 << 15) | (reqtype)))
 #define RESET_FORCE_BIT(reqtype)	((reqtype) = (~(1 << 15) & (reqtype)))
 #define GET_FORCE_BIT(reqtype)		((reqtype) & (1 << 15))
+/* timer is in milliseconds rather than seconds */
+#define SET_MSEC_BIT(reqtype)		((reqtype) = ((1 << 14) | (reqtype)))
+#define RESET_MSEC_BIT(reqtype)		((reqtype) = (~(1 << 14) & (reqtype)))
+#define GET_MSEC_BIT(reqtype)		((reqtype) & (1 << 14))
+/* request carries an absolute deadline instead of a timer */
+#define SET_ABSTIME_BIT(reqtype)	((reqtype) = ((1 << 13) | (reqtype)))
+#define RESET_ABSTIME_BIT(reqtype)	((reqtype) = (~(1 << 13) & (reqtype)))
+#define GET_ABSTIME_BIT(reqtype)	((reqtype) & (1 << 13))
+/* all of the above, the request type is in the bits below */
+#define REQ_FLAG_BITS			0xe000
 /*
  * server sstates
  */
 #define	ACK_GRANTED		0x0000
 #define	ACK_DENIED		0x0001
 #define ACK_DISABLED		0x0002		/* request is disabled in server config */
+#define ACK_NO_SESSION		0x0003		/* session unknown or expired */
+#define ACK_REPLAYED		0x0004		/* seen before, the first copy was granted */
 
 #define MSG_MAXSIZE		128
+#define BATCH_MAX		8	/* commands in a batch */
+#define BATCH_MAXSIZE		1024	/* commands of a batch, in place of msg */
 
 /* parse_request:	Store request code in *$reqtype */
 int parse_request(uint16_t *reqtype, char *reqstr);
 
 /*
  * pack_request:
- * 	Pack request structure into a character array and return a pointer to it.
- * 	The character array is dynamically allocated and has to be freed by the caller.
- * 	$size  is set to the size of the array.
+ * 	Pack request structure into the $size bytes at $buf in wire format
+ * 	$req->version, after limiting $req->msg_size to MSG_MAXSIZE (or
+ * 	BATCH_MAXSIZE for a batch). $buf should
+ * 	have room for REQUEST_MAX_SIZE bytes to leave room for the signature.
+ * 	Returns the size of the packed request, or 0 if it does not fit.
  */
-unsigned char *pack_request(struct request *req, size_t *size);
+size_t pack_request(struct request *req, unsigned char *buf, size_t size);
 
 /*
  * sign_request:
- * 	Sign request packed into $buf using $keyfile as private key, and store the
- * 	signature in $size. Update $sigsize to the size of the signature.
+ * 	Sign request packed into $buf using $keyfile as private key, with the
+ * 	algorithm named in its header (SIG_LEGACY for v1), and append
+ * 	the signature to it. Update $bufsize to include the signature and $sigsize
+ * 	to the size of the signature.
  */
 unsigned char *sign_request(unsigned char *buf, size_t *bufsize, size_t *sigsize,
 		const char *keyfile);
@@ -82,28 +256,111 @@ unsigned char *sign_request(unsigned char *buf, size_t *bufsize, size_t *sigsize
  */
 void unpack_signature(struct signature *sig, unsigned char *buf);
 
+/*
+ * unpack_request:
+ * 	Unpack the $size byte request in $buf into $req, in place, whichever its
+ * 	wire format (stored in req->version) is: req->msg points
+ * 	into $buf and is not nul-terminated, so it is only valid as long as $buf
+ * 	is. Nothing is read past the end of $buf.
+ * 	The proof of a request signed with a Merkle root is unpacked into
+ * 	req->proof, hashes pointing into $buf as well.
+ * 	Returns the size of the signed part of the request, or -1 if it is
+ * 	malformed or truncated.
+ */
+ssize_t unpack_request(struct request *req, unsigned char *buf, size_t size);
+
+/*
+ * pack_batch:
+ * 	Pack the $n commands in $cmds (request type, timer, deadline and
+ * 	message) into the $size bytes at $buf, to be sent as the message of a
+ * 	REQ_BATCH request. Returns the size of the packed commands, or 0 if
+ * 	they do not fit.
+ */
+size_t pack_batch(struct request *cmds, int n, unsigned char *buf, size_t size);
+
+/*
+ * unpack_batch:
+ * 	Unpack the commands of v2 REQ_BATCH request $batch into the $max
+ * 	entries of $cmds, each getting the other fields of $batch. Messages
+ * 	point into the one of $batch. Batches may not hold batches, session
+ * 	requests or unknown request types.
+ * 	Returns the number of commands, or -1 if the batch is malformed, empty
+ * 	or holds more than $max of them.
+ */
+int unpack_batch(const struct request *batch, struct request *cmds, int max);
+
+/*
+ * merkle_proof_hashes:
+ * 	Number of hashes in the proof of leaf $index of a tree of $count
+ * 	leaves, one per level where its node has a sibling.
+ */
+int merkle_proof_hashes(uint32_t index, uint32_t count);
+
+/*
+ * pack_merkle_proof:
+ * 	Pack $proof, MERKLE_PROOF_FIELDS followed by its hashes, into the $size
+ * 	bytes at $buf. Returns the size of the packed proof, or 0 if it does
+ * 	not fit.
+ */
+size_t pack_merkle_proof(const struct merkle_proof *proof, unsigned char *buf, size_t size);
+
+/*
+ * unpack_request_ext:
+ * 	Unpack the fields following the message of a v1 request in $buf, which are only present
+ * 	for some request types, into $req. Returns a pointer past them, i.e to
+ * 	the signature.
+ */
+unsigned char *unpack_request_ext(struct request *req, unsigned char *buf);
+
+/*
+ * request_ext_size:
+ * 	Return the size of the fields following the message in v1 request $req
+ */
+size_t request_ext_size(struct request *req);
+
 /*
  * unpack_request_fixed:
- * 	Unpack fixed part of request structure from character array into the given struct.
+ * 	Unpack fixed part of v1 request structure from character array into the given struct.
  *	NOTE: reqbuf does not include the message buffer. It has to be read from the
  *	connection based on the msg_size field.
  */
 unsigned char *unpack_request_fixed(struct request *req, unsigned char *reqbuf);
 
+/*
+ * request_timer_ms:
+ * 	Return the timer of $req in milliseconds, whichever unit it was sent in,
+ * 	or the time left until its deadline if it has one.
+ */
+int64_t request_timer_ms(struct request *req);
+
 /*
  * pack_sstate:
- * 	Pack sstate structure into character array. Since the sstate structure
- * 	contains only fixed size members, the required size of the buffer is known
- * 	and is the sum of the members. If $size is less than this value, resbuf is
- * 	untouched.
+ * 	Pack sstate structure into character array, followed by its npending
+ * 	entries. SSTATE_SIZE is enough for any sstate. Returns the number of bytes
+ * 	packed, or 0 if $size is too small, in which case resbuf is untouched.
  */
-void pack_sstate(struct sstate *res, char resbuf[], size_t size);
+size_t pack_sstate(struct sstate *res, char resbuf[], size_t size);
 
 /*
  * unpack_sstate:
- *	Unpack sstate structure from character array into the given struct.
+ *	Unpack sstate structure from the $size bytes in $resbuf into the given
+ *	struct. Returns -1 if the buffer is truncated and 0 on success.
+ */
+int unpack_sstate(struct sstate *res, char *resbuf, size_t size);
+
+/*
+ * pack_session_reply:
+ * 	Pack $reply into the $size bytes at $buf. Returns the number of bytes
+ * 	packed, or 0 if $size is less than SESSION_REPLY_SIZE.
+ */
+size_t pack_session_reply(const struct session_reply *reply, unsigned char *buf, size_t size);
+
+/*
+ * unpack_session_reply:
+ * 	Unpack the session reply in the $size bytes at $buf into $reply.
+ * 	Returns -1 if it is not one, and 0 on success.
  */
-void unpack_sstate(struct sstate *res, char *resbuf);
+int unpack_session_reply(struct session_reply *reply, const unsigned char *buf, size_t size);
 
 /*
  * request_struct_fixedsize:
@@ -120,11 +377,18 @@ char *reqstr(uint16_t reqtype, char *str, size_t size);
 
 /*
  * sstate_struct_size:
- * 	Return size of sstate struct
+ * 	Return the packed size of a sstate struct listing $npending entries
  */
-size_t sstate_struct_size(void);
+size_t sstate_struct_size(uint16_t npending);
 
-#define	SSTATE_SIZE		sstate_struct_size()
+#define	SSTATE_SIZE		((0 SSTATE_FIELDS(PROTO_FIELD_SIZE)) \
+					+ SSTATE_MAX_PENDING * (0 SSTATE_ENTRY_FIELDS(PROTO_FIELD_SIZE)))
+#define SESSION_REPLY_SIZE	((0 SESSION_REPLY_FIELDS(PROTO_FIELD_SIZE)) \
+					+ sizeof(((struct session_reply *)0)->pub))
 #define REQUEST_FIXED_SIZE	request_struct_fixedsize()
+/* largest request on the wire, of either version */
+#define REQUEST_MAX_SIZE	(REQUEST_V2_FIXED_SIZE + REQUEST_V2_KEYID_SIZE + BATCH_MAXSIZE \
+					+ MERKLE_PROOF_MAXSIZE \
+					+ sizeof(struct signature))
 
 #endif	/* ifndef LSDPROTO_H */
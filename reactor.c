@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/pidfd.h>
+
+#include "common.h"
+#include "reactor.h"
+
+#define MAX_EVENTS	64
+
+struct reactor_handler {
+	int		fd;
+	reactor_cb	cb;
+	void		*arg;
+	/* only for child watches */
+	pid_t		pid;
+	reactor_child_cb child_cb;
+	void		*child_arg;
+	/* removed handlers are freed once the current batch of events is done */
+	bool		dead;
+	struct reactor_handler *next_dead;
+};
+
+static int epfd = -1;
+static volatile bool running;
+static struct reactor_handler *dead_handlers;
+static pthread_mutex_t dead_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int reactor_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+	return 0;
+}
+
+/* register a fully set up handler, freeing it on error */
+static struct reactor_handler *handler_add(struct reactor_handler *h, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, h->fd, &ev) == -1) {
+		perror("epoll_ctl: add");
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+struct reactor_handler *reactor_add(int fd, uint32_t events, reactor_cb cb, void *arg)
+{
+	struct reactor_handler *h;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL)
+		return NULL;
+	h->fd = fd;
+	h->cb = cb;
+	h->arg = arg;
+	return handler_add(h, events);
+}
+
+void reactor_del(struct reactor_handler *h)
+{
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL) == -1)
+		perror("epoll_ctl: del");
+	/* an event for $h may still be pending in the batch being dispatched */
+	pthread_mutex_lock(&dead_lock);
+	h->dead = true;
+	h->next_dead = dead_handlers;
+	dead_handlers = h;
+	pthread_mutex_unlock(&dead_lock);
+}
+
+static void free_dead_handlers(void)
+{
+	struct reactor_handler *h, *next;
+
+	pthread_mutex_lock(&dead_lock);
+	h = dead_handlers;
+	dead_handlers = NULL;
+	pthread_mutex_unlock(&dead_lock);
+	for (; h != NULL; h = next) {
+		next = h->next_dead;
+		free(h);
+	}
+}
+
+/* pidfd became readable: the child has exited */
+static void child_exited(int pidfd, uint32_t events, void *arg)
+{
+	struct reactor_handler *h = arg;
+	siginfo_t info = { 0 };
+	int status = 0;
+
+	if (waitid(P_PIDFD, pidfd, &info, WEXITED | WNOHANG) == -1) {
+		perror("waitid");
+	} else {
+		/* turn the siginfo back into a wait status for WIFEXITED() & co */
+		if (info.si_code == CLD_EXITED)
+			status = (info.si_status & 0xff) << 8;
+		else
+			status = info.si_status & 0x7f;
+	}
+	PDEBUG("[-] child %d exited with status %x\n", h->pid, status);
+	if (h->child_cb)
+		h->child_cb(h->pid, status, h->child_arg);
+	reactor_del(h);
+	close(pidfd);
+}
+
+int reactor_watch_child(pid_t pid, reactor_child_cb cb, void *arg)
+{
+	struct reactor_handler *h;
+	int pidfd;
+
+	if ((pidfd = pidfd_open(pid, 0)) == -1) {
+		perror("pidfd_open");
+		return -1;
+	}
+	if ((h = calloc(1, sizeof(*h))) == NULL) {
+		close(pidfd);
+		return -1;
+	}
+	/* the handler is its own callback argument, the user's is kept inside */
+	h->fd = pidfd;
+	h->cb = child_exited;
+	h->arg = h;
+	h->pid = pid;
+	h->child_cb = cb;
+	h->child_arg = arg;
+	if (handler_add(h, EPOLLIN) == NULL) {
+		close(pidfd);
+		return -1;
+	}
+	return 0;
+}
+
+int reactor_run(void)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct reactor_handler *h;
+	int n;
+
+	running = true;
+	while (running) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+		for (int i = 0; i < n && running; ++i) {
+			h = events[i].data.ptr;
+			if (!h->dead)
+				h->cb(h->fd, events[i].events, h->arg);
+		}
+		free_dead_handlers();
+	}
+	return 0;
+}
+
+void reactor_stop(void)
+{
+	running = false;
+}
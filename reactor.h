@@ -0,0 +1,55 @@
+#ifndef REACTOR_H
+#define REACTOR_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+/*
+ * Event loop of the server's main thread. Everything the main thread waits
+ * for (sockets, timers, signals, helper processes) is a file descriptor
+ * registered here, and the only place it sleeps is epoll_wait().
+ */
+
+struct reactor_handler;
+
+typedef void (*reactor_cb)(int fd, uint32_t events, void *arg);
+typedef void (*reactor_child_cb)(pid_t pid, int status, void *arg);
+
+/* reactor_init:	Create the epoll instance. Returns -1 on error, 0 on success */
+int reactor_init(void);
+
+/*
+ * reactor_add:
+ * 	Call $cb(fd, events, $arg) from the event loop whenever $fd is ready for
+ * 	$events (EPOLLIN, ...). The fd should be non-blocking.
+ * 	Returns the handler, to be passed to reactor_del(), or NULL on error.
+ */
+struct reactor_handler *reactor_add(int fd, uint32_t events, reactor_cb cb, void *arg);
+
+/*
+ * reactor_del:
+ * 	Stop watching the fd of $h and free $h once the events already fetched
+ * 	have been dispatched, so it is safe to remove any handler from inside a
+ * 	callback or from another thread. The fd is not closed.
+ */
+void reactor_del(struct reactor_handler *h);
+
+/*
+ * reactor_watch_child:
+ * 	Watch child process $pid through a pidfd, reap it once it exits and call
+ * 	$cb(pid, status, $arg) with its wait status. Safe to call from any
+ * 	thread. Returns -1 on error and 0 on success.
+ */
+int reactor_watch_child(pid_t pid, reactor_child_cb cb, void *arg);
+
+/*
+ * reactor_run:
+ * 	Dispatch events until reactor_stop() is called.
+ * 	Returns -1 if epoll_wait() fails and 0 otherwise.
+ */
+int reactor_run(void);
+
+void reactor_stop(void);
+
+#endif /* ifndef REACTOR_H */
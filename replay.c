@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+
+#include "common.h"
+#include "replay.h"
+
+#define WORD_BITS	64
+/* one word more than the window, so advancing never clears a bit in it */
+#define WINDOW_WORDS	(REPLAY_WINDOW / WORD_BITS + 1)
+
+_Static_assert((REPLAY_SLOTS & (REPLAY_SLOTS - 1)) == 0, "REPLAY_SLOTS must be a power of two");
+_Static_assert(REPLAY_WINDOW % WORD_BITS == 0, "REPLAY_WINDOW must be a multiple of 64");
+
+struct client {
+	uint64_t	key;		/* id of the key the client signs with */
+	uint64_t	id;
+	uint64_t	top;		/* highest sequence number seen */
+	int64_t		last_seen;	/* 0 if the slot was never used */
+	/* ring of bits, bit seq % (64 * WINDOW_WORDS) set if seq was seen */
+	uint64_t	window[WINDOW_WORDS];
+	uint64_t	granted[WINDOW_WORDS];	/* and if it was granted */
+};
+
+/*
+ * Open addressing with linear probing. A client whose last request is older
+ * than twice the freshness window can be forgotten: any request it sent back
+ * then is stale by now. Its slot stays in probe chains, so that clients
+ * further along are still found, but may be taken over by a new client.
+ */
+static struct client clients[REPLAY_SLOTS];
+
+static bool expired(struct client *c, int64_t now)
+{
+	return now - c->last_seen > 2 * REPLAY_FRESH_MS;
+}
+
+static uint64_t hash_id(uint64_t x)
+{
+	/* splitmix64 finalizer: client ids may be anything, spread them out */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/*
+ * find client $id of key $key, or if $add a free slot for it; NULL if there
+ * is none
+ */
+static struct client *lookup(uint64_t key, uint64_t id, int64_t now, bool add)
+{
+	struct client *c, *reuse = NULL;
+	uint64_t i = hash_id(id ^ key);
+
+	for (int n = 0; n < REPLAY_SLOTS; ++n, ++i) {
+		c = &clients[i & (REPLAY_SLOTS - 1)];
+		if (c->last_seen == 0)
+			break;		/* end of the chain: not tracked */
+		if (c->id == id && c->key == key && !expired(c, now))
+			return c;
+		if (!reuse && expired(c, now))
+			reuse = c;
+	}
+	if (!add)
+		return NULL;
+	if (!reuse && c->last_seen != 0)
+		return NULL;	/* every slot live */
+	c = reuse ? reuse : c;
+	c->key = key;
+	c->id = id;
+	c->last_seen = 0;
+	return c;
+}
+
+int replay_check(uint64_t keyid, uint64_t client_id, uint64_t seq, int64_t sent_ms,
+		int64_t now_ms)
+{
+	struct client *c;
+	uint64_t word, bit, cur, diff, k;
+
+	if (sent_ms < now_ms - REPLAY_FRESH_MS || sent_ms > now_ms + REPLAY_FRESH_MS)
+		return REPLAY_STALE;
+	if ((c = lookup(keyid, client_id, now_ms, true)) == NULL)
+		return REPLAY_FULL;
+
+	word = seq / WORD_BITS;
+	bit = seq % WORD_BITS;
+	if (c->last_seen == 0) {
+		/* new client: whatever it sends first starts its window */
+		for (int i = 0; i < WINDOW_WORDS; ++i)
+			c->window[i] = c->granted[i] = 0;
+		c->top = seq;
+	} else if (seq > c->top) {
+		/* slide the window, clearing the words it moves over */
+		cur = c->top / WORD_BITS;
+		diff = MIN(word - cur, WINDOW_WORDS);
+		for (uint64_t i = 1; i <= diff; ++i) {
+			k = (cur + i) % WINDOW_WORDS;
+			c->window[k] = c->granted[k] = 0;
+		}
+		c->top = seq;
+	} else if (c->top - seq >= REPLAY_WINDOW) {
+		return REPLAY_OLD;	/* fell out of the window, cannot tell */
+	}
+	if (c->window[word % WINDOW_WORDS] & (1ULL << bit))
+		return c->granted[word % WINDOW_WORDS] & (1ULL << bit) ? REPLAY_DUP
+			: REPLAY_REFUSED;
+	c->window[word % WINDOW_WORDS] |= 1ULL << bit;
+	c->last_seen = now_ms;
+	return REPLAY_OK;
+}
+
+void replay_grant(uint64_t keyid, uint64_t client_id, uint64_t seq, int64_t now_ms)
+{
+	struct client *c = lookup(keyid, client_id, now_ms, false);
+
+	/* checked just before, so tracked and in the window */
+	if (c == NULL || c->top - seq >= REPLAY_WINDOW)
+		return;
+	c->granted[seq / WORD_BITS % WINDOW_WORDS] |= 1ULL << seq % WORD_BITS;
+}
+
+void replay_reset(void)
+{
+	memset(clients, 0, sizeof(clients));
+}
+
+int replay_next_seq(const char *path, uint64_t *seq)
+{
+	char buf[32];
+	struct timespec ts;
+	ssize_t n;
+	int fd, ret = -1;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+		return -1;
+	/* held until the number taken is written back */
+	if (flock(fd, LOCK_EX) == -1)
+		goto out;
+	if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) == -1)
+		goto out;
+	buf[n] = '\0';
+	if (sscanf(buf, "%" SCNu64, seq) == 1) {
+		++*seq;
+	} else {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		*seq = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+	n = snprintf(buf, sizeof(buf), "%" PRIu64 "\n", *seq);
+	if (pwrite(fd, buf, n, 0) == n && ftruncate(fd, n) == 0)
+		ret = 0;
+out:
+	close(fd);
+	return ret;
+}
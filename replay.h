@@ -0,0 +1,63 @@
+#ifndef REPLAY_H
+#define REPLAY_H 1
+
+#include <stdint.h>
+
+/*
+ * Replay protection for v2 requests. Every client (client_id, under the key
+ * it signs with, so holders of different keys cannot use up each other's
+ * sequence numbers) numbers its requests with an increasing 64 bit sequence
+ * number; a window of the last REPLAY_WINDOW numbers seen from each client
+ * tells replays from requests that are merely reordered. Requests sent more
+ * than REPLAY_FRESH_MS away from the server's wall clock are rejected
+ * outright, which is what allows clients not heard from for a while to be
+ * forgotten. The window also tells which requests were granted, so that a
+ * copy is only answered as such if its first copy was carried out.
+ */
+
+#define REPLAY_SLOTS		4096	/* clients tracked at once, a power of two */
+#define REPLAY_WINDOW		960	/* sequence numbers below the highest one seen */
+#define REPLAY_FRESH_MS		60000	/* accepted distance of send time from ours */
+
+/* return values of replay_check() */
+#define REPLAY_OK	0
+#define REPLAY_STALE	-1	/* send time outside the freshness window */
+#define REPLAY_DUP	-2	/* seen before, and granted then */
+#define REPLAY_FULL	-3	/* no room to track another client */
+#define REPLAY_OLD	-4	/* too old for the window, cannot tell */
+#define REPLAY_REFUSED	-5	/* seen before, and not granted then */
+
+/*
+ * replay_check:
+ * 	Check request $seq of client $client_id of key $keyid (0 for the
+ * 	default key), sent at wall clock time $sent_ms, against the requests
+ * 	seen so far at wall clock time $now_ms, and record it if it is new.
+ * 	Not thread safe.
+ * 	Returns REPLAY_OK if the request is new, else why it is not.
+ */
+int replay_check(uint64_t keyid, uint64_t client_id, uint64_t seq, int64_t sent_ms,
+		int64_t now_ms);
+
+/*
+ * replay_grant:
+ * 	Record that request $seq of client $client_id of key $keyid, found
+ * 	new by replay_check() at $now_ms, was granted. Not thread safe.
+ */
+void replay_grant(uint64_t keyid, uint64_t client_id, uint64_t seq, int64_t now_ms);
+
+/* replay_reset:	Forget every client, so tests start from a clean table */
+void replay_reset(void);
+
+/*
+ * replay_next_seq:
+ * 	Take the next sequence number from the counter kept in file $path,
+ * 	created if missing, into *$seq. Senders sharing the file number their
+ * 	requests one after another, however close together they send and
+ * 	whatever the wall clock does, so a request overtaken by a later one
+ * 	is still inside the window. A new counter starts from the wall clock
+ * 	in microseconds, above whatever a counter before it handed out.
+ * 	Returns -1 on error and 0 on success.
+ */
+int replay_next_seq(const char *path, uint64_t *seq);
+
+#endif /* ifndef REPLAY_H */
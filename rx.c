@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "stats.h"
+#include "rx.h"
+
+int rxbatch_init(struct rxbatch *batch, unsigned int size)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->slots = calloc(size, sizeof(*batch->slots));
+	batch->bufs = malloc((size_t)size * RXBUF_SIZE);
+	batch->msgs = calloc(size, sizeof(*batch->msgs));
+	batch->iovs = calloc(size, sizeof(*batch->iovs));
+	batch->ctrls = malloc((size_t)size * RXCTRL_SIZE);
+	if (!batch->slots || !batch->bufs || !batch->msgs || !batch->iovs || !batch->ctrls) {
+		rxbatch_free(batch);
+		return -1;
+	}
+	batch->size = size;
+
+	for (unsigned int i = 0; i < size; ++i) {
+		batch->slots[i].buf = batch->bufs + (size_t)i * RXBUF_SIZE;
+		batch->iovs[i].iov_base = batch->slots[i].buf;
+		batch->iovs[i].iov_len = RXBUF_SIZE;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->slots[i].addr;
+		batch->msgs[i].msg_hdr.msg_control = batch->ctrls + (size_t)i * RXCTRL_SIZE;
+	}
+	return 0;
+}
+
+void rxbatch_free(struct rxbatch *batch)
+{
+	free(batch->slots);
+	free(batch->bufs);
+	free(batch->msgs);
+	free(batch->iovs);
+	free(batch->ctrls);
+	memset(batch, 0, sizeof(*batch));
+}
+
+int64_t rx_stamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int rx_want_dst(int sockfd)
+{
+	int on = 1;
+
+	return setsockopt(sockfd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+}
+
+uint32_t rx_dst(const struct msghdr *msg)
+{
+	struct in_pktinfo info;
+
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR((struct msghdr *)msg, c)) {
+		if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+			memcpy(&info, CMSG_DATA(c), sizeof(info));
+			return info.ipi_addr.s_addr;
+		}
+	}
+	return 0;
+}
+
+int rxbatch_recv(struct rxbatch *batch, int sockfd)
+{
+	int64_t stamp;
+	int n;
+
+	/* msg_namelen and msg_controllen are overwritten on every receive */
+	for (unsigned int i = 0; i < batch->size; ++i) {
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->slots[i].addr);
+		batch->msgs[i].msg_hdr.msg_controllen = RXCTRL_SIZE;
+	}
+
+	batch->count = 0;
+	/* MSG_WAITFORONE: block for the first datagram, then take what is queued */
+	n = recvmmsg(sockfd, batch->msgs, batch->size, MSG_WAITFORONE, NULL);
+	STATS_INC(rx_syscalls);
+	if (n < 0)
+		return -1;
+
+	/* one clock read for the batch, it was queued by the time it returns */
+	stamp = rx_stamp();
+	for (int i = 0; i < n; ++i) {
+		batch->slots[i].stamp = stamp;
+		batch->slots[i].len = batch->msgs[i].msg_len;
+		batch->slots[i].addrlen = batch->msgs[i].msg_hdr.msg_namelen;
+		batch->slots[i].sockfd = sockfd;
+		batch->slots[i].dst = rx_dst(&batch->msgs[i].msg_hdr);
+	}
+	STATS_ADD(rx_datagrams, n);
+	batch->count = n;
+	return n;
+}
@@ -0,0 +1,72 @@
+#ifndef RX_H
+#define RX_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define RXBUF_SIZE	2048
+#define RXBATCH_MAX	1024	/* recvmmsg() limit on messages per call */
+/* room for the control message carrying the destination address */
+#define RXCTRL_SIZE	CMSG_SPACE(sizeof(struct in_pktinfo))
+
+/* one received datagram along with where it came from */
+struct rxslot {
+	unsigned char		*buf;		/* RXBUF_SIZE bytes of room */
+	size_t			len;
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	int			sockfd;		/* socket it arrived on */
+	uint32_t		dst;		/* IPv4 address it was sent to, 0 if unknown */
+	int64_t			stamp;		/* wall clock receive time, in ms */
+	uint64_t		dedupe;		/* see dedupe_check(), 0 if unset */
+};
+
+/*
+ * Set of receive slots filled by a single recvmmsg() call. The slots and the
+ * message headers pointing into them are allocated once by rxbatch_init().
+ */
+struct rxbatch {
+	struct rxslot	*slots;
+	unsigned char	*bufs;		/* backing storage of the slots */
+	unsigned char	*ctrls;		/* RXCTRL_SIZE bytes for each slot */
+	struct mmsghdr	*msgs;
+	struct iovec	*iovs;
+	unsigned int	size;		/* number of slots */
+	unsigned int	count;		/* slots filled by last rxbatch_recv() */
+};
+
+/*
+ * rxbatch_init:
+ * 	Allocate $size receive slots in $batch and set up the message headers.
+ * 	Returns -1 on error and 0 on success.
+ */
+int rxbatch_init(struct rxbatch *batch, unsigned int size);
+
+void rxbatch_free(struct rxbatch *batch);
+
+/* rx_stamp:	Return the wall clock time in milliseconds, for rxslot.stamp */
+int64_t rx_stamp(void);
+
+/*
+ * rx_want_dst:
+ * 	Have the destination address of every datagram received on $sockfd
+ * 	passed along with it, for rxslot.dst. Returns -1 on error and 0 on
+ * 	success.
+ */
+int rx_want_dst(int sockfd);
+
+/* rx_dst:	Return the destination address passed along with $msg, for rxslot.dst */
+uint32_t rx_dst(const struct msghdr *msg);
+
+/*
+ * rxbatch_recv:
+ * 	Block until at least one datagram is available on $sockfd, then receive
+ * 	up to batch->size datagrams in one syscall. Returns the number of slots
+ * 	filled (also stored in batch->count), or -1 on error with errno set.
+ */
+int rxbatch_recv(struct rxbatch *batch, int sockfd);
+
+#endif /* ifndef RX_H */
@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "stats.h"
+#include "sched.h"
+
+struct sched_entry {
+	uint32_t	id;		/* 0 if the slot is free */
+	uint16_t	powcmd;
+	int64_t		due;		/* CLOCK_BOOTTIME, so time asleep counts */
+	int64_t		deadline;	/* CLOCK_REALTIME if absolute, else 0 */
+	int		heap_idx;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	struct sched_entry	slots[SCHED_MAX];
+	struct sched_entry	*heap[SCHED_MAX];	/* min-heap on due */
+	int			n;
+	int			ndeadlines;	/* entries with an absolute deadline */
+	uint32_t		next_gen;	/* upper bits of the next id */
+	int			timerfd;
+	int			rt_timerfd;	/* for absolute deadlines */
+	sched_fire_cb		fire;
+	struct sstate_entry	last;		/* last entry carried out */
+	int64_t			last_fired;
+} sched = { .lock = PTHREAD_MUTEX_INITIALIZER, .timerfd = -1, .rt_timerfd = -1 };
+
+/*
+ * Entry ids are (generation << 8 | slot), so cancelling finds the slot
+ * directly and a stale id never matches a reused slot.
+ */
+#define ID_SLOT(id)	((id) & 0xff)
+
+static int64_t now_ms(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int sched_priority(uint16_t powcmd)
+{
+	switch (powcmd) {
+	case REQ_POW_SHUTDOWN:
+		return 5;
+	case REQ_POW_HIBERNATE:
+		return 4;
+	case REQ_POW_REBOOT:
+		return 3;
+	case REQ_POW_SLEEP:
+		return 2;
+	case REQ_POW_STANDBY:
+		return 1;
+	}
+	return 0;
+}
+
+static void heap_swap(int i, int j)
+{
+	struct sched_entry *tmp = sched.heap[i];
+
+	sched.heap[i] = sched.heap[j];
+	sched.heap[j] = tmp;
+	sched.heap[i]->heap_idx = i;
+	sched.heap[j]->heap_idx = j;
+}
+
+static void sift_up(int i)
+{
+	while (i > 0 && sched.heap[(i - 1) / 2]->due > sched.heap[i]->due) {
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void sift_down(int i)
+{
+	int min, l, r;
+
+	while (true) {
+		min = i;
+		l = 2 * i + 1;
+		r = l + 1;
+		if (l < sched.n && sched.heap[l]->due < sched.heap[min]->due)
+			min = l;
+		if (r < sched.n && sched.heap[r]->due < sched.heap[min]->due)
+			min = r;
+		if (min == i)
+			return;
+		heap_swap(i, min);
+		i = min;
+	}
+}
+
+static void heap_remove(struct sched_entry *e)
+{
+	int i = e->heap_idx;
+
+	if (i != --sched.n) {
+		heap_swap(i, sched.n);
+		sift_down(i);
+		sift_up(i);
+	}
+	if (e->deadline)
+		--sched.ndeadlines;
+	e->id = 0;
+}
+
+/* arm $fd to expire at $ms on its clock, or disarm it if $ms is -1 */
+static void settimer(int fd, int64_t ms, int flags)
+{
+	struct itimerspec its = { 0 };
+
+	if (ms >= 0) {
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = ms % 1000 * 1000000;
+		/* an all-zero value would disarm the timer instead */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME | flags, &its, NULL) == -1)
+		perror("timerfd_settime");
+}
+
+/*
+ * Arm the timers for the earliest entry, with sched.lock held. An absolute
+ * deadline is left to the CLOCK_REALTIME timer, which expires on the wall
+ * clock time itself even if the clock is set meanwhile, and reports that.
+ * While any deadline is pending that timer is armed for the earliest entry
+ * of either kind, so a clock set is always noticed and the heap rekeyed.
+ */
+static void rearm(void)
+{
+	struct sched_entry *e = sched.n > 0 ? sched.heap[0] : NULL;
+	int64_t real = -1;
+
+	if (e && e->deadline)
+		real = e->deadline;
+	else if (e && sched.ndeadlines)
+		real = MAX(e->due - now_ms(CLOCK_BOOTTIME) + now_ms(CLOCK_REALTIME), 0);
+	settimer(sched.timerfd, e && !e->deadline ? e->due : -1, 0);
+	settimer(sched.rt_timerfd, real, TFD_TIMER_CANCEL_ON_SET);
+}
+
+/*
+ * The heap is ordered on boot time, which absolute deadlines are converted
+ * to when added. Redo that whenever the wall clock may have been set.
+ */
+static void rekey(void)
+{
+	int64_t boot = now_ms(CLOCK_BOOTTIME), real = now_ms(CLOCK_REALTIME);
+
+	for (int i = 0; i < sched.n; ++i)
+		if (sched.heap[i]->deadline)
+			sched.heap[i]->due = sched.heap[i]->deadline - real + boot;
+	for (int i = sched.n / 2 - 1; i >= 0; --i)
+		sift_down(i);
+}
+
+/* called from the event loop when the earliest entry is due */
+static void sched_expired(int fd, uint32_t events, void *arg)
+{
+	struct sched_entry *e, *winner = NULL;
+	uint64_t expirations;
+	uint16_t powcmd = 0;
+	uint32_t id = 0;
+	int64_t until, due = 0, fired;
+
+	/* ECANCELED: the wall clock was set, so deadlines moved */
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)
+			&& errno != ECANCELED)
+		return;		/* rearmed after it became readable */
+
+	pthread_mutex_lock(&sched.lock);
+	rekey();
+	until = now_ms(CLOCK_BOOTTIME);
+	while (sched.n > 0 && sched.heap[0]->due <= until) {
+		e = sched.heap[0];
+		if (!winner || sched_priority(e->powcmd) > sched_priority(winner->powcmd)) {
+			if (winner)
+				STATS_INC(sched_superseded);
+			powcmd = e->powcmd;
+			id = e->id;
+			due = e->deadline ? e->deadline
+				: e->due - now_ms(CLOCK_BOOTTIME) + now_ms(CLOCK_REALTIME);
+			winner = e;
+		} else {
+			STATS_INC(sched_superseded);
+		}
+		heap_remove(e);
+	}
+	/* nothing runs after the machine goes down */
+	if (winner && (powcmd == REQ_POW_SHUTDOWN || powcmd == REQ_POW_REBOOT)) {
+		STATS_ADD(sched_superseded, sched.n);
+		while (sched.n > 0)
+			heap_remove(sched.heap[0]);
+	}
+	if (winner) {
+		fired = now_ms(CLOCK_REALTIME);
+		sched.last.id = id;
+		sched.last.powcmd = powcmd;
+		sched.last.due = due;
+		sched.last_fired = fired;
+	}
+	rearm();
+	pthread_mutex_unlock(&sched.lock);
+
+	if (winner) {
+		STATS_INC(sched_fired);
+		PDEBUG("[-] entry %u due: %x, %ld ms late\n", id, powcmd, (long)(fired - due));
+		sched.fire(powcmd, id);
+	}
+}
+
+int sched_init(sched_fire_cb fire)
+{
+	sched.fire = fire;
+	sched.timerfd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sched.timerfd == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+	sched.rt_timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sched.rt_timerfd == -1) {
+		perror("timerfd_create");
+		goto err;
+	}
+	if (reactor_add(sched.timerfd, EPOLLIN, sched_expired, NULL) == NULL
+			|| reactor_add(sched.rt_timerfd, EPOLLIN, sched_expired, NULL) == NULL)
+		goto err;
+	return 0;
+
+err:
+	/* a handler left behind never fires: its timer is never armed */
+	close(sched.timerfd);
+	if (sched.rt_timerfd != -1)
+		close(sched.rt_timerfd);
+	return -1;
+}
+
+/* add an entry due at $due boot time, or at wall clock time $deadline if not 0 */
+static uint32_t add(uint16_t powcmd, int64_t due, int64_t deadline)
+{
+	struct sched_entry *e = NULL;
+	uint32_t id = 0;
+
+	pthread_mutex_lock(&sched.lock);
+	for (int i = 0; i < SCHED_MAX; ++i) {
+		if (sched.slots[i].id == 0) {
+			e = &sched.slots[i];
+			break;
+		}
+	}
+	if (e) {
+		/* generation 0 is skipped so that no id is 0 */
+		if (++sched.next_gen >= (1U << 24))
+			sched.next_gen = 1;
+		id = sched.next_gen << 8 | (uint32_t)(e - sched.slots);
+		e->id = id;
+		e->powcmd = powcmd;
+		e->due = due;
+		e->deadline = deadline;
+		if (deadline)
+			++sched.ndeadlines;
+		e->heap_idx = sched.n;
+		sched.heap[sched.n++] = e;
+		sift_up(e->heap_idx);
+		rearm();
+	}
+	pthread_mutex_unlock(&sched.lock);
+
+	return id;
+}
+
+uint32_t sched_add(uint16_t powcmd, int64_t delay_ms)
+{
+	uint32_t id = add(powcmd, now_ms(CLOCK_BOOTTIME) + delay_ms, 0);
+
+	if (id)
+		PDEBUG("[+] entry %u: %x in %ld ms\n", id, powcmd, (long)delay_ms);
+	return id;
+}
+
+uint32_t sched_add_at(uint16_t powcmd, int64_t deadline_ms)
+{
+	int64_t due = deadline_ms - now_ms(CLOCK_REALTIME) + now_ms(CLOCK_BOOTTIME);
+	uint32_t id;
+
+	/* a deadline of 0 is taken as 1 ms past the epoch, already due anyway */
+	if ((id = add(powcmd, due, MAX(deadline_ms, 1))))
+		PDEBUG("[+] entry %u: %x at %ld ms\n", id, powcmd, (long)deadline_ms);
+	return id;
+}
+
+int sched_cancel(uint32_t id)
+{
+	struct sched_entry *e = &sched.slots[ID_SLOT(id) % SCHED_MAX];
+	int ret = -1;
+
+	pthread_mutex_lock(&sched.lock);
+	if (id != 0 && e->id == id) {
+		heap_remove(e);
+		rearm();
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sched.lock);
+
+	return ret;
+}
+
+void sched_cancel_all(const uint32_t *keep, size_t nkeep)
+{
+	size_t k;
+
+	pthread_mutex_lock(&sched.lock);
+	for (int i = 0; i < SCHED_MAX; ++i) {
+		for (k = 0; k < nkeep && keep[k] != sched.slots[i].id; ++k)
+			;
+		if (sched.slots[i].id && k == nkeep)
+			heap_remove(&sched.slots[i]);
+	}
+	rearm();
+	pthread_mutex_unlock(&sched.lock);
+}
+
+size_t sched_room(void)
+{
+	size_t room;
+
+	pthread_mutex_lock(&sched.lock);
+	room = SCHED_MAX - sched.n;
+	pthread_mutex_unlock(&sched.lock);
+	return room;
+}
+
+static int cmp_due(const void *a, const void *b)
+{
+	const struct sched_entry *x = *(struct sched_entry **)a;
+	const struct sched_entry *y = *(struct sched_entry **)b;
+
+	return (x->due > y->due) - (x->due < y->due);
+}
+
+size_t sched_list(struct sstate_entry *out, size_t max)
+{
+	struct sched_entry *sorted[SCHED_MAX];
+	int64_t boot, real;
+	size_t n;
+
+	pthread_mutex_lock(&sched.lock);
+	memcpy(sorted, sched.heap, sched.n * sizeof(sorted[0]));
+	qsort(sorted, sched.n, sizeof(sorted[0]), cmp_due);
+	/* convert due times from boot time to wall clock */
+	boot = now_ms(CLOCK_BOOTTIME);
+	real = now_ms(CLOCK_REALTIME);
+	n = MIN((size_t)sched.n, max);
+	for (size_t i = 0; i < n; ++i) {
+		out[i].id = sorted[i]->id;
+		out[i].powcmd = sorted[i]->powcmd;
+		out[i].due = sorted[i]->deadline ? sorted[i]->deadline
+			: sorted[i]->due - boot + real;
+	}
+	pthread_mutex_unlock(&sched.lock);
+
+	return n;
+}
+
+int sched_last(struct sstate_entry *entry, int64_t *fired_at)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&sched.lock);
+	if (sched.last.id) {
+		*entry = sched.last;
+		*fired_at = sched.last_fired;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sched.lock);
+
+	return ret;
+}
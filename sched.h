@@ -0,0 +1,78 @@
+#ifndef SCHED_H
+#define SCHED_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "protocol.h"	/* get definition of struct sstate_entry */
+
+/*
+ * Scheduler for pending power commands. Entries are kept in a min-heap on
+ * their due time with a single timerfd armed for the earliest one, so
+ * adding and cancelling are O(log n). Times are in milliseconds.
+ *
+ * When the timer fires, of all entries already due the one with the highest
+ * priority wins and the others are dropped, so a sleep due together with a
+ * shutdown does not run first. No entry runs before it is due. After a
+ * shutdown or a reboot nothing else can run, so every remaining entry is
+ * dropped too.
+ */
+
+#define SCHED_MAX	64	/* pending entries */
+
+typedef void (*sched_fire_cb)(uint16_t powcmd, uint32_t id);
+
+/*
+ * sched_init:
+ * 	Create the timer and register it with the event loop, which calls $fire
+ * 	with the winning entry whenever entries become due.
+ * 	Returns -1 on error and 0 on success.
+ */
+int sched_init(sched_fire_cb fire);
+
+/*
+ * sched_add:
+ * 	Schedule $powcmd (force bit cleared) to run $delay_ms from now.
+ * 	Returns the id of the new entry, or 0 if the scheduler is full.
+ */
+uint32_t sched_add(uint16_t powcmd, int64_t delay_ms);
+
+/*
+ * sched_add_at:
+ * 	Schedule $powcmd (force bit cleared) to run at wall clock time
+ * 	$deadline_ms, following changes to the clock. Returns the id of the new
+ * 	entry, or 0 if the scheduler is full.
+ */
+uint32_t sched_add_at(uint16_t powcmd, int64_t deadline_ms);
+
+/* sched_cancel:	Cancel entry $id. Returns -1 if there is no such entry. */
+int sched_cancel(uint32_t id);
+
+/*
+ * sched_cancel_all:
+ * 	Cancel every entry but the $nkeep ones whose ids are listed in $keep.
+ */
+void sched_cancel_all(const uint32_t *keep, size_t nkeep);
+
+/* sched_room:	Return how many more entries can be added */
+size_t sched_room(void);
+
+/*
+ * sched_list:
+ * 	Store up to $max pending entries in $out, earliest first, with their
+ * 	wall clock due time. Returns the number stored.
+ */
+size_t sched_list(struct sstate_entry *out, size_t max);
+
+/*
+ * sched_last:
+ * 	Store the last entry carried out in $entry, with its wall clock due
+ * 	time, and when it was actually carried out in $fired_at.
+ * 	Returns -1 if nothing has been carried out yet.
+ */
+int sched_last(struct sstate_entry *entry, int64_t *fired_at);
+
+/* sched_priority:	Rank of $powcmd when several entries are due at once */
+int sched_priority(uint16_t powcmd);
+
+#endif /* ifndef SCHED_H */
@@ -1,8 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/signalfd.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -14,114 +22,681 @@
 #include "daemon.h"
 #include "auth.h"
 #include "notif.h"
+#include "stats.h"
+#include "rx.h"
+#include "pipeline.h"
+#include "reactor.h"
+#include "uring.h"
+#include "replay.h"
+#include "admit.h"
+#include "filter.h"
+#include "acl.h"
+#include "session.h"
+#include "merkle.h"
+#include "dedupe.h"
 
 #define BUFFSIZE	2048
-#define RXBUF_SIZE	BUFFSIZE
 #define TXBUF_SIZE	BUFFSIZE
 
+#define DEFAULT_BATCH	16	/* datagrams received per syscall */
+#define DEFAULT_QUEUE	1024	/* requests queued for verification */
+#define SOCKET_MAX_BATCHES	8	/* batches received per event loop wakeup */
+#define URING_NBUFS	256	/* io_uring provided receive buffers */
+
 static struct {
 	int port;
-	char *pubkey;
+	char *pubkey;		/* default key, NULL if only the trust store is used */
+	char *trust;		/* trust store directory, NULL for none */
+	char *acl;		/* source address ACL, NULL to allow everyone */
+	unsigned int batch;	/* max datagrams per recvmmsg() */
+	int workers;		/* number of receive/verify threads */
+	int verifiers;		/* verifier threads, 0 to verify in workers */
+	unsigned int queue;	/* pipeline queue size */
+	bool pin;		/* pin each worker to a cpu */
+	bool uring;		/* receive through io_uring if available */
 	bool ipv6;
+	unsigned int rate;	/* requests per second per source, 0 for no limit */
+	unsigned int burst;
 } argopts;
 
 /* server state showing info about pending power commands */
 struct sstate state;
+/* serializes handle_request() and hence all access to $state */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * With more than one worker, each runs a receive/verify loop on its own
+ * SO_REUSEPORT socket in its own thread.
+ */
+struct worker {
+	pthread_t	tid;
+	int		id;
+	int		sockfd;
+};
 
 static void parse_args(int *argc, char *argv[]);
+static void signal_ready(int fd, uint32_t events, void *arg);
+static void socket_ready(int fd, uint32_t events, void *arg);
+static void handle_slot(struct rxslot *slot);
+static void handle_batch(struct rxbatch *batch);
+static void uring_ready(int fd, uint32_t events, void *arg);
+static int receive_requests_uring(int sockfd);
+static void *worker_main(void *arg);
+static void pipeline_verify(struct pipe_entry *e);
+static void pipeline_dispatch(struct pipe_entry *e);
+static int apply_batch(struct request *req);
+static int apply_request(struct request *req, struct power_handle *h);
 
 int create_socket(int domain, int port);
 int receive_requests(int sockfd);
+int verify_datagram(struct rxslot *slot, struct request *req);
+int process_datagram(struct rxslot *slot);
 int handle_request(struct request *req);
+void send_ack(struct rxslot *slot, struct request *req, int status);
+void send_refusal(struct rxslot *slot, uint16_t ack);
+int send_session(struct rxslot *slot, struct request *req);
 
 int main(int argc, char *argv[])
 {
-	int sockfd = -1, rxlen, txlen;
-	bool is_server = true;
-	ssize_t ret;
+	struct worker *workers;
+	struct rxbatch batch;
+	struct uring *ring = NULL;
+	sigset_t sigset;
+	int sigfd, ret = 0;
 
 	parse_args(&argc, argv);
 
-	sockfd = create_socket(AF_INET, argopts.port);
-	if (sockfd == -1)
+	/* fail at startup, not for every request, if the keys are unusable */
+	if (!argopts.pubkey && !argopts.trust)
+		argopts.pubkey = DEFAULT_PUBKEY;
+	if (argopts.pubkey && pubkey_load(argopts.pubkey) == -1)
+		exit(EXIT_FAILURE);
+	if (argopts.trust && truststore_load(argopts.trust) == -1)
+		exit(EXIT_FAILURE);
+	if (argopts.acl && acl_load(argopts.acl) == -1)
+		exit(EXIT_FAILURE);
+
+	admit_init(argopts.rate, argopts.burst);
+	dedupe_init();
+	if (reactor_init() == -1 || power_init() == -1 || notif_init() == -1)
+		exit(EXIT_FAILURE);
+
+	workers = calloc(argopts.workers, sizeof(*workers));
+	if (!workers) {
+		perror("error allocating workers");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < argopts.workers; ++i) {
+		workers[i].id = i;
+		workers[i].sockfd = create_socket(AF_INET, argopts.port);
+		if (workers[i].sockfd == -1)
+			exit(EXIT_FAILURE);
+	}
+	/* the group exists once all are bound, the program is shared by it */
+	if (argopts.workers > 1
+			&& filter_attach_reuseport(workers[0].sockfd, argopts.workers) == -1)
+		fprintf(stderr, "continuing with the default reuseport hash..\n");
+
+	/*
+	 * Signals are only handled by the event loop, through a signalfd; block
+	 * them before creating any threads so they inherit the mask.
+	 */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGHUP);
+	sigaddset(&sigset, SIGUSR1);
+	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	sigfd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd == -1 || reactor_add(sigfd, EPOLLIN, signal_ready, NULL) == NULL) {
+		perror("error setting up signalfd");
+		exit(EXIT_FAILURE);
+	}
+
+	if (argopts.verifiers && pipeline_start(argopts.queue, argopts.verifiers,
+				pipeline_verify, pipeline_dispatch) == -1) {
+		perror("error starting pipeline");
 		exit(EXIT_FAILURE);
+	}
+	if (argopts.workers == 1) {
+		/* a single socket is served by the event loop itself */
+		fcntl(workers[0].sockfd, F_SETFL, O_NONBLOCK);
+		if (argopts.uring) {
+			ring = uring_setup(workers[0].sockfd, URING_NBUFS, handle_slot);
+			if (ring && reactor_add(uring_fd(ring), EPOLLIN, uring_ready,
+						ring) == NULL)
+				exit(EXIT_FAILURE);
+			if (!ring)
+				fprintf(stderr, "io_uring unavailable (%s), using recvmmsg\n",
+					strerror(errno));
+		}
+	}
+	if (argopts.workers == 1 && !ring) {
+		if (rxbatch_init(&batch, argopts.batch) == -1) {
+			perror("error allocating receive slots");
+			exit(EXIT_FAILURE);
+		}
+		if (reactor_add(workers[0].sockfd, EPOLLIN, socket_ready, &batch) == NULL)
+			exit(EXIT_FAILURE);
+	} else if (argopts.workers > 1) {
+		for (int i = 0; i < argopts.workers; ++i) {
+			if ((errno = pthread_create(&workers[i].tid, NULL, worker_main,
+							&workers[i])) != 0) {
+				perror("error creating worker thread");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
 
-	printf("lsdd: listening on port %d\n", argopts.port);
-	receive_requests(sockfd);
+	printf("lsdd: listening on port %d with %d worker(s)\n",
+		argopts.port, argopts.workers);
+	if (reactor_run() == -1)
+		ret = 1;
 	printf("server exiting...\n");
-out:
-	close(sockfd);
-	return 0;
+	stats_dump(stdout);
+	if (argopts.verifiers)
+		pipeline_dump(stdout);
+
+	/* worker threads are blocked in recvmmsg(), they go away with the process */
+	for (int i = 0; i < argopts.workers; ++i)
+		close(workers[i].sockfd);
+	free(workers);
+	close(sigfd);
+	uring_free(ring);
+	pubkey_unload();
+	truststore_unload();
+	acl_unload();
+	return ret;
+}
+
+/* signalfd is readable: handle the signals for the whole server */
+static void signal_ready(int fd, uint32_t events, void *arg)
+{
+	struct signalfd_siginfo si;
+	bool reloaded;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGHUP:
+			reloaded = false;
+			if (argopts.pubkey) {
+				printf("reloading public key '%s'\n", argopts.pubkey);
+				if (pubkey_load(argopts.pubkey) == -1) {
+					fprintf(stderr, "keeping previously loaded public key\n");
+				} else {
+					/* the key may have been replaced, not just rewritten */
+					pthread_mutex_lock(&state_lock);
+					session_drop_key(0);
+					pthread_mutex_unlock(&state_lock);
+					reloaded = true;
+				}
+			}
+			if (argopts.trust) {
+				printf("reloading trust store '%s'\n", argopts.trust);
+				if (truststore_load(argopts.trust) == -1) {
+					fprintf(stderr, "keeping previously loaded trust store\n");
+				} else {
+					/* revoked keys take their sessions with them */
+					pthread_mutex_lock(&state_lock);
+					session_drop_untrusted();
+					pthread_mutex_unlock(&state_lock);
+					reloaded = true;
+				}
+			}
+			if (reloaded) {
+				/* what was verified with the old keys is checked again */
+				merkle_cache_flush();
+				dedupe_flush();
+			}
+			if (argopts.acl && acl_load(argopts.acl) == -1)
+				fprintf(stderr, "keeping previously loaded ACL\n");
+			break;
+		case SIGUSR1:
+			stats_dump(stdout);
+			truststore_dump(stdout);
+			if (argopts.verifiers)
+				pipeline_dump(stdout);
+			break;
+		case SIGTERM:
+		case SIGINT:
+			reactor_stop();
+			return;
+		}
+	}
+}
+
+/*
+ * socket_ready:
+ * 	The event loop's socket has datagrams queued. Receive a bounded number
+ * 	of batches so that timers and signals are not starved under a flood;
+ * 	epoll reports the socket again if more is left.
+ */
+static void socket_ready(int fd, uint32_t events, void *arg)
+{
+	struct rxbatch *batch = arg;
+
+	for (int i = 0; i < SOCKET_MAX_BATCHES; ++i) {
+		if (rxbatch_recv(batch, fd) == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				STATS_INC(rx_errors);
+				perror("recvmmsg error");
+			}
+			return;
+		}
+		handle_batch(batch);
+		if (batch->count < batch->size)
+			return;		/* socket drained */
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	if (argopts.pin) {
+		cpu_set_t cpus;
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		CPU_ZERO(&cpus);
+		CPU_SET(w->id % (ncpus > 0 ? ncpus : 1), &cpus);
+		if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+							&cpus)) != 0)
+			perror("pthread_setaffinity_np: worker not pinned");
+	}
+	PDEBUG("[+] worker %d receiving on socket %d\n", w->id, w->sockfd);
+	if (argopts.uring && receive_requests_uring(w->sockfd) == -1)
+		fprintf(stderr, "worker %d: io_uring unavailable (%s), using recvmmsg\n",
+			w->id, strerror(errno));
+	receive_requests(w->sockfd);
+	return NULL;
 }
 
 int receive_requests(int sockfd)
 {
-	char rxbuf[RXBUF_SIZE], txbuf[TXBUF_SIZE], *rp;
-	char addrstr[INET_ADDRSTRLEN];
-	ssize_t ret;
-	struct sockaddr_in cliaddr;
-	struct request req;
-	socklen_t addrsize = sizeof(cliaddr);
+	struct rxbatch batch;
+
+	if (rxbatch_init(&batch, argopts.batch) == -1) {
+		perror("error allocating receive slots");
+		return -1;
+	}
 
 	while (true) {
-		/* receive fixed part of request first */
-		ret = recvfrom(sockfd, rxbuf, sizeof(rxbuf), 0,
-				(struct sockaddr *)&cliaddr, &addrsize);
-		if (ret < 0) {
-			perror("recvfrom error");
+		if (rxbatch_recv(&batch, sockfd) == -1) {
+			if (errno != EINTR) {
+				STATS_INC(rx_errors);
+				perror("recvmmsg error");
+			}
 			continue;
 		}
-		PDEBUG("received %zd bytes from %s:%d\n", ret,
-			inet_ntop(AF_INET, &cliaddr.sin_addr, addrstr, sizeof(addrstr)),
-			ntohs(cliaddr.sin_port));
-		/* rp points past the fixed part, i.e to the message part */
-		rp = unpack_request_fixed(&req, rxbuf);
-		PDEBUG("request\n=======\n"
-			"when = %ld\ntimer=%d\nreq_type=%x\nmsg_size = %d\n",
-			req.when, req.timer, req.req_type, req.msg_size);
-		/* receive message */
-		if (req.msg_size > 0) {
-			req.msg = strdup(rp);
-			PDEBUG("msg = '%s'\n", req.msg);
-		} else {
-			req.msg = NULL;
+		handle_batch(&batch);
+	}
+	rxbatch_free(&batch);
+	return 0;
+}
+
+static void handle_slot(struct rxslot *slot)
+{
+	unsigned char reply[DEDUPE_REPLY_MAX];
+	size_t replylen;
+
+	slot->dedupe = 0;
+	/* cheap checks first, so floods are dropped before costing a verify */
+	switch (admit_datagram(slot)) {
+	case ADMIT_OK:
+		break;
+	case ADMIT_DENIED:
+		send_refusal(slot, ACK_DENIED);
+		return;
+	case ADMIT_DISABLED:
+		send_refusal(slot, ACK_DISABLED);
+		return;
+	default:
+		PDEBUG("datagram of %zu bytes not admitted\n", slot->len);
+		return;
+	}
+	/* a copy of a recent datagram gets the same answer, or none */
+	switch (dedupe_check(slot, reply, &replylen)) {
+	case DEDUPE_NEW:
+		break;
+	case DEDUPE_ANSWERED:
+		if (replylen && sendto(slot->sockfd, reply, replylen, 0,
+					(struct sockaddr *)&slot->addr, slot->addrlen) == -1)
+			perror("error sending cached reply");
+		return;
+	default:
+		return;
+	}
+	/* with a pipeline, verification happens in other threads */
+	if (argopts.verifiers)
+		pipeline_push(slot);
+	else
+		process_datagram(slot);
+}
+
+static void handle_batch(struct rxbatch *batch)
+{
+	PDEBUG("received batch of %u datagrams\n", batch->count);
+	for (unsigned int i = 0; i < batch->count; ++i)
+		handle_slot(&batch->slots[i]);
+}
+
+/* io_uring backend: completions queued for the event loop's ring */
+static void uring_ready(int fd, uint32_t events, void *arg)
+{
+	uring_reap(arg);
+}
+
+/* io_uring backend for worker threads, returns -1 if it is unavailable */
+static int receive_requests_uring(int sockfd)
+{
+	struct uring *ring;
+
+	if ((ring = uring_setup(sockfd, URING_NBUFS, handle_slot)) == NULL)
+		return -1;
+	while (true) {
+		if (uring_wait(ring) == -1 && errno != EINTR) {
+			perror("io_uring_enter");
+			continue;
 		}
-		rp += req.msg_size;
-		unpack_signature(&req.sig, rp);
-		size_t sigsize = req.sig.sigsize;
-		if (!verifysig(argopts.pubkey, rxbuf, REQUEST_FIXED_SIZE+req.msg_size,
-				req.sig.sig, &sigsize)) {
-			printf("client verification failed!\n");
-			printf("discarding request\n");
-			goto end;
+		uring_reap(ring);
+	}
+	uring_free(ring);
+	return 0;
+}
+
+/*
+ * verify_datagram:
+ * 	Parse the request in $slot into $req and check its signature. The
+ * 	request is parsed in place, req->msg pointing into the slot's buffer,
+ * 	so parsing allocates nothing; checking a public key signature still
+ * 	does, inside OpenSSL.
+ * 	Returns 1 if the request is authentic, else 0.
+ */
+int verify_datagram(struct rxslot *slot, struct request *req)
+{
+	char addrstr[INET_ADDRSTRLEN];
+	struct sockaddr_in *cliaddr = (struct sockaddr_in *)&slot->addr;
+	ssize_t signedsize;
+	int valid;
+
+	PDEBUG("received %zu bytes from %s:%d\n", slot->len,
+		inet_ntop(AF_INET, &cliaddr->sin_addr, addrstr, sizeof(addrstr)),
+		ntohs(cliaddr->sin_port));
+	if ((signedsize = unpack_request(req, slot->buf, slot->len)) == -1) {
+		dedupe_reject(slot);
+		STATS_INC(verify_failed);
+		printf("malformed request, discarding\n");
+		return 0;
+	}
+	PDEBUG("request\n=======\n"
+		"when = %ld\ntimer=%d\nreq_type=%x\nmsg_size = %d\n",
+		req->when, req->timer, req->req_type, req->msg_size);
+	PDEBUG("msg = '%.*s'\n", req->msg_size, req->msg ? (char *)req->msg : "");
+	size_t sigsize = req->sig.sigsize;
+	if (req->sigalg == SIG_HMAC_SHA256) {
+		/* the session stands for the key that opened it */
+		valid = session_verify(req->client_id, slot->buf, signedsize, req->sig.sig,
+				sigsize, slot->stamp, &req->keyid);
+		if (valid == -1) {
+			/* the client has to open another one */
+			STATS_INC(session_unknown);
+			send_refusal(slot, ACK_NO_SESSION);
+			return 0;
 		}
-		handle_request(&req);
-	end:
-		free(req.msg);
+	} else if (req->proof.count) {
+		valid = merkle_verify(slot->buf, signedsize, req, slot->dst, slot->stamp);
+	} else {
+		valid = verifysig(req->sigalg, req->keyid, slot->buf, signedsize,
+				req->sig.sig, &sigsize);
+	}
+	if (!valid) {
+		dedupe_reject(slot);
+		STATS_INC(verify_failed);
+		printf("client verification failed!\n");
+		printf("discarding request\n");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * process_datagram:
+ * 	Parse and verify the request in $slot, and handle it if the signature
+ * 	is valid. Returns -1 if the request was discarded, else the return
+ * 	value of handle_request().
+ */
+int process_datagram(struct rxslot *slot)
+{
+	struct request req;
+	int ret = -1;
+
+	if (verify_datagram(slot, &req)) {
+		pthread_mutex_lock(&state_lock);
+		ret = handle_request(&req);
+		send_ack(slot, &req, ret);
+		pthread_mutex_unlock(&state_lock);
+	}
+	return ret;
+}
+
+/*
+ * send_ack:
+ * 	Answer the authentic request $req received in $slot with the server
+ * 	state, $status being the return value of handle_request(). The skew of
+ * 	requests with a deadline is measured against their send time, so clients
+ * 	can see how far apart the hosts they address are; a copy of one seen
+ * 	before was sent again later, and has none. Must be called with
+ * 	state_lock held.
+ */
+void send_ack(struct rxslot *slot, struct request *req, int status)
+{
+	char buf[SSTATE_SIZE];
+	struct sstate ack = state;
+	size_t size;
+
+	/* an opened session is answered with its id and the server's key */
+	if ((req->req_type & ~REQ_FLAG_BITS) == REQ_SESSION && status == 0
+			&& send_session(slot, req) == 0)
+		return;
+	power_get_state(&ack);
+	ack.ack = status == 0 ? ACK_GRANTED : status == -3 ? ACK_REPLAYED : ACK_DENIED;
+	ack.skew = GET_ABSTIME_BIT(req->req_type) && status != -3 ? slot->stamp - req->sent : 0;
+	if ((size = pack_sstate(&ack, buf, sizeof(buf))) == 0)
+		return;
+	dedupe_answer(slot, buf, size);
+	if (sendto(slot->sockfd, buf, size, 0, (struct sockaddr *)&slot->addr,
+				slot->addrlen) == -1)
+		perror("error sending ack");
+}
+
+/*
+ * send_refusal:
+ * 	Answer the request in $slot, refused by the ACL or naming an unknown
+ * 	session before it could be verified, with $ack alone. Whoever sent
+ * 	it may not be who it claims to be, so it learns nothing of the server
+ * 	state, and gets back no more than it sent.
+ */
+void send_refusal(struct rxslot *slot, uint16_t ack)
+{
+	char buf[SSTATE_SIZE];
+	struct sstate refusal = { .ack = ack };
+	size_t size;
+
+	/* never a reflector amplifying what is sent to us */
+	if ((size = pack_sstate(&refusal, buf, sizeof(buf))) == 0 || size > slot->len)
+		return;
+	dedupe_answer(slot, buf, size);
+	if (sendto(slot->sockfd, buf, size, 0, (struct sockaddr *)&slot->addr,
+				slot->addrlen) == -1)
+		perror("error sending refusal");
+}
+
+/*
+ * send_session:
+ * 	Open a session for the authentic REQ_SESSION request $req received in
+ * 	$slot, and send its reply. Returns -1 if it could not be opened, and 0
+ * 	on success.
+ */
+int send_session(struct rxslot *slot, struct request *req)
+{
+	unsigned char buf[SESSION_REPLY_SIZE];
+	struct session_reply reply;
+	size_t size;
+
+	if (session_open(req->keyid, req->client_id, req->msg, req->msg_size, slot->stamp,
+				&reply) == -1
+			|| (size = pack_session_reply(&reply, buf, sizeof(buf))) == 0) {
+		fprintf(stderr, "error opening session for client %016llx\n",
+			(unsigned long long)req->client_id);
+		return -1;
+	}
+	STATS_INC(session_opened);
+	dedupe_answer(slot, buf, size);
+	if (sendto(slot->sockfd, buf, size, 0, (struct sockaddr *)&slot->addr,
+				slot->addrlen) == -1)
+		perror("error sending session");
+	return 0;
+}
+
+/* verify and dispatch callbacks for the pipeline */
+static void pipeline_verify(struct pipe_entry *e)
+{
+	e->valid = verify_datagram(&e->rx, &e->req);
+}
+
+static void pipeline_dispatch(struct pipe_entry *e)
+{
+	if (e->valid) {
+		pthread_mutex_lock(&state_lock);
+		send_ack(&e->rx, &e->req, handle_request(&e->req));
+		pthread_mutex_unlock(&state_lock);
 	}
 }
 
 /*
  * handle_request:
+ * 	Carry out the authentic request $req, or each command of a batch, unless
+ * 	it was seen before. Returns:
  * 	0 on success.
  * 	-1 on invalid request or error scheduling command.
- * 	-2 if request too old.
+ * 	-2 if request too old, not tracked, or a copy of one not granted.
+ * 	-3 if replayed: a copy of it was granted before.
+ * 	Must be called with state_lock held.
  */
 int handle_request(struct request *req)
 {
-	int scheduled = 0;
-	uint16_t req_type;
+	struct power_handle h;
+	int64_t now = rx_stamp();
+	int fresh, ret;
 
-	if (req->when <= state.when) {
+	state.failed = 0;
+	/* v1 has no sequence numbers, only the time of the last command */
+	if (req->version >= 2) {
+		fresh = replay_check(req->keyid, req->client_id, req->seq, req->sent, now);
+		if (fresh != REPLAY_OK) {
+			STATS_INC(replay_rejected);
+			fprintf(stderr, "%s request from client %016llx... ignoring\n",
+				fresh == REPLAY_STALE ? "stale" : fresh == REPLAY_FULL
+				? "untracked" : fresh == REPLAY_OLD ? "old" : "replayed",
+				(unsigned long long)req->client_id);
+			/* only a copy of a granted request was carried out */
+			return fresh == REPLAY_DUP ? -3 : -2;
+		}
+	} else if (req->when <= state.when) {
+		STATS_INC(replay_rejected);
 		fprintf(stderr, "old request... ignoring\n");
 		return -2;
 	}
 
+	if ((req->req_type & ~REQ_FLAG_BITS) == REQ_BATCH)
+		ret = apply_batch(req);
+	else
+		ret = apply_request(req, &h);
+	if (ret == 0 && req->version >= 2)
+		replay_grant(req->keyid, req->client_id, req->seq, now);
+	return ret;
+}
+
+/* is_power:	Whether $req is a power command to schedule */
+static bool is_power(const struct request *req)
+{
+	uint16_t type = req->req_type & ~REQ_FLAG_BITS;
+
+	return type >= REQ_POW_SHUTDOWN && type <= REQ_POW_HIBERNATE;
+}
+
+/*
+ * apply_batch:
+ * 	Carry out the commands of batch $req, all or none of them. The batch
+ * 	is parsed and the type of every command checked, and the scheduler
+ * 	checked to have room for its power commands, before the first one is
+ * 	carried out. The power commands are scheduled first, in order; if one
+ * 	cannot be, those before it are cancelled. Only then are notifications
+ * 	shown and aborts carried out, in order, an abort of every command
+ * 	sparing those of the batch that come after it. state_lock is held
+ * 	throughout, so other requests see the batch applied all at once.
+ * 	Returns -1, with state.failed set to 1 + the index of the command
+ * 	that failed if any, when the batch was not applied, and 0 if it was.
+ */
+static int apply_batch(struct request *req)
+{
+	struct request cmds[BATCH_MAX];
+	struct power_handle h[BATCH_MAX] = { 0 };
+	size_t room = power_room();
+	uint16_t type;
+	int n;
+
+	if ((n = unpack_batch(req, cmds, BATCH_MAX)) == -1) {
+		fprintf(stderr, "invalid batch, ignoring...\n");
+		return -1;
+	}
+	PDEBUG("batch of %d commands\n", n);
+	for (int i = 0; i < n; ++i) {
+		if (is_power(&cmds[i]) && room-- == 0) {
+			fprintf(stderr, "no room to schedule batch command %d, ignoring...\n", i);
+			state.failed = i + 1;
+			return -1;
+		}
+	}
+	for (int i = 0; i < n; ++i) {
+		if (!is_power(&cmds[i]) || apply_request(&cmds[i], &h[i]) == 0)
+			continue;
+		fprintf(stderr, "batch command %d failed, cancelling those before it\n", i);
+		state.failed = i + 1;
+		while (i-- > 0)
+			power_unschedule(&h[i]);
+		return -1;
+	}
+	for (int i = 0; i < n; ++i) {
+		type = cmds[i].req_type & ~REQ_FLAG_BITS;
+		if (type == REQ_POW_ABORT) {
+			if (power_abort(cmds[i].timer, &h[i + 1], n - i - 1) == -1)
+				fprintf(stderr, "no scheduled command %u to abort\n", cmds[i].timer);
+		} else if (!is_power(&cmds[i])) {
+			apply_request(&cmds[i], NULL);
+		}
+	}
+	return 0;
+}
+
+/*
+ * apply_request:
+ * 	Carry out $req, which is fresh, keeping in *$h what was scheduled for
+ * 	a power command. Returns 0 on success and -1 on invalid request or
+ * 	error scheduling command.
+ */
+static int apply_request(struct request *req, struct power_handle *h)
+{
+	int scheduled = 0;
+	uint16_t req_type;
+
 	/* unset force bit for switch case */
 	req_type = req->req_type;
 	if (GET_FORCE_BIT(req_type))
 		PDEBUG("[-] force bit set\n");
 	RESET_FORCE_BIT(req_type);
+	RESET_MSEC_BIT(req_type);
+	RESET_ABSTIME_BIT(req_type);
 	/* call power_schedule if it is a power command, else call notify or send state */
 	switch (req_type) {
 	case REQ_POW_SHUTDOWN:
@@ -129,10 +704,13 @@ int handle_request(struct request *req)
 	case REQ_POW_STANDBY:
 	case REQ_POW_SLEEP:
 	case REQ_POW_HIBERNATE:
-		scheduled = power_schedule(req, &state);
+		if ((scheduled = power_schedule(req, h)) == 0)
+			return -1;
 		break;
 	case REQ_POW_ABORT:
-		power_abort();
+		/* timer holds the id of the command to abort, 0 for all */
+		if (power_abort(req->timer, NULL, 0) == -1)
+			fprintf(stderr, "no scheduled command %u to abort\n", req->timer);
 		break;
 	case REQ_NOTIFY:
 		PDEBUG("notify\n");
@@ -141,24 +719,33 @@ int handle_request(struct request *req)
 		return 0;
 	case REQ_QUERY:
 		PDEBUG("query\n");
+		power_get_state(&state);
 		PDEBUG("sstate\n=====\n"
 			".when = %ld\n.issued_at = %ld\n"
 			".timer = %d\n.powcmd = %x\n\n",
 			state.when, state.issued_at, state.timer, state.powcmd);
+		for (int i = 0; i < state.npending; ++i)
+			PDEBUG("  [%u] %x at %ld ms\n", state.pending[i].id,
+				state.pending[i].powcmd, (long)state.pending[i].due);
 		/* send state to client */
 		break;
+	case REQ_SESSION:
+		/* opened by send_ack(), with the client's key in the message */
+		if (req->version < 2 || req->sigalg == SIG_HMAC_SHA256
+				|| req->msg_size != SESSION_PUB_SIZE) {
+			fprintf(stderr, "invalid session request, ignoring...\n");
+			return -1;
+		}
+		return 0;
 	default:
 		fprintf(stderr, "invalid request type %x, ignoring...\n", req->req_type);
 		return -1;
 	}
+	/* scheduled, or accepted and waiting for the user to confirm it */
 	if (scheduled) {
 		state.when = req->when;
-		state.powcmd = req->req_type;	// do this only if power command, in switch. 
-		state.timer = req->timer;
-		PDEBUG("message: '%s'\n", (req->msg_size > 0 ? req->msg : ""));
-		/* schedule power command and return 0 on success
-		 * power_schedule(&req, &state).
-		 * schedules the command sets server state in state (issued_at). */
+		power_get_state(&state);
+		PDEBUG("message: '%.*s'\n", req->msg_size, (req->msg_size > 0 ? (char *)req->msg : ""));
 
 		PDEBUG("state\n======\n"
 			".when = %ld\n.issued_at = %ld\n.powcmd = %x\n .timer = %d\n", 
@@ -190,6 +777,14 @@ int create_socket(int domain, int port)
 		close(s);
 		return -1;
 	}
+	/* junk is better dropped in the kernel than woken up for */
+	if (filter_attach(s) == -1)
+		fprintf(stderr, "continuing without socket filter..\n");
+	/* Merkle requests are bound to the address they were sent to */
+	if (rx_want_dst(s) == -1) {
+		perror("setsockopt(IP_PKTINFO) failed");
+		fprintf(stderr, "continuing without Merkle requests..\n");
+	}
 
 	return s;
 }
@@ -200,16 +795,31 @@ static void parse_args(int *argc, char *argv[])
 
 	/* setting defaults */
 	argopts.port = DEFAULT_PORT;
-	argopts.pubkey = DEFAULT_PUBKEY;
+	argopts.batch = DEFAULT_BATCH;
+	argopts.workers = 1;
+	argopts.queue = DEFAULT_QUEUE;
+	argopts.rate = ADMIT_DEFAULT_RATE;
+	argopts.burst = ADMIT_DEFAULT_BURST;
 
 	static struct option long_options[] = {
 		{"port", required_argument, NULL, 'p'},
 		{"pubkey", required_argument, NULL, 'k'},
-		{"ipv6", no_argument, NULL, '6'}
+		{"trust", required_argument, NULL, 'T'},
+		{"acl", required_argument, NULL, 'A'},
+		{"batch", required_argument, NULL, 'B'},
+		{"workers", required_argument, NULL, 'w'},
+		{"pin", no_argument, NULL, 'P'},
+		{"verifiers", required_argument, NULL, 'V'},
+		{"queue", required_argument, NULL, 'Q'},
+		{"uring", no_argument, NULL, 'u'},
+		{"ipv6", no_argument, NULL, '6'},
+		{"rate", required_argument, NULL, 'r'},
+		{"burst", required_argument, NULL, 'b'},
+		{NULL, 0, NULL, 0}
 	};
 
 	while (1) {
-		if ((c = getopt_long(*argc, argv, "p:k:6", long_options, NULL)) == -1)
+		if ((c = getopt_long(*argc, argv, "p:k:T:A:B:w:PV:Q:u6r:b:", long_options, NULL)) == -1)
 			break;
 		switch (c) {
 		case 'p':
@@ -224,10 +834,74 @@ static void parse_args(int *argc, char *argv[])
 			argopts.pubkey = optarg;
 			printf("pubkey='%s'\n", argopts.pubkey);
 			break;
+		case 'T':
+			argopts.trust = optarg;
+			printf("trust='%s'\n", argopts.trust);
+			break;
+		case 'A':
+			argopts.acl = optarg;
+			printf("acl='%s'\n", argopts.acl);
+			break;
+		case 'B':
+			argopts.batch = strtol(optarg, NULL, 10);
+			if (argopts.batch == 0 || argopts.batch > RXBATCH_MAX) {
+				printf("invalid batch size, should be 1-%d\n", RXBATCH_MAX);
+				exit(EXIT_FAILURE);
+			}
+			printf("batch=%u\n", argopts.batch);
+			break;
+		case 'w':
+			argopts.workers = strtol(optarg, NULL, 10);
+			if (argopts.workers <= 0) {
+				puts("invalid number of workers");
+				exit(EXIT_FAILURE);
+			}
+			printf("workers=%d\n", argopts.workers);
+			break;
+		case 'P':
+			argopts.pin = true;
+			puts("pin");
+			break;
+		case 'V':
+			argopts.verifiers = strtol(optarg, NULL, 10);
+			if (argopts.verifiers < 0) {
+				puts("invalid number of verifiers");
+				exit(EXIT_FAILURE);
+			}
+			printf("verifiers=%d\n", argopts.verifiers);
+			break;
+		case 'Q':
+			argopts.queue = strtol(optarg, NULL, 10);
+			if (argopts.queue == 0 || argopts.queue > (1 << 20)) {
+				puts("invalid queue size");
+				exit(EXIT_FAILURE);
+			}
+			printf("queue=%u\n", argopts.queue);
+			break;
+		case 'u':
+			argopts.uring = true;
+			puts("uring");
+			break;
 		case '6':
 			argopts.ipv6 = true;
 			puts("ipv6");
 			break;
+		case 'r':
+			argopts.rate = strtol(optarg, NULL, 10);
+			if (argopts.rate > 1000000) {
+				puts("invalid rate, should be 0-1000000");
+				exit(EXIT_FAILURE);
+			}
+			printf("rate=%u\n", argopts.rate);
+			break;
+		case 'b':
+			argopts.burst = strtol(optarg, NULL, 10);
+			if (argopts.burst == 0 || argopts.burst > 1000000) {
+				puts("invalid burst, should be 1-1000000");
+				exit(EXIT_FAILURE);
+			}
+			printf("burst=%u\n", argopts.burst);
+			break;
 		}
 	}
 }
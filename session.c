@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "auth.h"
+#include "session.h"
+
+#define HMAC_SIZE	(SESSION_TAG_SIZE - sizeof(uint64_t))
+#define KDF_LABEL	"lsd session v1"
+
+_Static_assert((SESSION_SLOTS & (SESSION_SLOTS - 1)) == 0, "SESSION_SLOTS must be a power of two");
+_Static_assert(sizeof(((struct session_reply *)0)->pub) == SESSION_PUB_SIZE,
+		"session reply out of sync");
+
+struct session_kex {
+	EVP_PKEY	*key;
+	unsigned char	pub[SESSION_PUB_SIZE];
+};
+
+/* a session as the server keeps it */
+struct server_session {
+	uint64_t	id;		/* 0 if the slot was never used */
+	uint64_t	client_id;
+	uint64_t	keyid;		/* of the key that signed the handshake */
+	int64_t		expires;
+	unsigned char	key[SESSION_KEY_SIZE];
+};
+
+/*
+ * The low bits of a session id are the index of its slot, the others are
+ * random, so lookups need no hashing or probing. Opening a session takes the
+ * slot of the client's previous session, else a free or expired one, else
+ * the one closest to expiring. Verifiers only read the table.
+ */
+static pthread_rwlock_t sessions_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct server_session sessions[SESSION_SLOTS];
+
+/* generate an X25519 key, storing its public half in $pub */
+static EVP_PKEY *kex_keygen(unsigned char pub[SESSION_PUB_SIZE])
+{
+	size_t len = SESSION_PUB_SIZE;
+	EVP_PKEY *key;
+
+	if ((key = EVP_PKEY_Q_keygen(NULL, NULL, "X25519")) == NULL
+			|| EVP_PKEY_get_raw_public_key(key, pub, &len) != 1) {
+		ERR_print_errors_fp(stderr);
+		EVP_PKEY_free(key);
+		return NULL;
+	}
+	return key;
+}
+
+/*
+ * Derive the key of session $id of $client_id into $out, from the shared
+ * secret of $own and $peer. $cpub and $spub are the public keys of the client
+ * and the server, one of which is $peer.
+ */
+static int derive(EVP_PKEY *own, const unsigned char *peer, const unsigned char *cpub,
+		const unsigned char *spub, uint64_t id, uint64_t client_id,
+		unsigned char out[SESSION_KEY_SIZE])
+{
+	unsigned char secret[32], info[sizeof(KDF_LABEL) + 2 * SESSION_PUB_SIZE + 16], *p;
+	size_t secretlen = sizeof(secret), outlen = SESSION_KEY_SIZE;
+	EVP_PKEY *peerkey;
+	EVP_PKEY_CTX *ctx = NULL;
+	int ok = 0;
+
+	peerkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer, SESSION_PUB_SIZE);
+	if (!peerkey || (ctx = EVP_PKEY_CTX_new(own, NULL)) == NULL
+			|| EVP_PKEY_derive_init(ctx) != 1
+			|| EVP_PKEY_derive_set_peer(ctx, peerkey) != 1
+			|| EVP_PKEY_derive(ctx, secret, &secretlen) != 1)
+		goto out;
+	EVP_PKEY_CTX_free(ctx);
+
+	/* the key is bound to everything the handshake agreed on */
+	p = info;
+	memcpy(p, KDF_LABEL, sizeof(KDF_LABEL));
+	p += sizeof(KDF_LABEL);
+	memcpy(p, cpub, SESSION_PUB_SIZE);
+	p += SESSION_PUB_SIZE;
+	memcpy(p, spub, SESSION_PUB_SIZE);
+	p += SESSION_PUB_SIZE;
+	id = htobe64(id);
+	memcpy(p, &id, sizeof(id));
+	p += sizeof(id);
+	client_id = htobe64(client_id);
+	memcpy(p, &client_id, sizeof(client_id));
+
+	ok = (ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)) != NULL
+		&& EVP_PKEY_derive_init(ctx) == 1
+		&& EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1
+		&& EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, secretlen) == 1
+		&& EVP_PKEY_CTX_add1_hkdf_info(ctx, info, sizeof(info)) == 1
+		&& EVP_PKEY_derive(ctx, out, &outlen) == 1;
+out:
+	if (!ok)
+		ERR_print_errors_fp(stderr);
+	OPENSSL_cleanse(secret, sizeof(secret));
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(peerkey);
+	return ok ? 0 : -1;
+}
+
+struct session_kex *session_kex_new(unsigned char pub[SESSION_PUB_SIZE])
+{
+	struct session_kex *kex;
+
+	if ((kex = calloc(1, sizeof(*kex))) == NULL)
+		return NULL;
+	if ((kex->key = kex_keygen(kex->pub)) == NULL) {
+		free(kex);
+		return NULL;
+	}
+	memcpy(pub, kex->pub, SESSION_PUB_SIZE);
+	return kex;
+}
+
+int session_kex_finish(struct session_kex *kex, uint64_t client_id,
+		const struct session_reply *reply, int64_t now_ms, struct session *s)
+{
+	if (reply->id == 0 || derive(kex->key, reply->pub, kex->pub, reply->pub,
+				reply->id, client_id, s->key) == -1)
+		return -1;
+	s->id = reply->id;
+	s->expires = now_ms + (int64_t)reply->lifetime * 1000;
+	return 0;
+}
+
+void session_kex_free(struct session_kex *kex)
+{
+	if (!kex)
+		return;
+	EVP_PKEY_free(kex->key);
+	free(kex);
+}
+
+/* HMAC-SHA256 of the $size bytes at $buf with session key $key */
+static int session_hmac(const unsigned char *key, const unsigned char *buf, size_t size,
+		unsigned char mac[HMAC_SIZE])
+{
+	unsigned int maclen = HMAC_SIZE;
+
+	return HMAC(EVP_sha256(), key, SESSION_KEY_SIZE, buf, size, mac, &maclen) != NULL;
+}
+
+size_t session_seal(const struct session *s, unsigned char *buf, size_t size)
+{
+	uint16_t tagsize = htobe16(SESSION_TAG_SIZE);
+	uint64_t id = htobe64(s->id);
+	unsigned char *p = buf + size;
+
+	memcpy(p, &tagsize, sizeof(tagsize));
+	p += sizeof(tagsize);
+	memcpy(p, &id, sizeof(id));
+	p += sizeof(id);
+	if (!session_hmac(s->key, buf, size, p))
+		return 0;
+	return size + sizeof(tagsize) + SESSION_TAG_SIZE;
+}
+
+int session_open(uint64_t keyid, uint64_t client_id, const unsigned char *pub, size_t size,
+		int64_t now_ms, struct session_reply *reply)
+{
+	struct server_session *s, *slot = NULL;
+	unsigned char key[SESSION_KEY_SIZE];
+	uint64_t rnd;
+	EVP_PKEY *own;
+
+	if (size != SESSION_PUB_SIZE || (own = kex_keygen(reply->pub)) == NULL)
+		return -1;
+	for (int i = 0; i < SESSION_SLOTS; ++i) {
+		s = &sessions[i];
+		if (s->id && s->client_id == client_id && s->keyid == keyid) {
+			slot = s;
+			break;
+		}
+		if (!slot || (slot->expires > now_ms && s->expires < slot->expires))
+			slot = s;
+	}
+	do {
+		if (RAND_bytes((unsigned char *)&rnd, sizeof(rnd)) != 1)
+			goto err;
+		reply->id = (rnd & ~(uint64_t)(SESSION_SLOTS - 1)) | (slot - sessions);
+	} while (reply->id == 0);
+	if (derive(own, pub, pub, reply->pub, reply->id, client_id, key) == -1)
+		goto err;
+	EVP_PKEY_free(own);
+
+	pthread_rwlock_wrlock(&sessions_lock);
+	slot->id = reply->id;
+	slot->client_id = client_id;
+	slot->keyid = keyid;
+	slot->expires = now_ms + SESSION_LIFETIME_MS;
+	memcpy(slot->key, key, sizeof(key));
+	pthread_rwlock_unlock(&sessions_lock);
+	OPENSSL_cleanse(key, sizeof(key));
+
+	reply->magic = PROTO_MAGIC;
+	reply->lifetime = SESSION_LIFETIME_MS / 1000;
+	PDEBUG("[+] session %016llx opened for client %016llx\n",
+		(unsigned long long)reply->id, (unsigned long long)client_id);
+	return 0;
+err:
+	EVP_PKEY_free(own);
+	return -1;
+}
+
+int session_verify(uint64_t client_id, const unsigned char *buf, size_t size,
+		const unsigned char *tag, size_t taglen, int64_t now_ms, uint64_t *keyid)
+{
+	unsigned char mac[HMAC_SIZE];
+	struct server_session *s;
+	uint64_t id;
+	int ret;
+
+	if (taglen != SESSION_TAG_SIZE)
+		return 0;
+	memcpy(&id, tag, sizeof(id));
+	id = be64toh(id);
+	s = &sessions[id & (SESSION_SLOTS - 1)];
+
+	pthread_rwlock_rdlock(&sessions_lock);
+	if (id == 0 || s->id != id || s->expires <= now_ms)
+		ret = -1;
+	else
+		ret = s->client_id == client_id && session_hmac(s->key, buf, size, mac)
+			&& CRYPTO_memcmp(mac, tag + sizeof(id), HMAC_SIZE) == 0;
+	*keyid = s->keyid;
+	pthread_rwlock_unlock(&sessions_lock);
+	return ret;
+}
+
+/* close session $s, with sessions_lock held for writing */
+static void session_close(struct server_session *s)
+{
+	PDEBUG("[-] session %016llx of key %016llx closed\n",
+		(unsigned long long)s->id, (unsigned long long)s->keyid);
+	s->id = 0;
+	s->expires = 0;
+	OPENSSL_cleanse(s->key, sizeof(s->key));
+}
+
+void session_drop_untrusted(void)
+{
+	pthread_rwlock_wrlock(&sessions_lock);
+	for (int i = 0; i < SESSION_SLOTS; ++i)
+		if (sessions[i].id && !truststore_has(sessions[i].keyid))
+			session_close(&sessions[i]);
+	pthread_rwlock_unlock(&sessions_lock);
+}
+
+void session_drop_key(uint64_t keyid)
+{
+	pthread_rwlock_wrlock(&sessions_lock);
+	for (int i = 0; i < SESSION_SLOTS; ++i)
+		if (sessions[i].id && sessions[i].keyid == keyid)
+			session_close(&sessions[i]);
+	pthread_rwlock_unlock(&sessions_lock);
+}
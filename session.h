@@ -0,0 +1,112 @@
+#ifndef SESSION_H
+#define SESSION_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Sessions spare clients sending a stream of requests to the same server a
+ * signature for each of them, and the server a verification:
+ *
+ * 	1. The client sends a REQ_SESSION request, signed as any other, whose
+ * 	   message is the public half of an ephemeral X25519 key.
+ * 	2. The server answers with a session reply: the id of the new session
+ * 	   and its own ephemeral public key. Both sides derive the session key
+ * 	   from the X25519 shared secret with HKDF-SHA256, over both public
+ * 	   keys, the session id and the client id.
+ * 	3. Requests of the session name algorithm SIG_HMAC_SHA256, and carry
+ * 	   the session id and an HMAC-SHA256 tag of the signed part instead of
+ * 	   a signature. The tag covers the sequence number, so the replay
+ * 	   window of the client id keeps working as it does for signatures.
+ *
+ * Only the signed handshake is trusted: the server reply is not signed, but
+ * whoever tampers with it only ends up with a key the server does not know.
+ * A session belongs to the client id that opened it, under the key that
+ * signed the handshake, which has at most one at a time, and lasts
+ * SESSION_LIFETIME_MS or until that key is no longer trusted.
+ */
+
+#define SESSION_PUB_SIZE	32	/* X25519 public key */
+#define SESSION_KEY_SIZE	32
+#define SESSION_TAG_SIZE	(8 + 32)	/* session id and HMAC-SHA256 */
+#define SESSION_SLOTS		1024	/* sessions open at once, a power of two */
+#define SESSION_LIFETIME_MS	(3600 * 1000)
+
+/* a session as the client keeps it */
+struct session {
+	uint64_t	id;		/* 0 if there is none */
+	int64_t		expires;	/* wall clock time in ms */
+	unsigned char	key[SESSION_KEY_SIZE];
+};
+
+/* ephemeral key of a handshake on the client side */
+struct session_kex;
+
+/*
+ * session_kex_new:
+ * 	Generate the ephemeral key of a handshake, storing its public half in
+ * 	$pub for the message of the REQ_SESSION request. Returns NULL on error.
+ */
+struct session_kex *session_kex_new(unsigned char pub[SESSION_PUB_SIZE]);
+
+/*
+ * session_kex_finish:
+ * 	Derive the key of the session $reply (from the server the handshake of
+ * 	$kex was sent to as $client_id) opened at wall clock time $now_ms
+ * 	into $s. $kex may be used with several servers.
+ * 	Returns -1 on error and 0 on success.
+ */
+int session_kex_finish(struct session_kex *kex, uint64_t client_id,
+		const struct session_reply *reply, int64_t now_ms, struct session *s);
+
+void session_kex_free(struct session_kex *kex);
+
+/*
+ * session_seal:
+ * 	Append the session id and tag of $s to the request packed in the $size
+ * 	bytes at $buf, which names SIG_HMAC_SHA256, as its signature. $buf must
+ * 	have room for them. Returns the size of the sealed request.
+ */
+size_t session_seal(const struct session *s, unsigned char *buf, size_t size);
+
+/*
+ * session_open:
+ * 	Open a session for $client_id, whose handshake signed with key $keyid
+ * 	carried the $size byte public key $pub, at wall clock time $now_ms; any
+ * 	session it had under that key is closed. Fill $reply to send back.
+ * 	Called by one thread at a time.
+ * 	Returns -1 on error and 0 on success.
+ */
+int session_open(uint64_t keyid, uint64_t client_id, const unsigned char *pub, size_t size,
+		int64_t now_ms, struct session_reply *reply);
+
+/*
+ * session_verify:
+ * 	Check the $taglen byte session id and tag in $tag of the $size bytes at
+ * 	$buf, sent by $client_id, at wall clock time $now_ms, storing the key
+ * 	the session was opened with in *$keyid. Safe to call while sessions
+ * 	are opened.
+ * 	Returns 1 if the tag is valid, 0 if it is not, and -1 if the session is
+ * 	unknown or expired.
+ */
+int session_verify(uint64_t client_id, const unsigned char *buf, size_t size,
+		const unsigned char *tag, size_t taglen, int64_t now_ms, uint64_t *keyid);
+
+/*
+ * session_drop_untrusted:
+ * 	Close the sessions opened with keys that are no longer trusted, once
+ * 	the trust store was reloaded. Called by one thread at a time, and not
+ * 	while session_open() is.
+ */
+void session_drop_untrusted(void);
+
+/*
+ * session_drop_key:
+ * 	Close the sessions opened with key $keyid, 0 for the default key, once
+ * 	it was reloaded. Called as session_drop_untrusted() is.
+ */
+void session_drop_key(uint64_t keyid);
+
+#endif /* ifndef SESSION_H */
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+struct stats g_stats;
+
+void stats_dump(FILE *fp)
+{
+	struct rusage ru;
+	double cpu_us = 0;
+	unsigned long n;
+
+	fprintf(fp, "statistics\n==========\n");
+#define X(name, desc) \
+	fprintf(fp, "%-24s %lu\t(%s)\n", #name, STATS_GET(name), desc);
+	STATS_COUNTERS(X)
+#undef X
+
+	/* cpu cost per request, to compare receive backends and modes */
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		cpu_us = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6
+			+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	n = STATS_GET(rx_datagrams);
+	fprintf(fp, "%-24s %.3f s user+sys, %.1f us/datagram, %.2f datagrams/syscall\n",
+		"cpu", cpu_us / 1e6, n ? cpu_us / n : 0.0,
+		STATS_GET(rx_syscalls) ? (double)n / STATS_GET(rx_syscalls) : 0.0);
+	fflush(fp);
+}
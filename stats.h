@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H 1
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+/*
+ * Server counters. Each entry is X(name, description); the list is expanded
+ * into the counter structure and into stats_dump().
+ */
+#define STATS_COUNTERS(X) \
+	X(rx_syscalls,		"receive syscalls") \
+	X(rx_datagrams,		"datagrams received") \
+	X(rx_errors,		"receive errors") \
+	X(admit_malformed,	"datagrams dropped as malformed before verification") \
+	X(admit_limited,	"datagrams dropped by per-source rate limiting") \
+	X(admit_refused,	"requests refused by the source address ACL") \
+	X(verify_failed,	"requests failing signature verification") \
+	X(replay_rejected,	"authentic requests rejected as replayed or stale") \
+	X(session_opened,	"sessions opened by a signed handshake") \
+	X(session_unknown,	"requests of unknown or expired sessions") \
+	X(dedupe_hit,		"copies of recent datagrams answered from the cache") \
+	X(dedupe_miss,		"datagrams not found in the dedupe cache") \
+	X(merkle_cached,	"requests under a Merkle root verified already") \
+	X(notif_shown,		"notification windows opened") \
+	X(notif_suppressed,	"duplicate notifications suppressed") \
+	X(notif_merged,		"notifications merged into another window") \
+	X(notif_dropped,	"notifications dropped, merge buffer full") \
+	X(sched_fired,		"scheduled power commands carried out") \
+	X(sched_superseded,	"scheduled power commands dropped for another one")
+
+struct stats {
+#define X(name, desc)	atomic_ulong name;
+	STATS_COUNTERS(X)
+#undef X
+};
+
+extern struct stats g_stats;
+
+#define STATS_ADD(name, n) \
+	atomic_fetch_add_explicit(&g_stats.name, (n), memory_order_relaxed)
+#define STATS_INC(name)		STATS_ADD(name, 1)
+#define STATS_GET(name) \
+	atomic_load_explicit(&g_stats.name, memory_order_relaxed)
+
+/* stats_dump:	Print all counters to $fp, one per line */
+void stats_dump(FILE *fp);
+
+#endif /* ifndef STATS_H */
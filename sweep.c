@@ -0,0 +1,45 @@
+#include "common.h"
+#include "protocol.h"
+#include "sweep.h"
+
+int sweep_refused(const struct sstate *ack)
+{
+	return ack->ack != ACK_GRANTED && ack->ack != ACK_REPLAYED;
+}
+
+int64_t sweep_left(const struct sstate *ack, int i)
+{
+	return ack->pending[i].due - ack->issued_at * 1000;
+}
+
+void sweep_add(struct sweep *sw, const struct sstate *ack)
+{
+	unsigned int seen = 0;
+	uint16_t powcmd;
+	int64_t left;
+
+	if (sweep_refused(ack)) {
+		++sw->refused;
+		return;
+	}
+	if (!ack->npending) {
+		++sw->idle;
+		return;
+	}
+	for (int i = 0; i < ack->npending; ++i) {
+		powcmd = ack->pending[i].powcmd & ~REQ_FLAG_BITS;
+		if (powcmd > REQ_MAX)
+			continue;
+		left = sweep_left(ack, i);
+		/* a host with several of a type counts once */
+		if (!(seen & 1u << powcmd)) {
+			sw->first[powcmd] = sw->hosts[powcmd] ? MIN(sw->first[powcmd], left) : left;
+			sw->last[powcmd] = sw->hosts[powcmd] ? MAX(sw->last[powcmd], left) : left;
+			++sw->hosts[powcmd];
+		} else {
+			sw->first[powcmd] = MIN(sw->first[powcmd], left);
+			sw->last[powcmd] = MAX(sw->last[powcmd], left);
+		}
+		seen |= 1u << powcmd;
+	}
+}
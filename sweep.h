@@ -0,0 +1,31 @@
+#ifndef SWEEP_H
+#define SWEEP_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * What the hosts queried by a sweep have pending, summed up as they answer,
+ * so nothing of each answer has to be kept. Times left are as each host
+ * sees them, from ack->issued_at, which is in whole seconds.
+ */
+struct sweep {
+	size_t		hosts[REQ_MAX + 1];	/* with a command of each type pending */
+	int64_t		first[REQ_MAX + 1];	/* earliest time left until it is due, ms */
+	int64_t		last[REQ_MAX + 1];
+	size_t		idle;			/* with nothing pending */
+	size_t		refused;		/* not answering the query itself */
+};
+
+/* sweep_refused:	Whether $ack refuses the query rather than answering it */
+int sweep_refused(const struct sstate *ack);
+
+/* sweep_left:	Time left until pending command $i of $ack is due, in ms */
+int64_t sweep_left(const struct sstate *ack, int i);
+
+/* sweep_add:	Add what a host queried answered in $ack to $sw */
+void sweep_add(struct sweep *sw, const struct sstate *ack);
+
+#endif /* ifndef SWEEP_H */
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "targets.h"
+
+static size_t addr_hash(const struct sockaddr_in *addr)
+{
+	uint64_t key = (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+
+	/* Fibonacci hashing, the top bits are the best mixed */
+	return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/* slot of index[] holding $addr, or the free one it would take */
+static size_t lookup(const struct targets *t, const struct sockaddr_in *addr)
+{
+	size_t i = addr_hash(addr) & t->mask;
+
+	while (t->index[i] && !same_addr(&t->v[t->index[i] - 1].addr, addr))
+		i = (i + 1) & t->mask;
+	return i;
+}
+
+/* size index[] for $size hosts and fill it again, at half load at most */
+static int reindex(struct targets *t, size_t size)
+{
+	size_t slots = 16;
+	uint32_t *index;
+
+	while (slots < 2 * size)
+		slots <<= 1;
+	if ((index = calloc(slots, sizeof(*index))) == NULL)
+		return -1;
+	free(t->index);
+	t->index = index;
+	t->mask = slots - 1;
+	for (size_t i = 0; i < t->count; ++i)
+		t->index[lookup(t, &t->v[i].addr)] = i + 1;
+	return 0;
+}
+
+int targets_init(struct targets *t, size_t size)
+{
+	memset(t, 0, sizeof(*t));
+	size = MAX(size, 1);
+	if ((t->v = calloc(size, sizeof(*t->v))) == NULL || reindex(t, size) == -1) {
+		targets_free(t);
+		return -1;
+	}
+	t->size = size;
+	return 0;
+}
+
+void targets_free(struct targets *t)
+{
+	free(t->v);
+	free(t->index);
+	memset(t, 0, sizeof(*t));
+}
+
+struct target *targets_add(struct targets *t, const struct sockaddr_in *addr, uint32_t host,
+		int *added)
+{
+	struct target *v, *tgt;
+	size_t i = lookup(t, addr);
+
+	if (added)
+		*added = !t->index[i];
+	if (t->index[i])
+		return &t->v[t->index[i] - 1];
+	if (t->count == t->size) {
+		if ((v = realloc(t->v, 2 * t->size * sizeof(*v))) == NULL)
+			return NULL;
+		t->v = v;
+		t->size *= 2;
+		if (reindex(t, t->size) == -1)
+			return NULL;
+		i = lookup(t, addr);
+	}
+	tgt = &t->v[t->count];
+	memset(tgt, 0, sizeof(*tgt));
+	tgt->addr = *addr;
+	tgt->host = host;
+	t->index[i] = ++t->count;
+	return tgt;
+}
+
+struct target *targets_find(const struct targets *t, const struct sockaddr_in *addr)
+{
+	size_t i = lookup(t, addr);
+
+	return t->index[i] ? &t->v[t->index[i] - 1] : NULL;
+}
+
+void target_answer(struct target *tgt, const struct sstate *ack)
+{
+	tgt->state = TARGET_ANSWERED;
+	tgt->ack = ack->ack;
+	tgt->failed = ack->failed;
+	tgt->npending = ack->npending;
+	tgt->skew = MAX(MIN(ack->skew, INT32_MAX), INT32_MIN);
+	tgt->fired = ack->fired;
+	tgt->fired_at = ack->fired_at;
+}
+
+int pacer_init(struct pacer *p, size_t nhosts, size_t window, unsigned int ntries, bool sweep)
+{
+	memset(p, 0, sizeof(*p));
+	if ((p->waiting = malloc(2 * MAX(nhosts, 1) * sizeof(*p->waiting))) == NULL)
+		return -1;
+	p->due = p->waiting + nhosts;
+	p->nhosts = nhosts;
+	p->window = window ? window : nhosts;
+	p->ntries = ntries;
+	p->sweep = sweep;
+	return 0;
+}
+
+void pacer_free(struct pacer *p)
+{
+	free(p->waiting);
+	memset(p, 0, sizeof(*p));
+}
+
+int64_t pacer_retry_ms(unsigned int sends)
+{
+	return MIN((int64_t)RETRY_MS << MIN(sends - 1, 16), RETRY_MAX_MS);
+}
+
+int64_t pacer_due(struct pacer *p, struct targets *t, int64_t now, int64_t end,
+		void (*gave_up)(const struct target *))
+{
+	struct target *tgt;
+	int64_t wake = end;
+	size_t nleft = 0;
+
+	p->ndue = 0;
+	for (size_t i = 0; i < p->nwaiting; ++i) {
+		tgt = &t->v[p->waiting[i]];
+		if (tgt->state == TARGET_ANSWERED)
+			continue;
+		/* a sweep moves on to other hosts */
+		if (p->sweep && tgt->sends >= p->ntries && tgt->next <= now) {
+			gave_up(tgt);
+			continue;
+		}
+		p->waiting[nleft++] = p->waiting[i];
+		if (tgt->sends >= p->ntries && !p->sweep)
+			continue;
+		if (tgt->next <= now)
+			p->due[p->ndue++] = p->waiting[i];
+		else
+			wake = MIN(wake, tgt->next);
+	}
+	p->nwaiting = nleft;
+	p->nretry = p->ndue;
+	while (p->unsent < p->nhosts && p->nwaiting < p->window) {
+		p->due[p->ndue++] = p->unsent;
+		p->waiting[p->nwaiting++] = p->unsent++;
+	}
+	return wake;
+}
+
+int64_t pacer_sent(struct pacer *p, struct targets *t, int64_t now, int64_t wake)
+{
+	struct target *tgt;
+
+	for (size_t i = 0; i < p->ndue; ++i) {
+		tgt = &t->v[p->due[i]];
+		tgt->next = now + pacer_retry_ms(tgt->sends);
+		if (tgt->sends < p->ntries || p->sweep)
+			wake = MIN(wake, tgt->next);
+	}
+	return wake;
+}
@@ -0,0 +1,127 @@
+#ifndef TARGETS_H
+#define TARGETS_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+
+/*
+ * The hosts a request is sent to, each tracked until it answers. Hosts are
+ * kept in the order they were added, and found by address through an open
+ * addressing index of half load at most, so acks from tens of thousands of
+ * them are matched in constant time. What is kept of an answer is only what
+ * the client reports, not the whole sstate.
+ */
+
+#define RETRY_MS	500	/* first wait for an ack before sending again */
+#define RETRY_MAX_MS	4000
+
+enum {
+	TARGET_WAITING,		/* sent the request, or about to be */
+	TARGET_ANSWERED,	/* an ack came back */
+	TARGET_BROADCAST,	/* a broadcast address, answered by other hosts */
+};
+
+struct target {
+	struct sockaddr_in	addr;
+	int64_t			next;		/* monotonic ms of the next send */
+	uint32_t		host;		/* index of the request it is sent */
+	uint8_t			state;		/* TARGET_* */
+	uint8_t			sends;		/* times the request was sent */
+	uint8_t			errors;		/* of which the kernel refused */
+	uint8_t			fallback;	/* lost its session, sent signed since */
+	/* of the ack, once answered */
+	uint16_t		ack;
+	uint8_t			failed;		/* 1 + index of the batch command */
+	uint16_t		npending;
+	int32_t			skew;		/* ms, see struct sstate */
+	struct sstate_entry	fired;		/* last command carried out, if id is not 0 */
+	int64_t			fired_at;
+};
+
+struct targets {
+	struct target	*v;
+	size_t		count, size;	/* of v[] */
+	uint32_t	*index;		/* 1 + position in v[], 0 if free */
+	size_t		mask;		/* of index[], a power of two minus one */
+};
+
+/*
+ * targets_init:
+ * 	Make room in $t for $size hosts, more being added as needed.
+ * 	Returns -1 on error and 0 on success.
+ */
+int targets_init(struct targets *t, size_t size);
+
+void targets_free(struct targets *t);
+
+/*
+ * targets_add:
+ * 	Return the host of $t at $addr (address and port), added waiting for
+ * 	request $host if it was not there already; *$added tells which, if not
+ * 	NULL. The pointer is valid until the next host is added.
+ * 	Returns NULL on error.
+ */
+struct target *targets_add(struct targets *t, const struct sockaddr_in *addr, uint32_t host,
+		int *added);
+
+/* targets_find:	Return the host of $t at $addr, or NULL if there is none */
+struct target *targets_find(const struct targets *t, const struct sockaddr_in *addr);
+
+/* target_answer:	Keep what is reported of $ack for $tgt, now answered */
+void target_answer(struct target *tgt, const struct sstate *ack);
+
+/*
+ * Which hosts of a struct targets to send the request to, and when: each
+ * is sent it again while it does not answer, up to ntries times in all,
+ * the wait doubling from RETRY_MS to RETRY_MAX_MS. At most window hosts
+ * wait for an ack at once, the others being sent it for the first time
+ * as those answer. A sweep gives up on a host after the wait following
+ * its last send; otherwise hosts are waited for until the caller stops.
+ */
+struct pacer {
+	uint32_t	*waiting;	/* hosts sent the request, not answered */
+	uint32_t	*due;		/* hosts to send it to now */
+	size_t		nwaiting, ndue;
+	size_t		nretry;		/* of the hosts due, those sent it before */
+	size_t		unsent;		/* hosts from here on were never sent it */
+	size_t		nhosts, window;
+	unsigned int	ntries;
+	bool		sweep;
+};
+
+/*
+ * pacer_init:
+ * 	Set up $p for the $nhosts hosts of a struct targets, with at most
+ * 	$window (all of them if 0) waiting at once and $ntries sends to each,
+ * 	giving up on hosts if $sweep. Returns -1 on error and 0 on success.
+ */
+int pacer_init(struct pacer *p, size_t nhosts, size_t window, unsigned int ntries, bool sweep);
+
+void pacer_free(struct pacer *p);
+
+/*
+ * pacer_due:
+ * 	Forget the hosts of $t that answered, and in a sweep those given up on
+ * 	by monotonic time $now, in ms, calling $gave_up with each. Then list in
+ * 	p->due the hosts to send the request to now: those waiting whose wait
+ * 	is over, and as many never sent it as the window has room for.
+ * 	Returns when the wait of the first other host is over, or $end.
+ */
+int64_t pacer_due(struct pacer *p, struct targets *t, int64_t now, int64_t end,
+		void (*gave_up)(const struct target *));
+
+/*
+ * pacer_sent:
+ * 	Start the wait of the hosts in p->due, sent the request at $now.
+ * 	Returns when the first of those waits is over, or $wake if earlier.
+ */
+int64_t pacer_sent(struct pacer *p, struct targets *t, int64_t now, int64_t wake);
+
+/* pacer_retry_ms:	How long to wait for an ack after the $sends-th send to a host */
+int64_t pacer_retry_ms(unsigned int sends);
+
+#endif /* ifndef TARGETS_H */
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "tx.h"
+
+#define TX_WAIT_MS	100	/* wait for room in the socket buffer */
+#define TX_BACKOFF_MS	10	/* wait for room in the device queue */
+#define TX_MAX_STALLS	10	/* waits for a message before it is skipped */
+
+int txvec_init(struct txvec *v, size_t size)
+{
+	memset(v, 0, sizeof(*v));
+	v->msgs = calloc(size, sizeof(*v->msgs));
+	v->iovs = calloc(size, sizeof(*v->iovs));
+	if (!v->msgs || !v->iovs) {
+		txvec_free(v);
+		return -1;
+	}
+	v->size = size;
+	return 0;
+}
+
+void txvec_free(struct txvec *v)
+{
+	free(v->msgs);
+	free(v->iovs);
+	memset(v, 0, sizeof(*v));
+}
+
+int txvec_add(struct txvec *v, const void *buf, size_t len, const struct sockaddr *addr,
+		socklen_t addrlen)
+{
+	struct mmsghdr *m;
+
+	if (v->count == v->size)
+		return -1;
+	v->iovs[v->count].iov_base = (void *)buf;
+	v->iovs[v->count].iov_len = len;
+	m = &v->msgs[v->count];
+	memset(m, 0, sizeof(*m));
+	m->msg_hdr.msg_name = (void *)addr;
+	m->msg_hdr.msg_namelen = addrlen;
+	m->msg_hdr.msg_iov = &v->iovs[v->count];
+	m->msg_hdr.msg_iovlen = 1;
+	v->count++;
+	return 0;
+}
+
+void txvec_clear(struct txvec *v)
+{
+	v->count = 0;
+}
+
+size_t txvec_send(struct txvec *v, int sockfd)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+	size_t i = 0;
+	int n, stalls = 0;
+
+	v->sent = v->failed = 0;
+	v->syscalls = 0;
+	v->error = 0;
+	for (size_t j = 0; j < v->count; ++j)
+		v->msgs[j].msg_len = 0;
+	while (i < v->count) {
+		n = sendmmsg(sockfd, &v->msgs[i], MIN(v->count - i, TXBATCH_MAX), 0);
+		v->syscalls++;
+		if (n > 0) {
+			/* the rest of a partly sent batch goes with the next call */
+			v->sent += n;
+			i += n;
+			stalls = 0;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		/* the socket buffer or the device queue is full, wait for room */
+		if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				&& ++stalls <= TX_MAX_STALLS) {
+			if (errno == ENOBUFS)
+				poll(NULL, 0, TX_BACKOFF_MS);	/* poll() cannot tell */
+			else
+				poll(&pfd, 1, TX_WAIT_MS);
+			continue;
+		}
+		/* only the first message of the call failed, skip it */
+		v->error = errno;
+		v->failed++;
+		i++;
+		stalls = 0;
+	}
+	return v->sent;
+}
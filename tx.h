@@ -0,0 +1,58 @@
+#ifndef TX_H
+#define TX_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define TXBATCH_MAX	1024	/* sendmmsg() limit on messages per call */
+
+/*
+ * Datagrams sent to many hosts with as few sendmmsg() calls as the kernel
+ * allows. txvec_add() points a message header at a buffer of the caller,
+ * which may be shared by every message, and its destination; the vector is
+ * only built once for a request sent to all of them.
+ */
+struct txvec {
+	struct mmsghdr	*msgs;		/* msg_len is set by txvec_send() */
+	struct iovec	*iovs;
+	size_t		size;		/* number of messages */
+	size_t		count;		/* messages added */
+	/* by the last txvec_send() */
+	size_t		sent, failed;
+	unsigned int	syscalls;
+	int		error;		/* errno of the last message that failed */
+};
+
+/*
+ * txvec_init:
+ * 	Allocate room for $size messages in $v. Returns -1 on error and 0 on
+ * 	success.
+ */
+int txvec_init(struct txvec *v, size_t size);
+
+void txvec_free(struct txvec *v);
+
+/*
+ * txvec_add:
+ * 	Add a message of the $len bytes at $buf for $addr, both of which have
+ * 	to stay put until it is sent. Returns -1 if $v is full and 0 on success.
+ */
+int txvec_add(struct txvec *v, const void *buf, size_t len, const struct sockaddr *addr,
+		socklen_t addrlen);
+
+/* txvec_clear:	Drop every message of $v, to add others */
+void txvec_clear(struct txvec *v);
+
+/*
+ * txvec_send:
+ * 	Send every message of $v on $sockfd, TXBATCH_MAX per syscall. Calls
+ * 	sending part of a batch are resumed where they stopped, a full socket
+ * 	buffer is waited for, and a message that cannot be sent is skipped with
+ * 	its msg_len left 0.
+ * 	Returns the number of messages sent, also stored in v->sent.
+ */
+size_t txvec_send(struct txvec *v, int sockfd);
+
+#endif /* ifndef TX_H */
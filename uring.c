@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "stats.h"
+#include "uring.h"
+
+/* IORING_REGISTER_PBUF_RING is an enum; it came in before multishot receive */
+#ifdef IORING_RECV_MULTISHOT
+
+#define URING_ENTRIES	8
+#define URING_BGID	0	/* id of our provided-buffer group */
+
+/*
+ * Each provided buffer receives a struct io_uring_recvmsg_out, the source
+ * address, the control messages and then the payload.
+ */
+#define URING_BUFSIZE	(sizeof(struct io_uring_recvmsg_out) \
+		+ sizeof(struct sockaddr_storage) + RXCTRL_SIZE + RXBUF_SIZE)
+
+struct uring {
+	int			fd;
+	int			sockfd;
+	uring_handler		handler;
+	/* submission queue */
+	void			*sq_ptr;
+	size_t			sq_len;
+	atomic_uint		*sq_head, *sq_tail, *sq_flags;
+	unsigned int		*sq_mask, *sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_len;
+	/* completion queue */
+	void			*cq_ptr;
+	size_t			cq_len;
+	atomic_uint		*cq_head, *cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+	/* provided buffers */
+	struct io_uring_buf_ring *br;
+	size_t			br_len;
+	unsigned int		nbufs;
+	unsigned char		*bufs;
+	/* template for the multishot recvmsg: only the lengths are used */
+	struct msghdr		msg;
+	int			armed;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+		unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* hand buffer $bid back to the kernel */
+static void recycle_buf(struct uring *ring, unsigned short bid)
+{
+	unsigned short tail = atomic_load_explicit((_Atomic unsigned short *)&ring->br->tail,
+			memory_order_relaxed);
+	struct io_uring_buf *buf = &ring->br->bufs[tail & (ring->nbufs - 1)];
+
+	buf->addr = (unsigned long)(ring->bufs + (size_t)bid * URING_BUFSIZE);
+	buf->len = URING_BUFSIZE;
+	buf->bid = bid;
+	atomic_store_explicit((_Atomic unsigned short *)&ring->br->tail, tail + 1,
+			memory_order_release);
+}
+
+/* queue and submit the multishot receive */
+static int post_recv(struct uring *ring)
+{
+	unsigned int tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ring->sockfd;
+	sqe->addr = (unsigned long)&ring->msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	ring->sq_array[idx] = idx;
+	atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+
+	STATS_INC(rx_syscalls);
+	if (io_uring_enter(ring->fd, 1, 0, 0) != 1)
+		return -1;
+	ring->armed = 1;
+	return 0;
+}
+
+struct uring *uring_setup(int sockfd, unsigned int nbufs, uring_handler handler)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct uring *ring;
+	unsigned int n = 1;
+
+	if ((ring = calloc(1, sizeof(*ring))) == NULL)
+		return NULL;
+	ring->fd = -1;
+	ring->sockfd = sockfd;
+	ring->handler = handler;
+	while (n < nbufs)
+		n <<= 1;
+
+	/*
+	 * Every buffer handed out can have a completion waiting, so the
+	 * completion queue must hold at least that many or it overflows.
+	 */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 2 * n;
+	if ((ring->fd = io_uring_setup(URING_ENTRIES, &p)) == -1)
+		goto err;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		goto err;
+	}
+
+	/* single mmap for both rings, sized for the larger of the two */
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring->cq_len > ring->sq_len)
+		ring->sq_len = ring->cq_len;
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto err;
+	}
+	ring->cq_ptr = ring->sq_ptr;
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+	ring->sq_head = (void *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (void *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_flags = (void *)((char *)ring->sq_ptr + p.sq_off.flags);
+	ring->sq_mask = (void *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (void *)((char *)ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (void *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (void *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (void *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (void *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+	/* provided-buffer ring, fails with EINVAL on kernels before 5.19 */
+	ring->nbufs = n;
+	ring->br_len = n * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ring->br == MAP_FAILED) {
+		ring->br = NULL;
+		goto err;
+	}
+	if ((ring->bufs = malloc(n * URING_BUFSIZE)) == NULL)
+		goto err;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->br;
+	reg.ring_entries = n;
+	reg.bgid = URING_BGID;
+	if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		goto err;
+	for (unsigned int i = 0; i < n; ++i)
+		recycle_buf(ring, i);
+
+	ring->msg.msg_namelen = sizeof(struct sockaddr_storage);
+	ring->msg.msg_controllen = RXCTRL_SIZE;
+	/* multishot recvmsg needs 6.0; older kernels reject it here */
+	if (post_recv(ring) == -1)
+		goto err;
+	PDEBUG("[+] io_uring: %u buffers of %zu bytes\n", n, URING_BUFSIZE);
+
+	return ring;
+err:
+	n = errno;
+	uring_free(ring);
+	errno = n;
+	return NULL;
+}
+
+int uring_fd(struct uring *ring)
+{
+	return ring->fd;
+}
+
+int uring_reap(struct uring *ring)
+{
+	struct io_uring_recvmsg_out *out;
+	struct io_uring_cqe *cqe;
+	struct msghdr ctrl = { 0 };
+	struct rxslot slot;
+	unsigned int head, tail;
+	unsigned short bid;
+	unsigned char *buf;
+	int handled = 0;
+	int64_t stamp;
+
+	head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+	tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+	stamp = rx_stamp();
+	for (; head != tail; ++head) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			ring->armed = 0;	/* kernel ended the multishot receive */
+		if (cqe->res < 0) {
+			/* -ENOBUFS: all buffers in use, re-posted below */
+			if (cqe->res != -ENOBUFS) {
+				STATS_INC(rx_errors);
+				fprintf(stderr, "io_uring recvmsg: %s\n", strerror(-cqe->res));
+			}
+			continue;
+		}
+		if (!(cqe->flags & IORING_CQE_F_BUFFER))
+			continue;
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = ring->bufs + (size_t)bid * URING_BUFSIZE;
+		out = (struct io_uring_recvmsg_out *)buf;
+
+		/* the datagram is handled in place, straight out of the buffer */
+		slot.buf = buf + sizeof(*out) + ring->msg.msg_namelen + ring->msg.msg_controllen;
+		slot.len = MIN(out->payloadlen, RXBUF_SIZE);
+		slot.addrlen = MIN(out->namelen, sizeof(slot.addr));
+		memcpy(&slot.addr, buf + sizeof(*out), slot.addrlen);
+		ctrl.msg_control = buf + sizeof(*out) + ring->msg.msg_namelen;
+		ctrl.msg_controllen = out->controllen;
+		slot.dst = rx_dst(&ctrl);
+		slot.sockfd = ring->sockfd;
+		slot.stamp = stamp;
+		STATS_INC(rx_datagrams);
+		ring->handler(&slot);
+		recycle_buf(ring, bid);
+		++handled;
+	}
+	atomic_store_explicit(ring->cq_head, head, memory_order_release);
+
+	/* completions that did not fit are only flushed by io_uring_enter() */
+	if (atomic_load_explicit(ring->sq_flags, memory_order_relaxed)
+			& IORING_SQ_CQ_OVERFLOW) {
+		STATS_INC(rx_syscalls);
+		io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+	}
+	if (!ring->armed && post_recv(ring) == -1)
+		perror("io_uring: re-posting receive");
+	return handled;
+}
+
+int uring_wait(struct uring *ring)
+{
+	STATS_INC(rx_syscalls);
+	return io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+}
+
+void uring_free(struct uring *ring)
+{
+	if (!ring)
+		return;
+	if (ring->fd != -1)
+		close(ring->fd);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->br)
+		munmap(ring->br, ring->br_len);
+	free(ring->bufs);
+	free(ring);
+}
+
+#else /* kernel headers without multishot receive */
+
+struct uring *uring_setup(int sockfd, unsigned int nbufs, uring_handler handler)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+int uring_fd(struct uring *ring)
+{
+	return -1;
+}
+
+int uring_reap(struct uring *ring)
+{
+	return 0;
+}
+
+int uring_wait(struct uring *ring)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void uring_free(struct uring *ring)
+{
+}
+
+#endif
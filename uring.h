@@ -0,0 +1,47 @@
+#ifndef URING_H
+#define URING_H 1
+
+#include "rx.h"
+
+/*
+ * io_uring receive backend. A multishot recvmsg stays posted on the socket
+ * and the kernel picks a buffer from a provided-buffer ring for every
+ * datagram, so under load receiving needs no syscalls at all: completions
+ * are read from shared memory and buffers handed back the same way.
+ *
+ * Only built if the kernel headers know about multishot receive; otherwise
+ * uring_setup() always fails with ENOSYS.
+ */
+
+struct uring;
+
+/* uring_handler:	Called for every received datagram; $slot->buf is only
+ * 			valid until it returns. */
+typedef void (*uring_handler)(struct rxslot *slot);
+
+/*
+ * uring_setup:
+ * 	Create a ring receiving from $sockfd into $nbufs provided buffers
+ * 	(rounded up to a power of two) and post the multishot receive.
+ * 	Returns NULL with errno set if io_uring is unavailable or fails, in
+ * 	which case the caller should use the recvmmsg() path.
+ */
+struct uring *uring_setup(int sockfd, unsigned int nbufs, uring_handler handler);
+
+/* uring_fd:	File descriptor that polls readable when completions are queued */
+int uring_fd(struct uring *ring);
+
+/*
+ * uring_reap:
+ * 	Run the handler for every queued completion and return the buffers to
+ * 	the kernel, re-posting the receive if the kernel ended it.
+ * 	Returns the number of datagrams handled.
+ */
+int uring_reap(struct uring *ring);
+
+/* uring_wait:	Block until at least one completion is queued */
+int uring_wait(struct uring *ring);
+
+void uring_free(struct uring *ring);
+
+#endif /* ifndef URING_H */